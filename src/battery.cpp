@@ -19,41 +19,56 @@
 
 #include <stdio.h>
 #include <string>
+#include "hardware/sync.h"
 #include "include/battery.h"
+#include "include/cancore.h"
 #include "include/pack.h"
 #include "include/io.h"
 #include "include/statemachine.h"
 #include "settings.h"
 
+#define SNAPSHOT_BENCHMARK_READS 100                // Snapshot reads timed by print()
 
-struct repeating_timer pollPackTimer;
 
 // Send request to each pack to ask for a data update
-bool poll_packs_for_data(struct repeating_timer *t) {
+void poll_packs_for_data() {
     extern Battery battery;
     battery.request_data();
-    return true;
 }
 
-// Handle the CAN messages that come back from the battery modules
-
-struct repeating_timer handleInboundCANMessagesTimer;
-
-bool handle_inbound_CAN_messages(struct repeating_timer *t) {
+// Handle the CAN messages that come back from the battery modules. Posted
+// whenever a pack port reads a frame, and run every 5ms in case a post is
+// missed.
+void handle_inbound_CAN_messages() {
     extern Battery battery;
     battery.read_message();
-    return true;
 }
 
 
-Battery::Battery(Io* _io) {
-    voltage = 0;
-    lowestCellVoltage = 0;
-    highestCellVoltage = 0;
-    lowestSensorTemperature = 0;
-    highestSensorTemperature = 0;
-    numPacks = NUM_PACKS;
+Battery::Battery(Io* _io, CellStore* _cells, CellStats* _stats) {
+    pending.voltage = 0;
+    pending.lowestCellVoltage = 0;
+    pending.highestCellVoltage = 0;
+    pending.cellDelta = 0;
+    pending.voltageDeltaBetweenPacks = 0;
+    pending.hasEmptyCell = false;
+    pending.hasFullCell = false;
+    pending.lowestSensorTemperature = 0;
+    pending.highestSensorTemperature = 0;
+    pending.time = Timestamp();
+    pending.newestFrameTime = Timestamp();
+    published[0] = pending;
+    published[1] = pending;
+    sequence = 0;
+    snapshotRetryCount = 0;
+    recomputeCount = 0;
+    decodePassCount = 0;
+    lastRecomputeCount = 0;
+    lastDecodePassCount = 0;
+    lastPrintTime = Timestamp();
     io = _io;
+    cells = _cells;
+    stats = _stats;
 }
 
 // Create all battery packs and modules
@@ -61,11 +76,11 @@ void Battery::initialise(Bms* _bms) {
 
     bms = _bms;
 
-    for ( int p = 0; p < numPacks; p++ ) {
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
         printf("[battery] Initialising battery pack %d (CS:%d, inh:%d, mod/pack:%d, cell/mod:%d, T/mod:%d)\n",
             p, CS_PINS[p], INHIBIT_CONTACTOR_PINS[p], MODULES_PER_PACK, CELLS_PER_MODULE, TEMPS_PER_MODULE);
         packs[p] = BatteryPack(p, CS_PINS[p], INHIBIT_CONTACTOR_PINS[p],
-            CONTACTOR_FEEDBACK_PINS[p], MODULES_PER_PACK, CELLS_PER_MODULE, TEMPS_PER_MODULE, canMutex, bms);
+            CONTACTOR_FEEDBACK_PINS[p], cells, stats, canMutex, bms);
         packs[p].set_battery(this);
         printf("[battery] Initialisation of battery pack %d complete\n", p);
     }
@@ -76,21 +91,50 @@ void Battery::initialise(Bms* _bms) {
 
     // Enable polling of packs for voltage/temperature data
     printf("[battery] Enabling polling of packs for data\n");
-    add_repeating_timer_ms(100, poll_packs_for_data, NULL, &pollPackTimer);
-    add_repeating_timer_ms(5, handle_inbound_CAN_messages, NULL, &handleInboundCANMessagesTimer);
+    add_can_task("poll packs", poll_packs_for_data, TASK_CONTROL, milliseconds(POLL_INTERVAL_MS),
+        milliseconds(POLL_INTERVAL_MS));
+    int decodeTask = add_can_task("decode packs", handle_inbound_CAN_messages, TASK_CONTROL, milliseconds(5),
+        milliseconds(5));
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
+        packs[p].set_rx_task(get_can_scheduler(), decodeTask);
+    }
 }
 
 //
 int Battery::print() {
-    for ( int p = 0; p < numPacks; p++ ) {
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
         packs[p].print();
     }
+    cells->print();
+    stats->print();
+    // Decode passes with new data are what used to trigger a recalculation
+    Timestamp now = monotonic_now();
+    uint32_t elapsedMs = ( now - lastPrintTime ).as_ms();
+    if ( lastPrintTime.is_set() && elapsedMs > 0 ) {
+        printf("[battery] recomputes:%lu/s decode passes:%lu/s\n",
+            ( recomputeCount - lastRecomputeCount ) * 1000 / elapsedMs,
+            ( decodePassCount - lastDecodePassCount ) * 1000 / elapsedMs);
+    }
+    lastRecomputeCount = recomputeCount;
+    lastDecodePassCount = decodePassCount;
+    lastPrintTime = now;
+
+    // What it costs a reader to take a copy of the snapshot
+    uint64_t readStartTime = time_us_64();
+    for ( int i = 0; i < SNAPSHOT_BENCHMARK_READS; i++ ) {
+        get_snapshot();
+    }
+    uint32_t readMeanNs = ( time_us_64() - readStartTime ) * 1000 / SNAPSHOT_BENCHMARK_READS;
+    printf("[battery] snapshot read mean:%luns retries:%lu\n", readMeanNs, snapshotRetryCount);
     return 0;
 }
 
-// Send messages to all packs to request voltage/temperature data
+// Send messages to all packs to request voltage/temperature data. Anything
+// left over from the last cycle, such as modules that didn't answer in full,
+// is recalculated first.
 void Battery::request_data() {
-    for ( int p = 0; p < numPacks; p++ ) {
+    recompute();
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
         packs[p].request_data();
     }
 }
@@ -99,22 +143,90 @@ void Battery::request_data() {
  * Check for and read messages from each pack
  */
 void Battery::read_message() {
-    for ( int p = 0; p < numPacks; p++ ) {
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
+        uint32_t decodedBefore = packs[p].get_decode_frame_count();
         packs[p].read_message();
+        if ( packs[p].get_decode_frame_count() != decodedBefore ) {
+            decodePassCount++;
+        }
+    }
+}
+
+/*
+ * Recalculate the battery figures from everything decoded since the last
+ * recompute, then publish them as the new snapshot. Does nothing if no new
+ * readings have come in.
+ */
+void Battery::recompute() {
+    uint8_t changed = 0;
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
+        changed |= packs[p].recompute();
+    }
+    if ( changed == 0 ) {
+        return;
+    }
+    if ( changed & PACK_TEMPERATURES_CHANGED ) {
+        process_temperature_update();
+    }
+    if ( changed & PACK_VOLTAGES_CHANGED ) {
+        process_voltage_update();
+    }
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
+        if ( packs[p].get_newest_frame_time() > pending.newestFrameTime ) {
+            pending.newestFrameTime = packs[p].get_newest_frame_time();
+        }
+    }
+    pending.time = monotonic_now();
+    publish_snapshot();
+    recomputeCount++;
+}
+
+/*
+ * Make pending the snapshot everyone else sees. There are two copies, and the
+ * sequence is bumped before each one is written, so whichever copy
+ * sequence & 1 points at is never the one being written. Only recompute()
+ * writes, from the CAN timers, so there is only ever one writer.
+ */
+void Battery::publish_snapshot() {
+    sequence = sequence + 1;
+    __dmb();
+    published[0] = pending;
+    __dmb();
+    sequence = sequence + 1;
+    __dmb();
+    published[1] = pending;
+    __dmb();
+}
+
+/*
+ * Copy out the latest snapshot without taking a lock, so this is safe from
+ * any timer callback or either core. If a publish got in while copying, the
+ * copy may be torn, so start again.
+ */
+BatterySnapshot Battery::get_snapshot() {
+    while ( true ) {
+        uint32_t start = sequence;
+        __dmb();
+        BatterySnapshot copy = published[start & 1];
+        __dmb();
+        if ( sequence == start ) {
+            return copy;
+        }
+        snapshotRetryCount++;
     }
 }
 
 //
 void Battery::send_test_message() {
     printf("[battery] Sending test messages to all packs\n");
-    for ( int p = 0; p < numPacks; p++ ) {
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
         can_frame fr;
         fr.can_id = 0x000;
         fr.can_dlc = 3;
         fr.data[0] = 0x7E;
         fr.data[1] = 0x57;
         fr.data[2] = p;
-        packs[p].send_frame(&fr);
+        packs[p].send_frame(&fr, CAN_TX_TELEMETRY);
     }
 }
 
@@ -127,23 +239,18 @@ void Battery::send_test_message() {
 
 // Return the voltage of the whole battery
 uint32_t Battery::get_voltage() {
-    return voltage;
+    return get_snapshot().voltage;
 }
 
 // Recompute and store the battery voltage based on current cell voltages
 void Battery::recalculate_voltage() {
     uint32_t newVoltage = 0;
-    for ( int p = 0; p < numPacks; p++ ) {
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
         if ( packs[p].get_voltage() > newVoltage ) {
             newVoltage = packs[p].get_voltage();
         }
     }
-    voltage = newVoltage;
-}
-
-// Recompute the difference between the highest and lowest cell voltage
-void Battery::recalculate_cell_delta() {
-    cellDelta = highestCellVoltage - lowestCellVoltage;
+    pending.voltage = newVoltage;
 }
 
 // Return the maximum allowed voltage of the whole battery
@@ -159,8 +266,8 @@ uint32_t Battery::get_min_voltage() {
 // Return the id of the pack that has the highest voltage
 int Battery::get_index_of_high_pack() {
     int high_pack_index = 0;
-    float high_pack_voltage = 0.0f;
-    for ( int p = 0; p < numPacks; p++ ) {
+    millivolts_t high_pack_voltage = 0;
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
         if ( packs[p].get_voltage() > high_pack_voltage ) {
             high_pack_index = p;
             high_pack_voltage = packs[p].get_voltage();
@@ -172,8 +279,8 @@ int Battery::get_index_of_high_pack() {
 // Return the id of the pack that has the lowest voltage
 int Battery::get_index_of_low_pack() {
     int low_pack_index = 0;
-    uint32_t low_pack_voltage = 1000;
-    for ( int p = 0; p < numPacks; p++ ) {
+    millivolts_t low_pack_voltage = 1000;
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
         if ( packs[0].get_voltage() < low_pack_voltage ) {
             low_pack_index = p;
             low_pack_voltage = packs[p].get_voltage();
@@ -183,19 +290,26 @@ int Battery::get_index_of_low_pack() {
 }
 
 /*
- * We have new cell voltage data. Process it.
+ * We have new cell voltage data. Process it. The packs keep their own voltage
+ * and lowest/highest cells up to date, so this only has to look at a few
+ * values per pack.
  */
 void Battery::process_voltage_update() {
-    // Do processing for each pack
-    for ( int p = 0; p < numPacks; p++ ) {
-        packs[p].process_voltage_update();
-    }
-    // Do processing for overall battery
     recalculate_voltage();
-    recalculate_cell_delta();
     recalculate_lowest_cell_voltage();
     recalculate_highest_cell_voltage();
-    if ( !packs_are_imbalanced() ) {
+    pending.cellDelta = 0;
+    pending.hasEmptyCell = false;
+    pending.hasFullCell = false;
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
+        if ( packs[p].get_cell_delta() > pending.cellDelta ) {
+            pending.cellDelta = packs[p].get_cell_delta();
+        }
+        pending.hasEmptyCell |= packs[p].has_empty_cell();
+        pending.hasFullCell |= packs[p].has_full_cell();
+    }
+    pending.voltageDeltaBetweenPacks = voltage_delta_between_packs();
+    if ( pending.voltageDeltaBetweenPacks < SAFE_VOLTAGE_DELTA_BETWEEN_PACKS ) {
         this->bms->pack_voltages_match_heartbeat();
     }
 }
@@ -206,7 +320,7 @@ void Battery::process_voltage_update() {
 // Recompute the lowest cell voltage across the whole battery
 void Battery::recalculate_lowest_cell_voltage() {
     uint16_t newLowestCellVoltage = 10000;
-    for ( int p = 1; p < numPacks; p++ ) {
+    for ( int p = 1; p < NUM_PACKS; p++ ) {
         if ( packs[p].get_lowest_cell_voltage() < newLowestCellVoltage ) {
             newLowestCellVoltage = packs[p].get_lowest_cell_voltage();
         }
@@ -215,21 +329,16 @@ void Battery::recalculate_lowest_cell_voltage() {
     if ( newLowestCellVoltage < CELL_EMPTY_VOLTAGE || newLowestCellVoltage > CELL_FULL_VOLTAGE ) {
         bms->set_internal_error();
     }
-    lowestCellVoltage = newLowestCellVoltage;
+    pending.lowestCellVoltage = newLowestCellVoltage;
 }
 
 uint16_t Battery::get_lowest_cell_voltage() {
-    return lowestCellVoltage;
+    return get_snapshot().lowestCellVoltage;
 }
 
 // Return true if any cell in the battery is below the minimum voltage level
 bool Battery::has_empty_cell() {
-    for ( int p = 0; p < numPacks; p++ ) {
-        if ( packs[p].has_empty_cell() ) {
-            return true;
-        }
-    }
-    return false;
+    return get_snapshot().hasEmptyCell;
 }
 
 // High cells
@@ -237,7 +346,7 @@ bool Battery::has_empty_cell() {
 // Recompute the highest cell voltage
 void Battery::recalculate_highest_cell_voltage() {
     uint16_t newHighestCellVoltage = 0;
-    for ( int p = 0; p < numPacks; p++ ) {
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
         if ( packs[p].get_highest_cell_voltage() > newHighestCellVoltage ) {
             newHighestCellVoltage = packs[p].get_highest_cell_voltage();
         }
@@ -246,21 +355,16 @@ void Battery::recalculate_highest_cell_voltage() {
     if ( newHighestCellVoltage < CELL_EMPTY_VOLTAGE || newHighestCellVoltage > CELL_FULL_VOLTAGE ) {
         bms->set_internal_error();
     }
-    highestCellVoltage = newHighestCellVoltage;
+    pending.highestCellVoltage = newHighestCellVoltage;
 }
 
 uint16_t Battery::get_highest_cell_voltage() {
-    return highestCellVoltage;
+    return get_snapshot().highestCellVoltage;
 }
 
 // Return true if any cell in the battery is below the minimum voltage level
 bool Battery::has_full_cell() {
-    for ( int p = 0; p < numPacks; p++ ) {
-        if ( packs[p].has_full_cell() ) {
-            return true;
-        }
-    }
-    return false;
+    return get_snapshot().hasFullCell;
 }
 
 /*
@@ -269,8 +373,8 @@ bool Battery::has_full_cell() {
 uint32_t Battery::voltage_delta_between_packs() {
     uint32_t highestPackVoltage = 0;
     uint32_t lowestPackVoltage = 1000000; // 1000V
-    for ( int p = 0; p < numPacks; p++ ) {
-        float packVoltage = packs[p].get_voltage();
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
+        millivolts_t packVoltage = packs[p].get_voltage();
         if ( packVoltage > highestPackVoltage ) {
             highestPackVoltage = packVoltage;
         }
@@ -284,7 +388,7 @@ uint32_t Battery::voltage_delta_between_packs() {
 // return the battery pack which has the highest voltage
 BatteryPack* Battery::get_pack_with_highest_voltage() {
     BatteryPack* pack = &packs[0];
-    for ( int p = 1; p < numPacks; p++ ) {
+    for ( int p = 1; p < NUM_PACKS; p++ ) {
         if ( packs[p].get_voltage() > pack->get_voltage() ) {
             pack = &packs[p];
         }
@@ -295,7 +399,7 @@ BatteryPack* Battery::get_pack_with_highest_voltage() {
 // Return true if the voltage difference between any two packs is too high and
 // therefore it's unstafe to close the contactors.
 bool Battery::packs_are_imbalanced() {
-    return voltage_delta_between_packs() >= SAFE_VOLTAGE_DELTA_BETWEEN_PACKS;
+    return get_snapshot().voltageDeltaBetweenPacks >= SAFE_VOLTAGE_DELTA_BETWEEN_PACKS;
 }
 
 
@@ -303,13 +407,7 @@ bool Battery::packs_are_imbalanced() {
  * Return the largest cell delta of any pack in the battery.
  */
 uint8_t Battery::get_cell_delta() {
-    uint8_t cellDelta = 0;
-    for ( int p = 0; p < numPacks; p++ ) {
-        if ( packs[p].get_cell_delta() > cellDelta ) {
-            cellDelta = packs[p].get_cell_delta();
-        }
-    }
-    return cellDelta;
+    return get_snapshot().cellDelta;
 }
 
 //// ----
@@ -319,8 +417,8 @@ uint8_t Battery::get_cell_delta() {
 //// ----
 
 void Battery::update_highest_sensor_temperature() {
-    float newHighestSensorTemperature = packs[0].get_highest_temperature();
-    for ( int p = 1; p < numPacks; p++ ) {
+    int8_t newHighestSensorTemperature = packs[0].get_highest_temperature();
+    for ( int p = 1; p < NUM_PACKS; p++ ) {
         if ( packs[p].get_highest_temperature() > newHighestSensorTemperature ) {
             newHighestSensorTemperature = packs[p].get_highest_temperature();
         }
@@ -329,21 +427,21 @@ void Battery::update_highest_sensor_temperature() {
     if ( newHighestSensorTemperature < -20 || newHighestSensorTemperature > 50 ) {
         bms->set_internal_error();
     }
-    this->highestSensorTemperature = newHighestSensorTemperature;
+    pending.highestSensorTemperature = newHighestSensorTemperature;
 }
 
 int8_t Battery::get_highest_sensor_temperature() {
-    return highestSensorTemperature;
+    return get_snapshot().highestSensorTemperature;
 }
 
 // Return true if any sensor in the pack is over the max temperature
 bool Battery::too_hot() {
-    return highestSensorTemperature >= MAXIMUM_TEMPERATURE;
+    return get_snapshot().too_hot();
 }
 
 void Battery::update_lowest_sensor_temperature() {
-    float newLowestSensorTemperature = packs[0].get_lowest_temperature();
-    for ( int p = 1; p < numPacks; p++ ) {
+    int8_t newLowestSensorTemperature = packs[0].get_lowest_temperature();
+    for ( int p = 1; p < NUM_PACKS; p++ ) {
         if ( packs[p].get_lowest_temperature() < newLowestSensorTemperature ) {
             newLowestSensorTemperature = packs[p].get_lowest_temperature();
         }
@@ -352,11 +450,11 @@ void Battery::update_lowest_sensor_temperature() {
     if ( newLowestSensorTemperature < -20 || newLowestSensorTemperature > 50 ) {
         this->bms->set_internal_error();
     }
-    this->lowestSensorTemperature = newLowestSensorTemperature;
+    pending.lowestSensorTemperature = newLowestSensorTemperature;
 }
 
 int8_t Battery::get_lowest_sensor_temperature() {
-    return lowestSensorTemperature;
+    return get_snapshot().lowestSensorTemperature;
 }
 
 void Battery::process_temperature_update() {
@@ -372,10 +470,7 @@ void Battery::process_temperature_update() {
 //// ----
 
 bool Battery::too_cold_to_charge() {
-    if ( get_lowest_sensor_temperature() < CHARGE_TEMPERATURE_MINIMUM ) {
-        return true;
-    }
-    return false;
+    return get_snapshot().too_cold_to_charge();
 }
 
 /* 
@@ -386,7 +481,8 @@ bool Battery::too_cold_to_charge() {
  */
 uint16_t Battery::get_max_charge_current_by_temperature() {
     // Safeties
-    if ( too_hot() || too_cold_to_charge() ) {
+    BatterySnapshot snapshot = get_snapshot();
+    if ( snapshot.too_hot() || snapshot.too_cold_to_charge() ) {
         return 0;
     }
 
@@ -395,7 +491,7 @@ uint16_t Battery::get_max_charge_current_by_temperature() {
 
     // Get the smallest max charge current of all the packs
     uint16_t smallestMaxChargeCurrent = packs[0].get_max_charge_current_by_temperature();
-    for ( int p = 1; p < numPacks; p++ ) {
+    for ( int p = 1; p < NUM_PACKS; p++ ) {
         if ( packs[p].get_max_charge_current_by_temperature() < smallestMaxChargeCurrent ) {
             smallestMaxChargeCurrent = packs[p].get_max_charge_current_by_temperature();
         }
@@ -418,7 +514,7 @@ uint16_t Battery::get_max_charge_current_by_temperature() {
 void Battery::enable_inhibit_contactor_close() {
     if ( !all_contactors_inhibited() ) {
         printf("[battery][enable_inhibit_contactor_close] Enabling inhibit contactor close for all packs\n");
-        for ( int p = 0; p < numPacks; p++ ) {
+        for ( int p = 0; p < NUM_PACKS; p++ ) {
             packs[p].enable_inhibit_contactor_close();
         }
     }
@@ -427,7 +523,7 @@ void Battery::enable_inhibit_contactor_close() {
 void Battery::disable_inhibit_contactor_close() {
     if ( one_or_more_contactors_inhibited() ) {
         printf("[battery][disable_inhibit_contactor_close] Disabling inhibit contactor close for all packs\n");
-        for ( int p = 0; p < numPacks; p++ ) {
+        for ( int p = 0; p < NUM_PACKS; p++ ) {
             packs[p].disable_inhibit_contactor_close();
         }
     }
@@ -435,7 +531,7 @@ void Battery::disable_inhibit_contactor_close() {
 
 // If any of the packs have their contactors inhibited, return true
 bool Battery::one_or_more_contactors_inhibited() {
-    for ( int p = 0; p < numPacks; p++ ) {
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
         if ( packs[p].contactors_are_inhibited() ) {
             return true;
         }
@@ -444,7 +540,7 @@ bool Battery::one_or_more_contactors_inhibited() {
 }
 
 bool Battery::all_contactors_inhibited() {
-    for ( int p = 0; p < numPacks; p++ ) {
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
         if ( !packs[p].contactors_are_inhibited() ) {
             return false;
         }
@@ -458,7 +554,7 @@ void Battery::disable_inhibit_contactors_for_drive() {
     int highPackId = get_index_of_high_pack();
     uint32_t highPackVoltage = packs[highPackId].get_voltage();
     uint32_t targetVoltage = highPackVoltage - SAFE_VOLTAGE_DELTA_BETWEEN_PACKS;
-    for ( int p = 0; p < numPacks; p++ ) {
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
         if ( p == highPackId ) {
             packs[p].disable_inhibit_contactor_close();
             continue;
@@ -475,7 +571,7 @@ void Battery::disable_inhibit_contactors_for_charge() {
     int lowPackId = get_index_of_low_pack();
     uint32_t lowPackVoltage = packs[lowPackId].get_voltage();
     uint32_t targetVoltage = lowPackVoltage + SAFE_VOLTAGE_DELTA_BETWEEN_PACKS;
-    for ( int p = 0; p < numPacks; p++ ) {
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
         if ( p == lowPackId ) {
             packs[p].disable_inhibit_contactor_close();
             continue;
@@ -490,35 +586,18 @@ void Battery::disable_inhibit_contactors_for_charge() {
  * Zero is alive, one is dead. moduleId is index of the across the whole pack,
  * rather than indexed by pack and then module. */
 int8_t Battery::get_module_liveness_byte(int8_t startModuleId) {
-    int8_t livenessByte = 0;
+    extern TimerWheel timerWheel;
     // If the module ID is out of range, return 0
-    if ( startModuleId > ( NUM_PACKS * MODULES_PER_PACK ) ) {
-        return livenessByte;
-    }
-    int8_t packId = ( NUM_PACKS * MODULES_PER_PACK ) / startModuleId;
-    int8_t moduleId = ( NUM_PACKS * MODULES_PER_PACK ) % startModuleId;
-    int8_t count = 0;
-    while ( count < 8 ) {
-        if ( !packs[packId].get_module_liveness(moduleId) ) {
-            livenessByte |= 1 << count;
-        }
-        moduleId += 1;
-        if ( moduleId >= MODULES_PER_PACK ) {
-            moduleId = 0;
-            packId += 1;
-        }
-        count += 1;
+    if ( startModuleId >= ( NUM_PACKS * MODULES_PER_PACK ) ) {
+        return 0;
     }
-    return livenessByte;
+    uint64_t deadModules = ~timerWheel.get_alive() & LIVENESS_ALL_MODULES;
+    return (int8_t)( ( deadModules >> startModuleId ) & 0xFF );
 }
 
 bool Battery::is_alive() {
-    for ( int p = 0; p < numPacks; p++ ) {
-        if ( !packs[p].is_alive() ) {
-            return false;
-        }
-    }
-    return true;
+    extern TimerWheel timerWheel;
+    return ( timerWheel.get_alive() & LIVENESS_ALL_MODULES ) == LIVENESS_ALL_MODULES;
 }
 
 bool Battery::contactor_is_welded(uint8_t packId) {
@@ -19,36 +19,47 @@
 
 #include "include/bms.h"
 #include "include/shunt.h"
+#include "include/timerwheel.h"
+#include "include/cancore.h"
+#include "include/scheduler.h"
+#include "include/supervisor.h"
+#include "include/telemetry.h"
 #include "include/util.h"
 
 #include "settings.h"
 
 extern mutex_t canMutex;
+extern TimerWheel timerWheel;
+extern Scheduler scheduler;
+extern Supervisor supervisor;
+extern Telemetry telemetry;
 
 /*
  * Perform all health checks periodically.
  */
 
-struct repeating_timer healthCheckTimer;
-
-bool run_health_checks(struct repeating_timer *t) {
+void run_health_checks() {
     extern Bms bms;
     extern Battery battery;
     extern Shunt shunt;
 
+    // One consistent set of figures for all of the checks
+    BatterySnapshot snapshot = battery.get_snapshot();
+    bms.record_safety_latency(snapshot);
+
     // Temperature
-    if ( battery.too_hot() ) {
+    if ( snapshot.too_hot() ) {
         bms.send_event(E_TOO_HOT);
-    } else if ( battery.too_cold_to_charge() ) {
+    } else if ( snapshot.too_cold_to_charge() ) {
         bms.send_event(E_TOO_COLD_TO_CHARGE);
     } else {
         bms.send_event(E_TEMPERATURE_OK);
     }
 
     // Voltage
-    if ( battery.has_empty_cell() ) {
+    if ( snapshot.hasEmptyCell ) {
         bms.send_event(E_BATTERY_EMPTY);
-    } else if ( battery.has_full_cell() ) {
+    } else if ( snapshot.hasFullCell ) {
         bms.send_event(E_BATTERY_FULL);
     } else {
         bms.send_event(E_BATTERY_NOT_EMPTY);
@@ -74,22 +85,38 @@ bool run_health_checks(struct repeating_timer *t) {
         bms.send_event(E_SHUNT_RESPONSIVE);
     }
 
-    return true;
+    supervisor.check_in(SUPERVISED_HEALTH_CHECKS);
 }
 
 /*
- * Run recurring calculations
+ * Called by the timer wheel when something has gone longer than its TTL
+ * without a heartbeat. Health checks keep sending the same events every
+ * 100ms, this just gets the first one out as soon as the TTL runs out.
  */
+void handle_liveness_expiry(int timer) {
+    extern Bms bms;
+    if ( timer == LIVENESS_SHUNT ) {
+        printf("[bms][liveness] no update from the shunt for %ds\n", SHUNT_TTL);
+        bms.send_event(E_SHUNT_UNRESPONSIVE);
+    } else if ( timer == LIVENESS_PACKS_MATCHED ) {
+        printf("[bms][liveness] pack voltages have not matched for %ds\n", PACKS_IMBALANCED_TTL);
+        bms.send_event(E_PACKS_IMBALANCED);
+    } else {
+        printf("[pack%d][liveness] no update from module %d for %ds\n", timer / MODULES_PER_PACK,
+            timer % MODULES_PER_PACK, MODULE_TTL);
+        bms.send_event(E_MODULE_UNRESPONSIVE);
+    }
+}
 
-struct repeating_timer calculationsTimer;
+/*
+ * Run recurring calculations
+ */
 
-bool run_calculations(struct repeating_timer *t) {
+void run_calculations() {
     extern Bms bms;
-    bms.update_max_charge_current();
-    bms.update_max_discharge_current();
+    bms.update_limits();
     bms.recalculate_soc();
     // TODO : range estimate
-    return true;
 }
 
 
@@ -117,7 +144,7 @@ void Bms::send_shunt_reset_message() {
     shuntResetFrame.data[5] = 0x00;
     shuntResetFrame.data[6] = 0x00;
     shuntResetFrame.data[7] = 0x00;
-    this->send_frame(&shuntResetFrame, false);
+    this->send_frame(&shuntResetFrame, false, CAN_TX_CONTROL);
 }
 
 
@@ -136,24 +163,19 @@ void Bms::send_shunt_reset_message() {
  * byte 7 = Discharge voltage MSB, scale 0.1, unit V
  */
 
-struct repeating_timer limitsMessageTimer;
-
-bool send_limits_message(struct repeating_timer *t) {
+void build_limits_message(can_frame* frame) {
     extern Bms bms;
     extern Battery battery;
-    struct can_frame limitsFrame;
-    zero_frame(&limitsFrame);
-    limitsFrame.can_id = 0x351;
-    limitsFrame.data[0] = (uint8_t)( battery.get_max_voltage() * 10 ) && 0xFF;
-    limitsFrame.data[1] = (uint8_t)( battery.get_max_voltage() * 10 ) >> 8;
-    limitsFrame.data[2] = (uint8_t)( bms.get_max_charge_current() * 10 ) && 0xFF;
-    limitsFrame.data[3] = (uint8_t)( bms.get_max_charge_current() * 10 ) >> 8;
-    limitsFrame.data[4] = (uint8_t)( bms.get_max_discharge_current() * 10 ) && 0xFF;
-    limitsFrame.data[5] = (uint8_t)( bms.get_max_discharge_current() * 10 ) >> 8;
-    limitsFrame.data[6] = (uint8_t)( battery.get_min_voltage() * 10 ) && 0xFF;
-    limitsFrame.data[7] = (uint8_t)( battery.get_min_voltage() * 10 ) >> 8;
-    bms.send_frame(&limitsFrame, false);
-    return true;
+    zero_frame(frame);
+    frame->can_id = 0x351;
+    frame->data[0] = (uint8_t)( battery.get_max_voltage() * 10 ) && 0xFF;
+    frame->data[1] = (uint8_t)( battery.get_max_voltage() * 10 ) >> 8;
+    frame->data[2] = (uint8_t)( bms.get_max_charge_current() * 10 ) && 0xFF;
+    frame->data[3] = (uint8_t)( bms.get_max_charge_current() * 10 ) >> 8;
+    frame->data[4] = (uint8_t)( bms.get_max_discharge_current() * 10 ) && 0xFF;
+    frame->data[5] = (uint8_t)( bms.get_max_discharge_current() * 10 ) >> 8;
+    frame->data[6] = (uint8_t)( battery.get_min_voltage() * 10 ) && 0xFF;
+    frame->data[7] = (uint8_t)( battery.get_min_voltage() * 10 ) >> 8;
 }
 
 
@@ -210,45 +232,40 @@ bool send_limits_message(struct repeating_timer *t) {
  */
 
 
-struct repeating_timer bmsStateTimer;
-
-bool send_bms_state_message(struct repeating_timer *t) {
+void build_bms_state_message(can_frame* frame) {
     extern Bms bms;
     extern Battery battery;
-    struct can_frame bmsStateFrame;
-    zero_frame(&bmsStateFrame);
+    zero_frame(frame);
 
-    bmsStateFrame.can_id = 0x352;
+    frame->can_id = 0x352;
 
     if ( bms.get_state() == &state_standby ) {
-        bmsStateFrame.data[0] = 0x00;
+        frame->data[0] = 0x00;
     } else if ( bms.get_state() == &state_drive ) {
-        bmsStateFrame.data[0] = 0x01;
+        frame->data[0] = 0x01;
     } else if ( bms.get_state() == &state_batteryHeating ) {
-        bmsStateFrame.data[0] = 0x02;
+        frame->data[0] = 0x02;
     } else if ( bms.get_state() == &state_charging ) {
-        bmsStateFrame.data[0] = 0x03;
+        frame->data[0] = 0x03;
     } else if ( bms.get_state() == &state_batteryEmpty ) {
-        bmsStateFrame.data[0] = 0x04;
+        frame->data[0] = 0x04;
     } else if ( bms.get_state() == &state_overTempFault ) {
-        bmsStateFrame.data[0] = 0x05;
+        frame->data[0] = 0x05;
     } else if ( bms.get_state() == &state_illegalStateTransitionFault ) {
-        bmsStateFrame.data[0] = 0x06;
+        frame->data[0] = 0x06;
     } else if ( bms.get_state() == &state_criticalFault ) {
-        bmsStateFrame.data[0] = 0x07;
+        frame->data[0] = 0x07;
     } else {
-        bmsStateFrame.data[0] = 0xFF;
+        frame->data[0] = 0xFF;
     }
 
-    bmsStateFrame.data[1] = bms.get_error_byte();
-    bmsStateFrame.data[2] = bms.get_status_byte();
-    bmsStateFrame.data[3] = bms.get_charge_inhibit_reason();
-    bmsStateFrame.data[4] = bms.get_drive_inhibit_reason();
-    bmsStateFrame.data[5] = bms.get_welding_byte();
-    bmsStateFrame.data[6] = 0x00;
-    bmsStateFrame.data[7] = 0x00; // checksum
-    bms.send_frame(&bmsStateFrame, true);
-    return true;
+    frame->data[1] = bms.get_error_byte();
+    frame->data[2] = bms.get_status_byte();
+    frame->data[3] = bms.get_charge_inhibit_reason();
+    frame->data[4] = bms.get_drive_inhibit_reason();
+    frame->data[5] = bms.get_welding_byte();
+    frame->data[6] = 0x00;
+    frame->data[7] = 0x00; // checksum
 }
 
 
@@ -267,24 +284,19 @@ bool send_bms_state_message(struct repeating_timer *t) {
  * byte 7 = checksum
  */
 
-struct repeating_timer moduleLivenessTimer;
-
-bool send_module_liveness_message(struct repeating_timer *t) {
+void build_module_liveness_message(can_frame* frame) {
     extern Bms bms;
     extern Battery battery;
-    struct can_frame moduleLivenessFrame;
-    zero_frame(&moduleLivenessFrame);
-    moduleLivenessFrame.can_id = 0x353;
-    moduleLivenessFrame.data[0] = battery.get_module_liveness_byte(0);
-    moduleLivenessFrame.data[1] = battery.get_module_liveness_byte(8);
-    moduleLivenessFrame.data[2] = battery.get_module_liveness_byte(16);
-    moduleLivenessFrame.data[3] = battery.get_module_liveness_byte(24);
-    moduleLivenessFrame.data[4] = battery.get_module_liveness_byte(32);
-    moduleLivenessFrame.data[5] = (uint8_t)bms.get_invalid_event_count() && 0xFF;
-    moduleLivenessFrame.data[6] = (uint8_t)bms.get_invalid_event_count() >> 8;
-    moduleLivenessFrame.data[7] = 0x00;  // checksum
-    bms.send_frame(&moduleLivenessFrame, true);
-    return true;
+    zero_frame(frame);
+    frame->can_id = 0x353;
+    frame->data[0] = battery.get_module_liveness_byte(0);
+    frame->data[1] = battery.get_module_liveness_byte(8);
+    frame->data[2] = battery.get_module_liveness_byte(16);
+    frame->data[3] = battery.get_module_liveness_byte(24);
+    frame->data[4] = battery.get_module_liveness_byte(32);
+    frame->data[5] = (uint8_t)bms.get_invalid_event_count() && 0xFF;
+    frame->data[6] = (uint8_t)bms.get_invalid_event_count() >> 8;
+    frame->data[7] = 0x00;  // checksum
 }
 
 /*
@@ -296,23 +308,18 @@ bool send_module_liveness_message(struct repeating_timer *t) {
  * byte 4 - 7 = can rx error counters (32bit counter)
  */
 
-struct repeating_timer mainCanErrorCountersTimer;
-
-bool send_main_can_error_counters_message(struct repeating_timer *t) {
+void build_main_can_error_counters_message(can_frame* frame) {
     extern Bms bms;
-    struct can_frame mainCanErrorCountersFrame;
-    zero_frame(&mainCanErrorCountersFrame);
-    mainCanErrorCountersFrame.can_id = 0x354;
-    mainCanErrorCountersFrame.data[0] = bms.get_can_tx_error_count() && 0xFF;
-    mainCanErrorCountersFrame.data[1] = bms.get_can_tx_error_count() >> 8 && 0xFF;
-    mainCanErrorCountersFrame.data[2] = bms.get_can_tx_error_count() >> 16 && 0xFF;
-    mainCanErrorCountersFrame.data[3] = bms.get_can_tx_error_count() >> 24 && 0xFF;
-    mainCanErrorCountersFrame.data[4] = bms.get_can_rx_error_count() && 0xFF;
-    mainCanErrorCountersFrame.data[5] = bms.get_can_rx_error_count() >> 8 && 0xFF;
-    mainCanErrorCountersFrame.data[6] = bms.get_can_rx_error_count() >> 16 && 0xFF;
-    mainCanErrorCountersFrame.data[7] = bms.get_can_rx_error_count() >> 24 && 0xFF;
-    bms.send_frame(&mainCanErrorCountersFrame, false);
-    return true;
+    zero_frame(frame);
+    frame->can_id = 0x354;
+    frame->data[0] = bms.get_can_tx_error_count() && 0xFF;
+    frame->data[1] = bms.get_can_tx_error_count() >> 8 && 0xFF;
+    frame->data[2] = bms.get_can_tx_error_count() >> 16 && 0xFF;
+    frame->data[3] = bms.get_can_tx_error_count() >> 24 && 0xFF;
+    frame->data[4] = bms.get_can_rx_error_count() && 0xFF;
+    frame->data[5] = bms.get_can_rx_error_count() >> 8 && 0xFF;
+    frame->data[6] = bms.get_can_rx_error_count() >> 16 && 0xFF;
+    frame->data[7] = bms.get_can_rx_error_count() >> 24 && 0xFF;
 }
 
 
@@ -331,23 +338,18 @@ bool send_main_can_error_counters_message(struct repeating_timer *t) {
  * byte 7 = unused
  */
 
-struct repeating_timer socMessageTimer;
-
-bool send_soc_message(struct repeating_timer *t) {
+void build_soc_message(can_frame* frame) {
     extern Bms bms;
-    struct can_frame socFrame;
-    zero_frame(&socFrame);
-    socFrame.can_id = 0x355;
-    socFrame.data[0] = (uint8_t)bms.get_soc() && 0xFF;            // SoC LSB
-    socFrame.data[1] = (uint8_t)bms.get_soc() >> 8;               // SoC MSB
-    socFrame.data[2] = 0x00;                                      // SoH, not implemented
-    socFrame.data[3] = 0x00;                                      // SoH, not implemented
-    socFrame.data[4] = (uint8_t)( bms.get_soc() * 100 ) && 0xFF;  // SoC LSB, scaled
-    socFrame.data[5] = (uint8_t)( bms.get_soc() * 100 ) >> 8;     // SoC MSB, scaled
-    socFrame.data[6] = 0x00;                                      // unused
-    socFrame.data[7] = 0x00;                                      // unused
-    bms.send_frame(&socFrame, false);
-    return true;
+    zero_frame(frame);
+    frame->can_id = 0x355;
+    frame->data[0] = (uint8_t)bms.get_soc() && 0xFF;            // SoC LSB
+    frame->data[1] = (uint8_t)bms.get_soc() >> 8;               // SoC MSB
+    frame->data[2] = 0x00;                                      // SoH, not implemented
+    frame->data[3] = 0x00;                                      // SoH, not implemented
+    frame->data[4] = (uint8_t)( bms.get_soc() * 100 ) && 0xFF;  // SoC LSB, scaled
+    frame->data[5] = (uint8_t)( bms.get_soc() * 100 ) >> 8;     // SoC MSB, scaled
+    frame->data[6] = 0x00;                                      // unused
+    frame->data[7] = 0x00;                                      // unused
 }
 
 /*
@@ -365,25 +367,21 @@ bool send_soc_message(struct repeating_timer *t) {
  * byte 7 = Voltage MSB (measured by shunt), scale 0.01, unit V
  */
 
-struct repeating_timer statusMessageTimer;
-
-bool send_status_message(struct repeating_timer *t) {
+void build_status_message(can_frame* frame) {
     extern Bms bms;
     extern Battery battery;
     extern Shunt shunt;
-    struct can_frame statusFrame;
-    zero_frame(&statusFrame);
-    statusFrame.can_id = 0x356;
-    statusFrame.data[0] = (uint8_t)( battery.get_voltage() * 100 ) && 0xFF;
-    statusFrame.data[1] = (uint8_t)( battery.get_voltage() * 100 ) >> 8;
-    statusFrame.data[2] = (uint8_t)( shunt.get_amps() * 10 ) && 0xFF;
-    statusFrame.data[3] = (uint8_t)( shunt.get_amps() * 10 ) >> 8;
-    statusFrame.data[4] = battery.get_highest_sensor_temperature() && 0xFF;
-    statusFrame.data[5] = (uint8_t)battery.get_highest_sensor_temperature() >> 8;
-    statusFrame.data[6] = (uint8_t)( shunt.get_voltage1() * 100 ) && 0xFF;
-    statusFrame.data[7] = (uint8_t)( shunt.get_voltage1() * 100 ) >> 8;
-    bms.send_frame(&statusFrame, false);
-    return true;
+    BatterySnapshot snapshot = battery.get_snapshot();
+    zero_frame(frame);
+    frame->can_id = 0x356;
+    frame->data[0] = (uint8_t)( snapshot.voltage * 100 ) && 0xFF;
+    frame->data[1] = (uint8_t)( snapshot.voltage * 100 ) >> 8;
+    frame->data[2] = (uint8_t)( shunt.get_amps() * 10 ) && 0xFF;
+    frame->data[3] = (uint8_t)( shunt.get_amps() * 10 ) >> 8;
+    frame->data[4] = snapshot.highestSensorTemperature && 0xFF;
+    frame->data[5] = (uint8_t)snapshot.highestSensorTemperature >> 8;
+    frame->data[6] = (uint8_t)( shunt.get_voltage1() / 10 ) && 0xFF;
+    frame->data[7] = (uint8_t)( shunt.get_voltage1() / 10 ) >> 8;
 }
 
 /*
@@ -397,24 +395,158 @@ bool send_status_message(struct repeating_timer *t) {
  * byte 6 - 7 = pack 1 can rx error counters (16bit counter)
  */
 
-struct repeating_timer packCanErrorCountersTimer;
-
-bool send_pack_can_error_counters_message(struct repeating_timer *t) {
+void build_pack_can_error_counters_message(can_frame* frame) {
     extern Bms bms;
     extern Battery battery;
-    struct can_frame packCanErrorCountersFrame;
-    zero_frame(&packCanErrorCountersFrame);
-    packCanErrorCountersFrame.can_id = 0x357;
-    packCanErrorCountersFrame.data[0] = battery.get_can_tx_error_count_for_pack(0) && 0xFF;
-    packCanErrorCountersFrame.data[1] = battery.get_can_tx_error_count_for_pack(0) >> 8 && 0xFF;
-    packCanErrorCountersFrame.data[2] = battery.get_can_rx_error_count_for_pack(0) && 0xFF;
-    packCanErrorCountersFrame.data[3] = battery.get_can_rx_error_count_for_pack(0) >> 8 && 0xFF;
-    packCanErrorCountersFrame.data[4] = battery.get_can_tx_error_count_for_pack(1) && 0xFF;
-    packCanErrorCountersFrame.data[5] = battery.get_can_tx_error_count_for_pack(1) >> 8 && 0xFF;
-    packCanErrorCountersFrame.data[6] = battery.get_can_rx_error_count_for_pack(1) && 0xFF;
-    packCanErrorCountersFrame.data[7] = battery.get_can_rx_error_count_for_pack(1) >> 8 && 0xFF;
-    bms.send_frame(&packCanErrorCountersFrame, false);
-    return true;
+    zero_frame(frame);
+    frame->can_id = 0x357;
+    frame->data[0] = battery.get_can_tx_error_count_for_pack(0) && 0xFF;
+    frame->data[1] = battery.get_can_tx_error_count_for_pack(0) >> 8 && 0xFF;
+    frame->data[2] = battery.get_can_rx_error_count_for_pack(0) && 0xFF;
+    frame->data[3] = battery.get_can_rx_error_count_for_pack(0) >> 8 && 0xFF;
+    frame->data[4] = battery.get_can_tx_error_count_for_pack(1) && 0xFF;
+    frame->data[5] = battery.get_can_tx_error_count_for_pack(1) >> 8 && 0xFF;
+    frame->data[6] = battery.get_can_rx_error_count_for_pack(1) && 0xFF;
+    frame->data[7] = battery.get_can_rx_error_count_for_pack(1) >> 8 && 0xFF;
+}
+
+/*
+ * Cell statistics query 0x530, answered with 0x531 and 0x532
+ *
+ * Custom message format (not in SimpBMS)
+ *
+ * Query
+ * byte 0 = pack
+ * byte 1 = module
+ * byte 2 = cell
+ * byte 3 = flags. bit 0 : reset this cell after answering, bit 1 : reset every cell after answering
+ *
+ * 0x531
+ * byte 0 = pack
+ * byte 1 = module (high nibble), cell (low nibble)
+ * byte 2 - 3 = mean voltage, in mV
+ * byte 4 - 5 = lowest voltage since reset, in mV
+ * byte 6 - 7 = highest voltage since reset, in mV
+ *
+ * 0x532
+ * byte 0 - 1 = as 0x531
+ * byte 2 - 5 = voltage variance, in mV^2 x 256
+ * byte 6 - 7 = rate of change, in mV/minute (signed)
+ *
+ * Nothing is sent back for a cell that hasn't had a reading since it was reset.
+ */
+
+static_assert(CELLS_PER_MODULE <= 16, "The cell number is one nibble in 0x531 and 0x532");
+
+void answer_cell_stats_query(can_frame* query) {
+    extern Bms bms;
+    extern CellStats cellStats;
+    int pack = query->data[0];
+    int module = query->data[1];
+    int cell = query->data[2];
+    if ( pack >= NUM_PACKS || module >= MODULES_PER_PACK || cell >= CELLS_PER_MODULE ) {
+        bms.count_discarded_frame();
+        return;
+    }
+
+    CellStatsSample sample;
+    if ( cellStats.get(pack, module, cell, &sample) ) {
+        struct can_frame statsFrame;
+        zero_frame(&statsFrame);
+        statsFrame.can_id = CELL_STATS_QUERY_ID + 1;
+        statsFrame.data[0] = pack;
+        statsFrame.data[1] = ( module << 4 ) | cell;
+        statsFrame.data[2] = sample.mean & 0xFF;
+        statsFrame.data[3] = sample.mean >> 8;
+        statsFrame.data[4] = sample.minimum & 0xFF;
+        statsFrame.data[5] = sample.minimum >> 8;
+        statsFrame.data[6] = sample.maximum & 0xFF;
+        statsFrame.data[7] = sample.maximum >> 8;
+        bms.send_frame(&statsFrame, false);
+
+        statsFrame.can_id = CELL_STATS_QUERY_ID + 2;
+        statsFrame.data[2] = sample.variance & 0xFF;
+        statsFrame.data[3] = ( sample.variance >> 8 ) & 0xFF;
+        statsFrame.data[4] = ( sample.variance >> 16 ) & 0xFF;
+        statsFrame.data[5] = sample.variance >> 24;
+        statsFrame.data[6] = sample.rate & 0xFF;
+        statsFrame.data[7] = ( sample.rate >> 8 ) & 0xFF;
+        bms.send_frame(&statsFrame, false);
+    }
+
+    if ( query->data[3] & 0x02 ) {
+        cellStats.reset_all();
+    } else if ( query->data[3] & 0x01 ) {
+        cellStats.reset(pack, module, cell);
+    }
+}
+
+/*
+ * Task statistics query 0x533, answered with 0x534 and 0x535
+ *
+ * Custom message format (not in SimpBMS)
+ *
+ * Query
+ * byte 0 = core
+ * byte 1 = task, in the order the tasks were added. The status print lists them.
+ *
+ * 0x534
+ * byte 0 = core
+ * byte 1 = task
+ * byte 2 - 3 = runs, low 16 bits
+ * byte 4 - 5 = overruns, low 16 bits
+ * byte 6 - 7 = longest run, in us, capped at 65535
+ *
+ * 0x535
+ * byte 0 - 1 = as 0x534
+ * byte 2 - 3 = mean run, in us, capped at 65535
+ * byte 4 - 5 = mean jitter, in us, capped at 65535
+ * byte 6 - 7 = worst jitter, in us, capped at 65535
+ *
+ * Nothing is sent back for a task that doesn't exist.
+ */
+
+static uint16_t cap_u16(uint32_t value) {
+    return value > 0xFFFF ? 0xFFFF : value;
+}
+
+void answer_task_stats_query(can_frame* query) {
+    extern Bms bms;
+    int core = query->data[0];
+    Scheduler* taskScheduler = core == 0 ? &scheduler : core == CAN_CORE ? get_can_scheduler() : NULL;
+    TaskStats stats;
+    if ( taskScheduler == NULL || !taskScheduler->get_stats(query->data[1], &stats) ) {
+        bms.count_discarded_frame();
+        return;
+    }
+
+    uint16_t runs = stats.runCount & 0xFFFF;
+    uint16_t overruns = stats.overrunCount & 0xFFFF;
+    uint16_t maxExec = cap_u16(stats.maxExecUs);
+    struct can_frame statsFrame;
+    zero_frame(&statsFrame);
+    statsFrame.can_id = TASK_STATS_QUERY_ID + 1;
+    statsFrame.data[0] = core;
+    statsFrame.data[1] = query->data[1];
+    statsFrame.data[2] = runs & 0xFF;
+    statsFrame.data[3] = runs >> 8;
+    statsFrame.data[4] = overruns & 0xFF;
+    statsFrame.data[5] = overruns >> 8;
+    statsFrame.data[6] = maxExec & 0xFF;
+    statsFrame.data[7] = maxExec >> 8;
+    bms.send_frame(&statsFrame, false);
+
+    uint16_t meanExec = cap_u16(stats.meanExecUs);
+    uint16_t meanJitter = cap_u16(stats.meanJitterUs);
+    uint16_t maxJitter = cap_u16(stats.maxJitterUs);
+    statsFrame.can_id = TASK_STATS_QUERY_ID + 2;
+    statsFrame.data[2] = meanExec & 0xFF;
+    statsFrame.data[3] = meanExec >> 8;
+    statsFrame.data[4] = meanJitter & 0xFF;
+    statsFrame.data[5] = meanJitter >> 8;
+    statsFrame.data[6] = maxJitter & 0xFF;
+    statsFrame.data[7] = maxJitter >> 8;
+    bms.send_frame(&statsFrame, false);
 }
 
 
@@ -462,70 +594,66 @@ bool send_pack_can_error_counters_message(struct repeating_timer *t) {
  *   bit 0 = cell delta warn
  */
 
-struct repeating_timer alarmMessageTimer;
-
-bool send_alarm_message(struct repeating_timer *t) {
+void build_alarm_message(can_frame* frame) {
     extern Bms bms;
     extern Battery battery;
-    struct can_frame alarmFrame;
-    zero_frame(&alarmFrame);
-    alarmFrame.can_id = 0x35A;
+    BatterySnapshot snapshot = battery.get_snapshot();
+    zero_frame(frame);
+    frame->can_id = 0x35A;
 
     // byte 0, bit 0, general alarm
-    if ( bms.get_internal_error() ) { alarmFrame.data[0] |= 0x01; }
+    if ( bms.get_internal_error() ) { frame->data[0] |= 0x01; }
     // byte 0, bit 2 : overvolt alarm
-    if ( battery.has_full_cell() ) { alarmFrame.data[0] |= 0x04; }
+    if ( snapshot.hasFullCell ) { frame->data[0] |= 0x04; }
     // byte 0, bit 4 : undervolt alarm
-    if ( battery.has_empty_cell() ) { alarmFrame.data[0] |= 0x08; }
+    if ( snapshot.hasEmptyCell ) { frame->data[0] |= 0x08; }
     // byte 0, bit 6 : high temp alarm
-    if ( battery.too_hot() ) { alarmFrame.data[0] |= 0x20; }
+    if ( snapshot.too_hot() ) { frame->data[0] |= 0x20; }
 
     // byte 1, bit 0 : low temp alarm
-    if ( battery.too_cold_to_charge() ) { alarmFrame.data[1] |= 0x01; }
+    if ( snapshot.too_cold_to_charge() ) { frame->data[1] |= 0x01; }
     // byte 1, bit 2 : high temp charge alarm
-    if ( battery.too_hot() ) { alarmFrame.data[1] |= 0x04; }
+    if ( snapshot.too_hot() ) { frame->data[1] |= 0x04; }
     // byte 1, bit 4 : low temp charge alarm
-    if ( battery.too_cold_to_charge() ) { alarmFrame.data[1] |= 0x08; }
+    if ( snapshot.too_cold_to_charge() ) { frame->data[1] |= 0x08; }
     // FIXME byte 1, bit 6 : high current alarm
 
     // FIXME byte 2, bit 0 : high charge current alarm
     // byte 2, bit 2 : contactor on alarm
-    if ( bms.charge_is_enabled() || bms.ignition_is_on() ) { alarmFrame.data[2] |= 0x04; }
+    if ( bms.charge_is_enabled() || bms.ignition_is_on() ) { frame->data[2] |= 0x04; }
     // FIXME byte 2, bit 4 : short circuit alarm
     // byte 2, bit 6 : internal error alarm
-    if ( bms.get_internal_error() ) { alarmFrame.data[2] |= 0x20; }
+    if ( bms.get_internal_error() ) { frame->data[2] |= 0x20; }
 
     // byte 3, bit 0 : cell delta alarm
-    if ( battery.cell_delta_above_alarm() ) { alarmFrame.data[3] |= 0x01; }
+    if ( snapshot.cell_delta_above_alarm() ) { frame->data[3] |= 0x01; }
 
     // FIXME byte 4, bit 0 : general warn
     // byte 4, bit 2 : overvolt warn
-    if ( battery.has_full_cell() ) { alarmFrame.data[4] |= 0x04; }
+    if ( snapshot.hasFullCell ) { frame->data[4] |= 0x04; }
     // byte 4, bit 4 : undervolt warn
-    if ( battery.has_empty_cell() ) { alarmFrame.data[4] |= 0x08; }
+    if ( snapshot.hasEmptyCell ) { frame->data[4] |= 0x08; }
     // byte 4, bit 6 : high temp warn
-    if ( battery.too_hot() ) { alarmFrame.data[4] |= 0x20; }
+    if ( snapshot.too_hot() ) { frame->data[4] |= 0x20; }
 
     // byte 5, bit 0 : low temp warn
-    if ( battery.too_cold_to_charge() ) { alarmFrame.data[5] |= 0x01; }
+    if ( snapshot.too_cold_to_charge() ) { frame->data[5] |= 0x01; }
     // byte 5, bit 2 : high temp charge warn
-    if ( battery.too_hot() ) { alarmFrame.data[5] |= 0x04; }
+    if ( snapshot.too_hot() ) { frame->data[5] |= 0x04; }
     // byte 5, bit 4 : low temp charge warn
-    if ( battery.too_cold_to_charge() ) { alarmFrame.data[5] |= 0x08; }
+    if ( snapshot.too_cold_to_charge() ) { frame->data[5] |= 0x08; }
     // FIXME byte 5, bit 6 : high current warn
 
     // FIXME byte 6, bit 0 : high charge current warn
     // byte 6, bit 2 : contactor on warn
-    if ( bms.charge_is_enabled() || bms.ignition_is_on() ) { alarmFrame.data[6] |= 0x04; }
+    if ( bms.charge_is_enabled() || bms.ignition_is_on() ) { frame->data[6] |= 0x04; }
     // FIXME byte 6, bit 4 : short circuit warn
     // byte 6, bit 6 : internal error warn
-    if ( bms.get_internal_error() ) { alarmFrame.data[6] != 0x40; }
+    if ( bms.get_internal_error() ) { frame->data[6] != 0x40; }
 
     // FIXME byte 7, bit 0 : cell delta warn
-    if ( battery.cell_delta_above_warn() ) { alarmFrame.data[7] |= 0x01; }
+    if ( snapshot.cell_delta_above_warn() ) { frame->data[7] |= 0x01; }
 
-    bms.send_frame(&alarmFrame, false);
-    return true;
 }
 
 
@@ -536,61 +664,71 @@ bool send_alarm_message(struct repeating_timer *t) {
 //// ----
 
 
-// Handle messages coming in on the main CAN bus
+// ISA shunt messages, 0x521 - 0x528. Each one carries a signed 32 bit value in
+// bytes 2-5, indexed here by can_id - SHUNT_FRAME_BASE_ID.
+
+#define SHUNT_FRAME_BASE_ID 0x521
+
+typedef void (*ShuntRoute)(Shunt* shunt, int32_t value);
+
+constexpr ShuntRoute shuntRoutes[] = {
+    [](Shunt* shunt, int32_t value) { shunt->set_amps(value); },                 // 0x521 current, mA
+    [](Shunt* shunt, int32_t value) { shunt->set_voltage1(value); },             // 0x522 voltage 1, mV
+    [](Shunt* shunt, int32_t value) { shunt->set_voltage2(value); },             // 0x523 voltage 2, mV
+    [](Shunt* shunt, int32_t value) { shunt->set_voltage3(value); },             // 0x524 voltage 3, mV
+    [](Shunt* shunt, int32_t value) { shunt->set_temperature(value); },          // 0x525 temperature, 0.1C
+    [](Shunt* shunt, int32_t value) { shunt->set_watts(value); },                // 0x526 power, W
+    [](Shunt* shunt, int32_t value) { shunt->set_ampSeconds(value); },           // 0x527 amp-seconds
+    [](Shunt* shunt, int32_t value) { shunt->set_wattHours(value); },            // 0x528 watt-hours
+};
+
+const uint32_t NUM_SHUNT_ROUTES = sizeof(shuntRoutes) / sizeof(shuntRoutes[0]);
+
+int shuntUpdateTask = -1;                           // apply_shunt_updates() on core 0
 
-struct repeating_timer handleMainCANMessageTimer;
+// Handle messages coming in on the main CAN bus. Posted whenever the main port
+// reads a frame, and run every 5ms to service the port.
 
-bool handle_main_CAN_messages(struct repeating_timer *t) {
+void handle_main_CAN_messages() {
     struct can_frame m;
-    extern Shunt shunt;
     extern Bms bms;
-    if ( bms.read_frame(&m) ) {
-        switch ( m.can_id ) {
-            // ISA shunt amps
-            case 0x521:
-                shunt.set_amps( (int32_t)( (m.data[5] << 24) | (m.data[4] << 16) | (m.data[3] << 8) | (m.data[2]) ) );
-                shunt.heartbeat();
-                break;
-            // ISA shunt voltage 1
-            case 0x522:
-                shunt.set_voltage1( (int32_t)( (m.data[5] << 24) | (m.data[4] << 16) | (m.data[3] << 8) | (m.data[2]) ) / 1000.0f );
-                shunt.heartbeat();
-                break;
-            // ISA shunt voltage 2
-            case 0x523:
-                shunt.set_voltage2( (int32_t)( (m.data[5] << 24) | (m.data[4] << 16) | (m.data[3] << 8) | (m.data[2]) ) / 1000.0f );
-                shunt.heartbeat();
-                break;
-            // ISA shunt voltage 3
-            case 0x524:
-                shunt.set_voltage3( (int32_t)( (m.data[5] << 24) | (m.data[4] << 16) | (m.data[3] << 8) | (m.data[2]) ) / 1000.0f );
-                shunt.heartbeat();
-                break;
-            // ISA shunt temperature
-            case 0x525:
-                shunt.set_temperature( (int32_t)( (m.data[5] << 24) | (m.data[4] << 16) | (m.data[3] << 8) | (m.data[2]) ) / 10 );
-                shunt.heartbeat();
-                break;
-            // ISA shunt kilowatts
-            case 0x526:
-                shunt.set_watts( (int32_t)( (m.data[5] << 24) | (m.data[4] << 16) | (m.data[3] << 8) | (m.data[2]) ) / 1000.0f );
-                shunt.heartbeat();
-                break;
-            // ISA shunt amp-hours
-            case 0x527:
-                shunt.set_ampSeconds( (int32_t)(m.data[5] << 24) | (m.data[4] << 16) | (m.data[3] << 8) | (m.data[2]) );
-                shunt.heartbeat();
-                break;
-            // ISA shunt kilowatt-hours
-            case 0x528:
-                shunt.set_wattHours( (int32_t)( (m.data[5] << 24) | (m.data[4] << 16) | (m.data[3] << 8) | (m.data[2]) ) );
-                shunt.heartbeat();
-                break;
-            default:
-                break;
+    if ( bms.service_can_port() ) {
+        supervisor.check_in(SUPERVISED_MAIN_RX);
+    }
+    while ( bms.read_frame(&m) ) {
+        if ( m.can_id == CELL_STATS_QUERY_ID ) {
+            answer_cell_stats_query(&m);
+            continue;
+        }
+        if ( m.can_id == TASK_STATS_QUERY_ID ) {
+            answer_task_stats_query(&m);
+            continue;
+        }
+        uint32_t routeId = m.can_id - SHUNT_FRAME_BASE_ID;
+        if ( routeId >= NUM_SHUNT_ROUTES ) {
+            bms.count_discarded_frame();
+            continue;
+        }
+        if ( bms.queue_shunt_update(routeId,
+                (int32_t)( (m.data[5] << 24) | (m.data[4] << 16) | (m.data[3] << 8) | (m.data[2]) )) ) {
+            scheduler.post(shuntUpdateTask);
+        } else {
+            bms.count_discarded_frame();
         }
     }
-    return true;
+}
+
+// Shunt readings are decoded on the CAN core, but the shunt belongs to core 0.
+// Posted for each reading queued.
+
+void apply_shunt_updates() {
+    extern Shunt shunt;
+    extern Bms bms;
+    ShuntUpdate update;
+    while ( bms.next_shunt_update(&update) ) {
+        shuntRoutes[update.route](&shunt, update.value);
+        shunt.heartbeat();
+    }
 }
 
 
@@ -602,25 +740,26 @@ Bms::Bms(Battery* _battery, Io* _io, Shunt* _shunt) {
     io = _io;
     shunt = _shunt;
     internalError = false;
+    mainCanTask = -1;
     statusLight = StatusLight(this);
     chargeInhibitReason = R_NONE;
     driveInhibitReason = R_NONE;
+    maxChargeCurrent = 0;
+    maxDischargeCurrent = 0;
+
+    // Both count as fine until their TTL passes without a heartbeat
+    timerWheel.add(LIVENESS_SHUNT, liveness_ticks(seconds(SHUNT_TTL)));
+    timerWheel.add(LIVENESS_PACKS_MATCHED, liveness_ticks(seconds(PACKS_IMBALANCED_TTL)));
+    timerWheel.set_expiry_handler(handle_liveness_expiry);
+
+    lastCheckedSnapshotTime = Timestamp();
+    safetyLatencyMaxUs = 0;
+    safetyLatencyTotalUs = 0;
+    safetyLatencyCount = 0;
 
     printf("[bms][init] setting up main CAN port\n");
-    CAN = new MCP2515(SPI_PORT, MAIN_CAN_CS, SPI_MISO, SPI_MOSI, SPI_CLK, 500000);
-    MCP2515::ERROR result = CAN->reset();
-    if ( result != MCP2515::ERROR_OK ) {
-        printf("[bms][init] WARNING problem resetting main CAN port : %d\n", result);
-    }
-    result = CAN->setBitrate(CAN_500KBPS, MCP_8MHZ);
-    if ( result != MCP2515::ERROR_OK ) {
-        printf("[bms][init] WARNING problem setting bitrate on main CAN port : %d\n", result);
-    }
-    result = CAN->setNormalMode();
-    if ( result != MCP2515::ERROR_OK ) {
-        printf("[bms][init] WARNING problem setting normal mode on main CAN port : %d\n", result);
-    }
-    printf("[bms][init] main CAN port memory address : %p\n", CAN);
+    canPort = new CanPort("main-can", MAIN_CAN_CS, MAIN_CAN_INT_PIN, MAIN_CAN_SPI_CLOCK,
+                          &CAN_ACCEPTANCE[MAIN_CAN_PORT], &canMutex);
 
     /*
     printf("[bms][init] sending 5 test messages\n");
@@ -635,36 +774,38 @@ Bms::Bms(Battery* _battery, Io* _io, Shunt* _shunt) {
     }
     */
 
+    // Outbound messages are sent by Telemetry
     printf("[bms][init] enabling CAN message handlers\n");
-    // limits (out)
-    add_repeating_timer_ms(1000, send_limits_message, NULL, &limitsMessageTimer);
-    // bms state (out)
-    add_repeating_timer_ms(1000, send_bms_state_message, NULL, &bmsStateTimer);
-    // module liveness (out)
-    add_repeating_timer_ms(5000, send_module_liveness_message, NULL, &moduleLivenessTimer);
-    // can error counters (out)
-    add_repeating_timer_ms(1000, send_main_can_error_counters_message, NULL, &mainCanErrorCountersTimer);
-    // soc (out)
-    add_repeating_timer_ms(1000, send_soc_message, NULL, &socMessageTimer);
-    // status (out)
-    add_repeating_timer_ms(1000, send_status_message, NULL, &statusMessageTimer);
-    // Alarms (out)
-    add_repeating_timer_ms(1000, send_alarm_message, NULL, &alarmMessageTimer);
     // main CAN (in)
-    add_repeating_timer_ms(5, handle_main_CAN_messages, NULL, &handleMainCANMessageTimer);
+    mainCanTask = add_can_task("main can", handle_main_CAN_messages, TASK_CONTROL, milliseconds(5),
+        milliseconds(5));
+    canPort->set_rx_task(get_can_scheduler(), mainCanTask);
+    canPort->set_tx_sent_handler(handle_main_frame_sent);
+    shuntUpdateTask = scheduler.add("shunt updates", apply_shunt_updates, TASK_CONTROL, milliseconds(5),
+        milliseconds(5));
     // health checks
-    printf("[bms][init] enabling SoC update timer\n");
-    add_repeating_timer_ms(100, run_health_checks, NULL, &healthCheckTimer);
+    printf("[bms][init] enabling health checks\n");
+    scheduler.add("health checks", run_health_checks, TASK_SAFETY, milliseconds(100), milliseconds(100));
     // calculations
-    printf("[bms][init] enabling calculations timer\n");
-    add_repeating_timer_ms(1000, run_calculations, NULL, &calculationsTimer);
+    printf("[bms][init] enabling calculations\n");
+    scheduler.add("calculations", run_calculations, TASK_CONTROL, seconds(1), seconds(1));
 }
 
 void Bms::set_state(State newState, std::string reason) {
     std::string oldStateName = get_state_name(state);
     std::string newStateName = get_state_name(newState);
     printf("[bms][set_state] switching from state %s to state %s, reason : %s\n", oldStateName.c_str(), newStateName.c_str(), reason.c_str());
+    bool changed = newState != state;
     state = newState;
+    if ( changed ) {
+        // The limits and alarms usually follow the state, so send all three.
+        // The frames are built when the telemetry task next runs, so the
+        // limits only have to be brought up to date before then.
+        update_limits();
+        telemetry.send_soon(TELEMETRY_BMS_STATE);
+        telemetry.send_soon(TELEMETRY_LIMITS);
+        telemetry.send_soon(TELEMETRY_ALARMS);
+    }
     // Change light blinking pattern based on state
     if ( state == state_standby ) {
         statusLight.set_mode(STANDBY);
@@ -692,7 +833,11 @@ State Bms::get_state() {
 }
 
 void Bms::send_event(Event event) {
+    // A handler that never returns is blamed on the state machine, not on
+    // whichever task sent the event
+    const char* previous = scheduler.enter_section("statemachine");
     state(event);
+    scheduler.leave_section(previous);
 }
 
 void Bms::print() {
@@ -700,14 +845,20 @@ void Bms::print() {
     std::string drv_inh = io->drive_is_inhibited() ? "true" : "false";
     std::string ign = io->ignition_is_on() ? "true" : "false";
     std::string chg_en = io->charge_enable_is_on() ? "true" : "false";
-    int8_t Tmax = battery->get_highest_sensor_temperature();
-    int8_t Tmin = battery->get_lowest_sensor_temperature();
-    int16_t Vmax = battery->get_highest_cell_voltage();
-    int16_t Vmin = battery->get_lowest_cell_voltage();
+    BatterySnapshot snapshot = battery->get_snapshot();
+    int8_t Tmax = snapshot.highestSensorTemperature;
+    int8_t Tmin = snapshot.lowestSensorTemperature;
+    int16_t Vmax = snapshot.highestCellVoltage;
+    int16_t Vmin = snapshot.lowestCellVoltage;
     printf("State:%s, SoC:%d, DRV_INH:%s, CHG_INH:%s, IGN:%s, CHG_EN:%s\n",
         get_state_name(get_state()), soc, drv_inh.c_str(), chg_inh.c_str(), ign.c_str(), chg_en.c_str());
-    printf(" V:%d, VMax:%d, VMin:%d\n", battery->get_voltage()/1000, Vmax, Vmin );
+    printf(" V:%d, VMax:%d, VMin:%d\n", snapshot.voltage/1000, Vmax, Vmin );
     printf(" TMax:%d, TMin:%d\n", Tmax, Tmin );
+    canPort->print();
+    uint32_t meanLatency = safetyLatencyCount > 0 ? safetyLatencyTotalUs / safetyLatencyCount : 0;
+    printf("[bms] CAN on core %d, frame to health check mean:%luus max:%luus, shunt queue max:%u dropped:%lu, "
+        "tx queue max:%u dropped:%lu\n", CAN_CORE, meanLatency, safetyLatencyMaxUs, shuntUpdates.get_max_depth(),
+        shuntUpdates.get_drop_count(), mainTxRequests.get_max_depth(), mainTxRequests.get_drop_count());
     battery->print();
 }
 
@@ -723,6 +874,7 @@ void Bms::enable_drive_inhibit(std::string context, InhibitReason reason) {
     if ( !drive_is_inhibited() ) {
         set_drive_inhibit_reason(reason);
         io->enable_drive_inhibit(context);
+        update_limits();
     }
 }
 
@@ -730,6 +882,7 @@ void Bms::disable_drive_inhibit(std::string context) {
     clear_drive_inhibit_reason();
     if ( drive_is_inhibited() ) {
         io->disable_drive_inhibit(context);
+        update_limits();
     }
 }
 
@@ -738,11 +891,16 @@ bool Bms::drive_is_inhibited() {
 }
 
 void Bms::set_drive_inhibit_reason(InhibitReason reason) {
+    if ( driveInhibitReason != reason ) {
+        telemetry.send_soon(TELEMETRY_BMS_STATE);
+        telemetry.send_soon(TELEMETRY_LIMITS);
+        telemetry.send_soon(TELEMETRY_ALARMS);
+    }
     driveInhibitReason = reason;
 }
 
 void Bms::clear_drive_inhibit_reason() {
-    driveInhibitReason = R_NONE;
+    set_drive_inhibit_reason(R_NONE);
 }
 
 int8_t Bms::get_drive_inhibit_reason() {
@@ -755,6 +913,7 @@ void Bms::enable_charge_inhibit(std::string context, InhibitReason reason) {
     if ( !charge_is_inhibited() ) {
         set_charge_inhibit_reason(reason);
         io->enable_charge_inhibit(context);
+        update_limits();
     }
 }
 
@@ -762,6 +921,7 @@ void Bms::disable_charge_inhibit(std::string context) {
     clear_charge_inhibit_reason();
     if ( charge_is_inhibited() ) {
         io->disable_charge_inhibit(context);
+        update_limits();
     }
 }
 
@@ -770,11 +930,16 @@ bool Bms::charge_is_inhibited() {
 }
 
 void Bms::set_charge_inhibit_reason(InhibitReason reason) {
+    if ( chargeInhibitReason != reason ) {
+        telemetry.send_soon(TELEMETRY_BMS_STATE);
+        telemetry.send_soon(TELEMETRY_LIMITS);
+        telemetry.send_soon(TELEMETRY_ALARMS);
+    }
     chargeInhibitReason = reason;
 }
 
 void Bms::clear_charge_inhibit_reason() {
-    chargeInhibitReason = R_NONE;
+    set_charge_inhibit_reason(R_NONE);
 }
 
 int8_t Bms::get_charge_inhibit_reason() {
@@ -899,13 +1064,22 @@ uint16_t Bms::get_max_charge_current_by_soc() {
     return 0;
 }
 
+// Bring both current limits up to date. Called every second, and straight
+// away when the state or an inhibit changes, as both can pull the limits to 0.
+void Bms::update_limits() {
+    update_max_charge_current();
+    update_max_discharge_current();
+}
+
 void Bms::update_max_charge_current() {
+    uint16_t previous = maxChargeCurrent;
     // Safeties
     if ( battery->too_hot() || charge_is_inhibited() ) {
         maxChargeCurrent = 0;
-        return;
+    } else {
+        maxChargeCurrent = std::min(battery->get_max_charge_current_by_temperature(), get_max_charge_current_by_soc());
     }
-    maxChargeCurrent = std::min(battery->get_max_charge_current_by_temperature(), get_max_charge_current_by_soc());
+    check_limit_change(previous, maxChargeCurrent);
 }
 
 uint16_t Bms::get_max_charge_current() {
@@ -913,8 +1087,19 @@ uint16_t Bms::get_max_charge_current() {
 }
 
 void Bms::update_max_discharge_current() {
+    uint16_t previous = maxDischargeCurrent;
     // FIXME actual implementation
     maxDischargeCurrent = 100;
+    check_limit_change(previous, maxDischargeCurrent);
+}
+
+// Don't leave the charger or inverter waiting for the next 0x351 if a limit
+// has moved by much
+void Bms::check_limit_change(uint16_t previous, uint16_t current) {
+    int32_t change = (int32_t)current - (int32_t)previous;
+    if ( change >= FAST_LIMIT_CHANGE_THRESHOLD || change <= -FAST_LIMIT_CHANGE_THRESHOLD ) {
+        telemetry.send_soon(TELEMETRY_LIMITS);
+    }
 }
 
 uint16_t Bms::Bms::get_max_discharge_current() {
@@ -929,101 +1114,82 @@ void Bms::led_blink() {
 
 // Track when the pack voltages match each other
 void Bms::pack_voltages_match_heartbeat() {
-    lastTimePackVoltagesMatched = get_clock();
+    timerWheel.heartbeat(LIVENESS_PACKS_MATCHED);
 }
 
 bool Bms::packs_are_imbalanced() {
-    return ( get_clock() - lastTimePackVoltagesMatched ) > PACKS_IMBALANCED_TTL;
+    return !timerWheel.is_alive(LIVENESS_PACKS_MATCHED);
 }
 
 
 // Comms
 
-bool Bms::send_frame(can_frame* frame, bool doChecksum) {
-    for ( int t = 0; t < SEND_FRAME_RETRIES; t++ ) {
-        // printf("[bms][send_frame] 0x%03X  [ ", frame->can_id);
-        // for ( int i = 0; i < frame->can_dlc; i++ ) {
-        //     printf("%02X ", frame->data[i]);
-        // }
-        // printf("]\n");
-
-        if ( doChecksum ) {
-            // Calculate XOR checksum
-            frame->data[7] = 0;
-            for ( int i = 0; i < 7; i++ ) {
-                frame->data[7] ^= frame->data[i];
-            }
+bool Bms::send_frame(can_frame* frame, bool doChecksum, CanTxPriority priority, uint32_t tag) {
+    // printf("[bms][send_frame] 0x%03X  [ ", frame->can_id);
+    // for ( int i = 0; i < frame->can_dlc; i++ ) {
+    //     printf("%02X ", frame->data[i]);
+    // }
+    // printf("]\n");
+
+    if ( doChecksum ) {
+        // Calculate XOR checksum
+        frame->data[7] = 0;
+        for ( int i = 0; i < 7; i++ ) {
+            frame->data[7] ^= frame->data[i];
         }
+    }
 
-        if ( !mutex_enter_timeout_ms(&canMutex, CAN_MUTEX_TIMEOUT_MS) ) {
+#if CAN_ON_CORE1
+    // Only the CAN core talks to the controller
+    if ( get_core_num() != CAN_CORE ) {
+        if ( !mainTxRequests.push({ *frame, priority, tag }) ) {
             increment_can_tx_error_count();
-            continue;
-        }
-
-        MCP2515::ERROR result = this->CAN->sendMessage(frame);
-        mutex_exit(&canMutex);
-
-        // Sending failed, try again
-        if ( result != MCP2515::ERROR_OK ) {
-            if ( result == MCP2515::ERROR_FAIL ) {
-                printf(" [send_frame %d] ERROR_FAIL, try again\n", t);
-                increment_can_tx_error_count();
-            } else if ( result == MCP2515::ERROR_ALLTXBUSY ) {
-                printf(" [send_frame %d] ERROR_ALLTXBUSY, try again\n", t);
-                increment_can_tx_error_count();
-            } else if ( result == MCP2515::ERROR_FAILINIT ) {
-                printf(" [send_frame %d] ERROR_FAILINIT, try again\n", t);
-                increment_can_tx_error_count();
-            } else if ( result == MCP2515::ERROR_FAILTX ) {
-                printf(" [send_frame %d] ERROR_FAILTX, try again\n", t);
-                increment_can_tx_error_count();
-            } else if ( result == MCP2515::ERROR_NOMSG ) {
-                printf(" [send_frame %d] ERROR_NOMSG, try again\n", t);
-                increment_can_tx_error_count();
-            }
-            continue;
+            return false;
         }
-        // Frame was sent
+        // Don't leave it waiting for the next period
+        get_can_scheduler()->post(mainCanTask);
         return true;
     }
-    // Failed to send after all retries
-    return false;
+#endif
+
+    if ( !canPort->queue_frame(frame, priority, tag) ) {
+        increment_can_tx_error_count();
+        return false;
+    }
+    return true;
 }
 
-bool Bms::read_frame(can_frame* frame) {
-    for ( int t = 0; t < READ_FRAME_RETRIES; t++ ) {    
-        if ( !mutex_enter_timeout_ms(&canMutex, CAN_MUTEX_TIMEOUT_MS) ) {
-            increment_can_rx_error_count();
-            return false;
-        }
-        MCP2515::ERROR result = this->CAN->readMessage(frame);
-        mutex_exit(&canMutex);
-        if ( result != MCP2515::ERROR_OK ) {
-            if ( result == MCP2515::ERROR_FAIL ) {
-                printf("[bms][read_frame] %d/%d ERROR_FAIL, try again\n", t, READ_FRAME_RETRIES);
-                increment_can_rx_error_count();
-            } else if ( result == MCP2515::ERROR_ALLTXBUSY ) {
-                printf("[bms][read_frame] %d/%d ERROR_ALLTXBUSY, try again\n", t, READ_FRAME_RETRIES);
-                increment_can_rx_error_count();
-            } else if ( result == MCP2515::ERROR_FAILINIT ) {
-                printf("[bms][read_frame] %d/%d ERROR_FAILINIT, try again\n", t, READ_FRAME_RETRIES);
-                increment_can_rx_error_count();
-            } else if ( result == MCP2515::ERROR_FAILTX ) {
-                printf("[bms][read_frame] %d/%d ERROR_FAILTX, try again\n", t, READ_FRAME_RETRIES);
-                increment_can_rx_error_count();
-            } else if ( result == MCP2515::ERROR_NOMSG ) {
-                return true;
-            }
-            continue;
+// Collect frames from the main bus controller, and hand it anything core 0
+// has queued to send. Runs on the CAN core. Returns false if the controller
+// couldn't be serviced.
+bool Bms::service_can_port() {
+    bool serviced = canPort->service();
+    MainTxRequest request;
+    while ( mainTxRequests.pop(&request) ) {
+        if ( !canPort->queue_frame(&request.frame, request.priority, request.tag) ) {
+            increment_can_tx_error_count();
         }
-        // Frame was read, print it out
-        // printf("[bms][read_frame] 0x%03X  [ ", frame->can_id);
-        // for ( int i = 0; i < frame->can_dlc; i++ ) {
-        //     printf("%02X ", frame->data[i]);
-        // }
-        // printf("]\n");
-        return true;
     }
-    // Failed to read after all retries
-    return false;
-}
\ No newline at end of file
+    return serviced;
+}
+
+// How long it took for the newest frame in this snapshot to reach a health
+// check. Each snapshot is only counted the first time it's checked.
+void Bms::record_safety_latency(const BatterySnapshot& snapshot) {
+    if ( snapshot.time == lastCheckedSnapshotTime || !snapshot.newestFrameTime.is_set() ) {
+        return;
+    }
+    lastCheckedSnapshotTime = snapshot.time;
+    uint32_t latency = elapsed_since(snapshot.newestFrameTime).as_us();
+    if ( latency > safetyLatencyMaxUs ) {
+        safetyLatencyMaxUs = latency;
+    }
+    safetyLatencyTotalUs += latency;
+    safetyLatencyCount++;
+}
+
+// Take the next frame received on the main CAN bus. Returns false when there
+// are none waiting.
+bool Bms::read_frame(can_frame* frame) {
+    return canPort->pop_frame(frame);
+}
@@ -0,0 +1,70 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "include/cancore.h"
+#include "include/canport.h"
+
+/*
+ * Everything that talks to the MCP2515s, or decodes what they receive, is a
+ * task added here. With CAN_ON_CORE1 they go on core 1's own scheduler, which
+ * starts running in start_can_core(), so they never wait behind the state
+ * machine, health checks or telemetry on core 0. Otherwise they share core 0's
+ * scheduler with everything else.
+ */
+
+#if CAN_ON_CORE1
+Scheduler canScheduler;
+
+void can_core_main() {
+    enable_can_interrupts();
+    canScheduler.run();
+}
+#endif
+
+void initialise_can_core() {
+#if CAN_ON_CORE1
+    canScheduler.initialise("sched1");
+#endif
+}
+
+Scheduler* get_can_scheduler() {
+#if CAN_ON_CORE1
+    return &canScheduler;
+#else
+    extern Scheduler scheduler;
+    return &scheduler;
+#endif
+}
+
+int add_can_task(const char* name, TaskCallback callback, TaskPriority priority, Duration period, Duration deadline) {
+    return get_can_scheduler()->add(name, callback, priority, period, deadline);
+}
+
+void start_can_core() {
+#if CAN_ON_CORE1
+    printf("[cancore] starting %d CAN tasks on core 1\n", canScheduler.get_num_tasks());
+    multicore_launch_core1(can_core_main);
+#else
+    printf("[cancore] CAN tasks are running on core 0\n");
+    enable_can_interrupts();
+#endif
+}
@@ -0,0 +1,659 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hardware/sync.h"
+#include "include/canport.h"
+#include "include/spibus.h"
+#include "settings.h"
+
+
+// Ports which have an INT line, so the GPIO callback can find the port that
+// raised the interrupt.
+static CanPort* interruptPorts[NUM_CAN_PORTS];
+static int numInterruptPorts = 0;
+
+// Called from the GPIO callback for every edge, on every pin
+void handle_can_interrupt(uint gpio) {
+    for ( int i = 0; i < numInterruptPorts; i++ ) {
+        if ( interruptPorts[i]->get_interrupt_pin() == static_cast<int>(gpio) ) {
+            interruptPorts[i]->handle_interrupt();
+        }
+    }
+}
+
+#if CAN_ON_CORE1
+// Core 1's own GPIO callback. It only ever sees the INT lines.
+static void can_gpio_callback(uint gpio, uint32_t events) {
+    handle_can_interrupt(gpio);
+}
+#endif
+
+/*
+ * Enable the INT line interrupts on the core that services the CAN ports, so
+ * that handle_interrupt() only ever interrupts that core's own tasks. Must be
+ * called from the CAN core once every port has been set up. On core 0 the INT
+ * lines share io.cpp's GPIO callback.
+ */
+void enable_can_interrupts() {
+    for ( int i = 0; i < numInterruptPorts; i++ ) {
+        #if CAN_ON_CORE1
+        gpio_set_irq_enabled_with_callback(interruptPorts[i]->get_interrupt_pin(), GPIO_IRQ_EDGE_FALL, true,
+            &can_gpio_callback);
+        #else
+        gpio_set_irq_enabled(interruptPorts[i]->get_interrupt_pin(), GPIO_IRQ_EDGE_FALL, true);
+        #endif
+    }
+}
+
+
+CanPort::CanPort(const char* _name, uint8_t csPin, int _intPin, uint32_t spiClock, const CanAcceptance* acceptance,
+                 mutex_t* _canMutex) {
+    strncpy(name, _name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    intPin = _intPin;
+    canMutex = _canMutex;
+    critical_section_init(&lock);
+
+    rxHead = 0;
+    rxTail = 0;
+    rxPending = false;
+    rxDraining = false;
+    rxDrainStartTime = Timestamp();
+    rxAsyncFrameCount = 0;
+    lastInterruptTime = 0;
+    rxScheduler = NULL;
+    rxTask = -1;
+
+    rxFrameCount = 0;
+    rxRingOverflowCount = 0;
+    rxHardwareOverflowCount = 0;
+    rxPassCount = 0;
+    rxLastPassFrameCount = 0;
+    rxMaxPassFrameCount = 0;
+    rxBudgetExhaustedCount = 0;
+    rxErrorCount = 0;
+    rxDiscardCount = 0;
+    rxPoppedCount = 0;
+    rxLatencyMaxUs = 0;
+    rxLatencyTotalUs = 0;
+
+    for ( int p = 0; p < NUM_CAN_TX_PRIORITIES; p++ ) {
+        txHead[p] = 0;
+        txTail[p] = 0;
+    }
+    txDepth = 0;
+    txMaxDepth = 0;
+    txQueuedCount = 0;
+    txLoadedCount = 0;
+    txSentCount = 0;
+    txDropCount = 0;
+    txLatencyMaxUs = 0;
+    txLatencyTotalUs = 0;
+    txBatchBuffers = 0;
+    txBatchRemaining = 0;
+    txBatchStartTime = Timestamp();
+    txBatchSpanUs = 0;
+    txBatchSpanMaxUs = 0;
+    for ( int b = 0; b < 3; b++ ) {
+        txBufferId[b] = 0;
+        txBufferTag[b] = 0;
+    }
+    txSentHandler = NULL;
+
+    extern SpiBus spiBus;
+    printf("[%s][init] setting up CAN port (CS:%d, INT:%d)\n", name, csPin, intPin);
+    CAN = new MCP2515(&spiBus, csPin, spiClock);
+    MCP2515::ERROR result = reset_at_working_clock(spiClock);
+    if ( result != MCP2515::ERROR_OK ) {
+        printf("[%s][init] WARNING problem resetting CAN port : %d\n", name, result);
+    }
+    #if SPI_BENCHMARK
+    benchmark_spi();
+    #endif
+    result = CAN->setBitrate(CAN_500KBPS, MCP_8MHZ);
+    if ( result != MCP2515::ERROR_OK ) {
+        printf("[%s][init] WARNING problem setting bitrate on CAN port : %d\n", name, result);
+    }
+    #if CAN_HW_FILTERS
+    result = set_acceptance(acceptance);
+    if ( result != MCP2515::ERROR_OK ) {
+        printf("[%s][init] WARNING problem setting acceptance filters on CAN port : %d\n", name, result);
+    }
+    #endif
+    result = CAN->setNormalMode();
+    if ( result != MCP2515::ERROR_OK ) {
+        printf("[%s][init] WARNING problem setting normal mode on CAN port : %d\n", name, result);
+    }
+
+    // INT is open drain and active low
+    if ( intPin >= 0 ) {
+        // Also interrupt when a TX buffer has been sent, so the queue can refill it
+        CAN->setInterruptMask(CAN->getInterruptMask() | MCP2515::CANINTF_TX0IF | MCP2515::CANINTF_TX1IF
+                              | MCP2515::CANINTF_TX2IF);
+        gpio_init(intPin);
+        gpio_set_dir(intPin, GPIO_IN);
+        gpio_pull_up(intPin);
+        // The IRQ itself is enabled by enable_can_interrupts(), on the CAN core
+        interruptPorts[numInterruptPorts++] = this;
+    }
+}
+
+void CanPort::print() {
+    uint32_t meanLatency = rxPoppedCount > 0 ? rxLatencyTotalUs / rxPoppedCount : 0;
+    printf("[%s] rx:%lu ringOvf:%lu hwOvf:%lu err:%lu latency(mean/max):%lu/%luus\n", name,
+        rxFrameCount, rxRingOverflowCount, rxHardwareOverflowCount, rxErrorCount, meanLatency, rxLatencyMaxUs);
+    printf("[%s] passes:%lu frames/pass(last/max):%u/%u budgetHit:%lu\n", name,
+        rxPassCount, rxLastPassFrameCount, rxMaxPassFrameCount, rxBudgetExhaustedCount);
+    printf("[%s] accepted:%lu discarded:%lu\n", name, rxFrameCount, rxDiscardCount);
+    uint32_t meanTxLatency = txLoadedCount > 0 ? txLatencyTotalUs / txLoadedCount : 0;
+    printf("[%s] tx queued:%lu sent:%lu dropped:%lu depth(now/max):%u/%u latency(mean/max):%lu/%luus\n", name,
+        txQueuedCount, txSentCount, txDropCount, txDepth, txMaxDepth, meanTxLatency, txLatencyMaxUs);
+    printf("[%s] tx batch span(last/max):%lu/%luus\n", name, txBatchSpanUs, txBatchSpanMaxUs);
+    printf("[%s] spi transactions:%lu bytes:%lu\n", name,
+        CAN->getSpiTransactionCount(), CAN->getSpiByteCount());
+}
+
+/*
+ * Reset the controller and check that registers read back correctly at the
+ * requested SPI clock. If they don't, step down through SPI_CLOCK_STEPS until
+ * they do.
+ */
+MCP2515::ERROR CanPort::reset_at_working_clock(uint32_t spiClock) {
+    MCP2515::ERROR result = CAN->reset();
+    if ( CAN->checkReadback() ) {
+        printf("[%s][init] SPI clock %luHz\n", name, spiClock);
+        return result;
+    }
+    printf("[%s][init] WARNING register read-back failed at %luHz\n", name, spiClock);
+
+    for ( uint i = 0; i < sizeof(SPI_CLOCK_STEPS) / sizeof(SPI_CLOCK_STEPS[0]); i++ ) {
+        if ( SPI_CLOCK_STEPS[i] >= spiClock ) {
+            continue;
+        }
+        CAN->setSpiClock(SPI_CLOCK_STEPS[i]);
+        result = CAN->reset();
+        if ( CAN->checkReadback() ) {
+            printf("[%s][init] WARNING SPI clock lowered to %luHz\n", name, SPI_CLOCK_STEPS[i]);
+            return result;
+        }
+        printf("[%s][init] WARNING register read-back failed at %luHz\n", name, SPI_CLOCK_STEPS[i]);
+    }
+
+    return MCP2515::ERROR_FAILINIT;
+}
+
+/*
+ * Time blocking frame reads and writes at each of SPI_CLOCK_STEPS. Writes only
+ * load TXB0, nothing is sent on the CAN bus. Leaves the clock as it was.
+ */
+void CanPort::benchmark_spi() {
+    uint32_t workingClock = CAN->getSpiClock();
+    can_frame frame;
+    frame.can_id = 0x7FF;
+    frame.can_dlc = 8;
+    memset(frame.data, 0xA5, sizeof(frame.data));
+
+    for ( uint i = 0; i < sizeof(SPI_CLOCK_STEPS) / sizeof(SPI_CLOCK_STEPS[0]); i++ ) {
+        CAN->setSpiClock(SPI_CLOCK_STEPS[i]);
+
+        uint64_t start = time_us_64();
+        for ( int n = 0; n < SPI_BENCHMARK_FRAMES; n++ ) {
+            can_frame readFrame;
+            CAN->readMessage(MCP2515::RXB0, &readFrame);
+        }
+        uint32_t readTime = time_us_64() - start;
+
+        start = time_us_64();
+        for ( int n = 0; n < SPI_BENCHMARK_FRAMES; n++ ) {
+            CAN->loadTxBuffer(MCP2515::TXB0, &frame);
+        }
+        uint32_t writeTime = time_us_64() - start;
+
+        printf("[%s][benchmark] %8luHz read:%lu.%02luus/frame write:%lu.%02luus/frame\n", name, SPI_CLOCK_STEPS[i],
+            readTime / SPI_BENCHMARK_FRAMES, ( readTime * 100 / SPI_BENCHMARK_FRAMES ) % 100,
+            writeTime / SPI_BENCHMARK_FRAMES, ( writeTime * 100 / SPI_BENCHMARK_FRAMES ) % 100);
+    }
+
+    CAN->setSpiClock(workingClock);
+}
+
+/*
+ * Program both masks and all six filters so that only the IDs this port
+ * decodes are let into RXB0/RXB1. MASK0 covers RXF0-1 and MASK1 covers RXF2-5,
+ * so leaving either one open would let everything through. Leaves the
+ * controller in config mode.
+ */
+MCP2515::ERROR CanPort::set_acceptance(const CanAcceptance* acceptance) {
+    printf("[%s][init] accepting ID & 0x%03X == 0x%03X\n", name, acceptance->mask, acceptance->filter);
+
+    MCP2515::MASK masks[] = { MCP2515::MASK0, MCP2515::MASK1 };
+    for ( int i = 0; i < 2; i++ ) {
+        MCP2515::ERROR result = CAN->setFilterMask(masks[i], false, acceptance->mask);
+        if ( result != MCP2515::ERROR_OK ) {
+            return result;
+        }
+    }
+
+    MCP2515::RXF filters[] = { MCP2515::RXF0, MCP2515::RXF1, MCP2515::RXF2, MCP2515::RXF3, MCP2515::RXF4, MCP2515::RXF5 };
+    for ( int i = 0; i < 6; i++ ) {
+        MCP2515::ERROR result = CAN->setFilter(filters[i], false, acceptance->filter & acceptance->mask);
+        if ( result != MCP2515::ERROR_OK ) {
+            return result;
+        }
+    }
+
+    return MCP2515::ERROR_OK;
+}
+
+/*
+ * The controller has pulled INT low. Start reading frames out of RXB0/RXB1
+ * before they can be overwritten. If the port is already being drained, leave
+ * a note for service() in case that pass has already looked and found nothing.
+ */
+void CanPort::handle_interrupt() {
+    lastInterruptTime = monotonic_now().as_us();
+    // INT may be a TX buffer coming free
+    try_service_tx();
+    if ( !claim_drain() ) {
+        rxPending = true;
+        return;
+    }
+    start_async_drain();
+}
+
+/*
+ * Called from the decode task. Drains the controller when it has no INT line,
+ * when an interrupt came in during a pass, or when INT is being held low by an
+ * error flag rather than a frame. Returns false if the port needed servicing
+ * but the CAN mutex couldn't be had, or if an INT driven pass has been going
+ * for so long that its SPI callbacks must have been lost.
+ */
+bool CanPort::service() {
+    if ( rxDraining ) {
+        return !drain_is_overdue();
+    }
+    // INT is still high, so there's nothing waiting in the controller and
+    // every TX buffer that finished has already been refilled
+    if ( intPin >= 0 && !rxPending && gpio_get(intPin) ) {
+        if ( txDepth > 0 ) {
+            try_service_tx();
+        }
+        return true;
+    }
+    if ( !mutex_enter_timeout_ms(canMutex, CAN_MUTEX_TIMEOUT_MS) ) {
+        printf("[%s][service] failed to get CAN mutex\n", name);
+        rxErrorCount++;
+        return false;
+    }
+    // An INT driven pass may have started while we waited for the mutex
+    if ( claim_drain() ) {
+        rxPending = false;
+        drain_rx();
+        release_drain();
+    }
+    service_tx();
+    mutex_exit(canMutex);
+    return true;
+}
+
+/*
+ * Only one pass over the controller, INT driven or from service(), may be
+ * pushing onto the ring at a time. Returns false if a pass is already going.
+ */
+bool CanPort::claim_drain() {
+    critical_section_enter_blocking(&lock);
+    bool claimed = !rxDraining;
+    rxDraining = true;
+    if ( claimed ) {
+        rxDrainStartTime = monotonic_now();
+    }
+    critical_section_exit(&lock);
+    return claimed;
+}
+
+// A pass has held the claim for longer than a reader is allowed to go quiet
+bool CanPort::drain_is_overdue() {
+    critical_section_enter_blocking(&lock);
+    bool overdue = rxDraining && elapsed_since(rxDrainStartTime) > milliseconds(RX_CHECK_IN_DEADLINE_MS);
+    critical_section_exit(&lock);
+    return overdue;
+}
+
+void CanPort::release_drain() {
+    critical_section_enter_blocking(&lock);
+    rxDraining = false;
+    critical_section_exit(&lock);
+}
+
+// First link of the INT driven pass : ask the controller which buffer is full.
+// The caller must have claimed the drain.
+void CanPort::start_async_drain() {
+    rxAsyncFrameCount = 0;
+    rxTransaction.callback = rx_status_done;
+    rxTransaction.context = this;
+    if ( !CAN->queueRxStatus(&rxTransaction, rxBuffer) ) {
+        // SPI queue is full, service() will have to do it
+        rxPending = true;
+        end_async_drain();
+    }
+}
+
+void CanPort::end_async_drain() {
+    record_pass(rxAsyncFrameCount);
+    release_drain();
+}
+
+// RX STATUS is back. Read the buffer it points at, or stop if both are empty.
+void CanPort::rx_status_done(SpiTransaction* transaction) {
+    CanPort* port = static_cast<CanPort*>(transaction->context);
+    int rxb = MCP2515::rxStatusBuffer(port->rxBuffer);
+    if ( rxb < 0 ) {
+        port->end_async_drain();
+        return;
+    }
+    transaction->callback = rx_read_done;
+    if ( !port->CAN->queueReadMessage(static_cast<MCP2515::RXBn>(rxb), transaction, port->rxBuffer) ) {
+        port->rxPending = true;
+        port->end_async_drain();
+    }
+}
+
+// A frame is in. Put it on the ring and go back for the next one.
+void CanPort::rx_read_done(SpiTransaction* transaction) {
+    CanPort* port = static_cast<CanPort*>(transaction->context);
+    can_frame frame;
+    if ( port->CAN->decodeRxBuffer(&port->rxBuffer[1], &frame) == MCP2515::ERROR_OK ) {
+        port->push_frame(&frame, Timestamp::from_us(port->lastInterruptTime));
+    } else {
+        port->rxErrorCount++;
+    }
+    port->rxAsyncFrameCount++;
+
+    if ( port->rxAsyncFrameCount == CAN_RX_BUDGET_PER_PASS ) {
+        port->rxBudgetExhaustedCount++;
+        port->rxPending = true;
+        port->end_async_drain();
+        return;
+    }
+
+    transaction->callback = rx_status_done;
+    if ( !port->CAN->queueRxStatus(transaction, port->rxBuffer) ) {
+        port->rxPending = true;
+        port->end_async_drain();
+    }
+}
+
+/*
+ * Keep moving frames from the controller into the ring until it reports that
+ * it has nothing left, or until we've used up this pass's budget. Then clear
+ * any error condition so that INT is released. Caller must hold canMutex.
+ */
+void CanPort::drain_rx() {
+    Timestamp timestamp = ( intPin >= 0 ) ? Timestamp::from_us(lastInterruptTime) : monotonic_now();
+    can_frame frame;
+    uint16_t framesRead = 0;
+
+    while ( framesRead < CAN_RX_BUDGET_PER_PASS ) {
+        MCP2515::ERROR result = CAN->readMessage(&frame);
+        if ( result == MCP2515::ERROR_NOMSG ) {
+            break;
+        }
+        if ( result != MCP2515::ERROR_OK ) {
+            rxErrorCount++;
+            break;
+        }
+        push_frame(&frame, timestamp);
+        framesRead++;
+    }
+
+    // More frames may still be waiting. INT stays low, so there won't be
+    // another edge. Let service() pick them up.
+    if ( framesRead == CAN_RX_BUDGET_PER_PASS ) {
+        rxBudgetExhaustedCount++;
+        rxPending = true;
+    }
+
+    record_pass(framesRead);
+
+    if ( CAN->getInterrupts() & ( MCP2515::CANINTF_ERRIF | MCP2515::CANINTF_MERRF ) ) {
+        uint8_t errorFlags = CAN->getErrorFlags();
+        if ( errorFlags & MCP2515::EFLG_RX0OVR ) {
+            rxHardwareOverflowCount++;
+        }
+        if ( errorFlags & MCP2515::EFLG_RX1OVR ) {
+            rxHardwareOverflowCount++;
+        }
+        if ( errorFlags & ( MCP2515::EFLG_RX0OVR | MCP2515::EFLG_RX1OVR ) ) {
+            CAN->clearRXnOVRFlags();
+        }
+        CAN->clearERRIF();
+        CAN->clearMERR();
+    }
+}
+
+void CanPort::record_pass(uint16_t framesRead) {
+    if ( framesRead > 0 ) {
+        rxPassCount++;
+        rxLastPassFrameCount = framesRead;
+        if ( framesRead > rxMaxPassFrameCount ) {
+            rxMaxPassFrameCount = framesRead;
+        }
+        if ( rxScheduler != NULL ) {
+            rxScheduler->post(rxTask);
+        }
+    }
+}
+
+/*
+ * Add a frame to the ring. When the ring is full the new frame is dropped.
+ * Only the pass that holds the drain claim calls this, but that pass may be
+ * running on either core, so the frame is written out before rxHead moves.
+ */
+void CanPort::push_frame(can_frame* frame, Timestamp timestamp) {
+    uint16_t next = ( rxHead + 1 ) & ( CAN_RX_RING_SIZE - 1 );
+    if ( next == rxTail ) {
+        rxRingOverflowCount++;
+        return;
+    }
+    rxRing[rxHead] = *frame;
+    rxTimestamp[rxHead] = timestamp;
+    __dmb();
+    rxHead = next;
+    rxFrameCount++;
+}
+
+// Take the oldest frame from the ring. Returns false if the ring is empty.
+bool CanPort::pop_frame(can_frame* frame, Timestamp* timestamp) {
+    if ( rxTail == rxHead ) {
+        return false;
+    }
+    *frame = rxRing[rxTail];
+    if ( timestamp != NULL ) {
+        *timestamp = rxTimestamp[rxTail];
+    }
+    uint32_t latency = elapsed_since(rxTimestamp[rxTail]).as_us();
+    if ( latency > rxLatencyMaxUs ) {
+        rxLatencyMaxUs = latency;
+    }
+    rxLatencyTotalUs += latency;
+    rxPoppedCount++;
+    rxTail = ( rxTail + 1 ) & ( CAN_RX_RING_SIZE - 1 );
+    return true;
+}
+
+/*
+ * Queue a frame to be sent. Never waits: if the SPI bus is busy the frame is
+ * loaded later, and if its queue is full it's dropped and false is returned.
+ * A non-zero tag is handed back to the TX sent handler once this particular
+ * frame has gone out.
+ */
+bool CanPort::queue_frame(const can_frame* frame, CanTxPriority priority, uint32_t tag) {
+    critical_section_enter_blocking(&lock);
+    uint16_t next = ( txHead[priority] + 1 ) & ( CAN_TX_QUEUE_SIZE - 1 );
+    if ( next == txTail[priority] ) {
+        txDropCount++;
+        critical_section_exit(&lock);
+        return false;
+    }
+    txQueue[priority][txHead[priority]] = *frame;
+    txTimestamp[priority][txHead[priority]] = monotonic_now();
+    txInBatch[priority][txHead[priority]] = false;
+    txTag[priority][txHead[priority]] = tag;
+    txHead[priority] = next;
+    txQueuedCount++;
+    txDepth++;
+    if ( txDepth > txMaxDepth ) {
+        txMaxDepth = txDepth;
+    }
+    critical_section_exit(&lock);
+
+    try_service_tx();
+    return true;
+}
+
+/*
+ * Queue a set of frames that belong together, e.g. one poll per module, and
+ * load as many as will fit into the TX buffers under a single hold of the bus.
+ * Returns how many were queued; any that don't fit are dropped.
+ */
+int CanPort::queue_batch(const can_frame* frames, int count, CanTxPriority priority) {
+    Timestamp now = monotonic_now();
+    int queued = 0;
+    critical_section_enter_blocking(&lock);
+    for ( ; queued < count; queued++ ) {
+        uint16_t next = ( txHead[priority] + 1 ) & ( CAN_TX_QUEUE_SIZE - 1 );
+        if ( next == txTail[priority] ) {
+            txDropCount += count - queued;
+            break;
+        }
+        txQueue[priority][txHead[priority]] = frames[queued];
+        txTimestamp[priority][txHead[priority]] = now;
+        txInBatch[priority][txHead[priority]] = true;
+        txTag[priority][txHead[priority]] = 0;
+        txHead[priority] = next;
+    }
+    txQueuedCount += queued;
+    txDepth += queued;
+    if ( txDepth > txMaxDepth ) {
+        txMaxDepth = txDepth;
+    }
+
+    // A new batch replaces the measurement of any batch still going out
+    txBatchRemaining = queued;
+    txBatchStartTime = Timestamp();
+    critical_section_exit(&lock);
+
+    try_service_tx();
+    return queued;
+}
+
+// Load the TX buffers now if nobody else is using the SPI bus
+void CanPort::try_service_tx() {
+    uint32_t owner;
+    if ( !mutex_try_enter(canMutex, &owner) ) {
+        return;
+    }
+    service_tx();
+    mutex_exit(canMutex);
+}
+
+/*
+ * Note any TX buffers that have been sent, then fill every free buffer with the
+ * highest priority frame waiting. Caller must hold canMutex, which makes this
+ * the only consumer of the TX queues. The queues are still shared with
+ * queue_frame() and queue_batch(), so txTail, txDepth and the batch
+ * measurement only change under lock.
+ */
+void CanPort::service_tx() {
+    static const MCP2515::TXBn txBuffers[3] = { MCP2515::TXB0, MCP2515::TXB1, MCP2515::TXB2 };
+    static const uint8_t txreq[3] = { MCP2515::STAT_TX0REQ, MCP2515::STAT_TX1REQ, MCP2515::STAT_TX2REQ };
+    static const uint8_t txif[3] = { MCP2515::STAT_TX0IF, MCP2515::STAT_TX1IF, MCP2515::STAT_TX2IF };
+
+    uint8_t status = CAN->getStatus();
+
+    for ( int b = 0; b < 3; b++ ) {
+        if ( status & txif[b] ) {
+            CAN->clearTXInterrupt(txBuffers[b]);
+            txSentCount++;
+            critical_section_enter_blocking(&lock);
+            if ( ( txBatchBuffers & ( 1 << b ) ) && txBatchRemaining > 0 && txBatchStartTime.is_set() ) {
+                if ( --txBatchRemaining == 0 ) {
+                    txBatchSpanUs = elapsed_since(txBatchStartTime).as_us();
+                    if ( txBatchSpanUs > txBatchSpanMaxUs ) {
+                        txBatchSpanMaxUs = txBatchSpanUs;
+                    }
+                }
+            }
+            critical_section_exit(&lock);
+            txBatchBuffers &= ~( 1 << b );
+            if ( txSentHandler != NULL ) {
+                txSentHandler(txBufferId[b], txBufferTag[b], monotonic_now());
+            }
+        }
+        if ( ( status & txreq[b] ) || txDepth == 0 ) {
+            continue;
+        }
+
+        int p = NUM_CAN_TX_PRIORITIES - 1;
+        while ( p >= 0 && txTail[p] == txHead[p] ) {
+            p--;
+        }
+        if ( p < 0 ) {
+            // txDepth said there was something waiting, but every queue is
+            // empty. Carry on, the other buffers may still have sent.
+            continue;
+        }
+        // The slot is ours until txTail moves past it, so it can be read
+        // without the lock
+        uint16_t slot = txTail[p];
+        bool loaded = CAN->loadTxBuffer(txBuffers[b], &txQueue[p][slot]) == MCP2515::ERROR_OK;
+        if ( loaded ) {
+            CAN->requestToSend(txBuffers[b], p);
+            txBufferId[b] = txQueue[p][slot].can_id;
+            txBufferTag[b] = txTag[p][slot];
+            txLoadedCount++;
+            if ( txInBatch[p][slot] ) {
+                txBatchBuffers |= ( 1 << b );
+                critical_section_enter_blocking(&lock);
+                if ( !txBatchStartTime.is_set() ) {
+                    txBatchStartTime = monotonic_now();
+                }
+                critical_section_exit(&lock);
+            }
+            uint32_t latency = elapsed_since(txTimestamp[p][slot]).as_us();
+            if ( latency > txLatencyMaxUs ) {
+                txLatencyMaxUs = latency;
+            }
+            txLatencyTotalUs += latency;
+        }
+
+        critical_section_enter_blocking(&lock);
+        if ( !loaded ) {
+            // Bad frame, it will never load
+            txDropCount++;
+        }
+        txTail[p] = ( slot + 1 ) & ( CAN_TX_QUEUE_SIZE - 1 );
+        txDepth--;
+        critical_section_exit(&lock);
+    }
+}
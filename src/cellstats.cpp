@@ -0,0 +1,110 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "include/cellstats.h"
+
+#define RATE_LIMIT 32767                            // Largest rate of change kept, in mV/min
+#define VARIANCE_DIFF_LIMIT 32767                   // Largest difference from the mean squared, in mV << 4
+
+
+CellStats::CellStats() {
+    reset_all();
+    updateFrameCount = 0;
+    updateTimeUs = 0;
+}
+
+// Cost of keeping the statistics up to date, so it shows up in the status output
+void CellStats::print() {
+    uint32_t meanNs = updateFrameCount > 0 ? updateTimeUs * 1000 / updateFrameCount : 0;
+    printf("[cellstats] %u bytes, frames:%lu mean update:%luns/frame\n", sizeof(CellStats), updateFrameCount, meanNs);
+}
+
+/*
+ * Fold a frame's worth of readings into the statistics. The first reading
+ * after a reset seeds the cell. After that, each of mean, variance and rate
+ * moves 1/2^CELL_STATS_EWMA_SHIFT of the way towards the new value.
+ */
+void CellStats::update(int pack, int module, int firstCell, const uint16_t* voltages, int count, Timestamp now) {
+    uint64_t startTime = time_us_64();
+    uint32_t nowMs = now.as_ms();
+    for ( int i = 0; i < count; i++ ) {
+        int c = firstCell + i;
+        uint16_t v = voltages[i];
+        int32_t scaled = (int32_t)v << CELL_STATS_FRACTION_BITS;
+
+        if ( !( seeded[pack][module] & ( 1u << c ) ) ) {
+            mean[pack][module][c] = scaled;
+            variance[pack][module][c] = 0;
+            rate[pack][module][c] = 0;
+            minimum[pack][module][c] = v;
+            maximum[pack][module][c] = v;
+            seeded[pack][module] |= 1u << c;
+        } else {
+            // Variance uses the difference from the mean before this reading,
+            // in 1/16 mV so the square stays within 32 bits
+            int32_t diff = ( scaled - mean[pack][module][c] ) >> ( CELL_STATS_FRACTION_BITS - 4 );
+            diff = diff > VARIANCE_DIFF_LIMIT ? VARIANCE_DIFF_LIMIT : diff < -VARIANCE_DIFF_LIMIT ? -VARIANCE_DIFF_LIMIT : diff;
+            int32_t squared = diff * diff;
+            variance[pack][module][c] += ( squared - (int32_t)variance[pack][module][c] ) >> CELL_STATS_EWMA_SHIFT;
+            mean[pack][module][c] += ( scaled - mean[pack][module][c] ) >> CELL_STATS_EWMA_SHIFT;
+
+            uint32_t elapsedMs = nowMs - lastTimeMs[pack][module][c];
+            if ( elapsedMs > 0 ) {
+                int32_t perMinute = ( (int32_t)v - last[pack][module][c] ) * 60000 / (int32_t)elapsedMs;
+                perMinute = perMinute > RATE_LIMIT ? RATE_LIMIT : perMinute < -RATE_LIMIT ? -RATE_LIMIT : perMinute;
+                rate[pack][module][c] += ( ( perMinute << CELL_STATS_FRACTION_BITS ) - rate[pack][module][c] )
+                    >> CELL_STATS_EWMA_SHIFT;
+            }
+
+            minimum[pack][module][c] = v < minimum[pack][module][c] ? v : minimum[pack][module][c];
+            maximum[pack][module][c] = v > maximum[pack][module][c] ? v : maximum[pack][module][c];
+        }
+        last[pack][module][c] = v;
+        lastTimeMs[pack][module][c] = nowMs;
+    }
+    updateTimeUs += time_us_64() - startTime;
+    updateFrameCount++;
+}
+
+// Statistics for one cell. Returns false if the cell has had no reading since
+// it was last reset.
+bool CellStats::get(int pack, int module, int cell, CellStatsSample* sample) {
+    if ( !( seeded[pack][module] & ( 1u << cell ) ) ) {
+        return false;
+    }
+    sample->mean = mean[pack][module][cell] >> CELL_STATS_FRACTION_BITS;
+    sample->variance = variance[pack][module][cell];
+    sample->minimum = minimum[pack][module][cell];
+    sample->maximum = maximum[pack][module][cell];
+    sample->rate = rate[pack][module][cell] >> CELL_STATS_FRACTION_BITS;
+    return true;
+}
+
+// Start one cell's statistics again from its next reading
+void CellStats::reset(int pack, int module, int cell) {
+    seeded[pack][module] &= ~( 1u << cell );
+}
+
+// Start every cell's statistics again from its next reading
+void CellStats::reset_all() {
+    memset(seeded, 0, sizeof(seeded));
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "include/cellstore.h"
+
+
+CellStore::CellStore() {
+    memset(voltage, 0, sizeof(voltage));
+    memset(temperature, -127, sizeof(temperature));
+    memset(voltageValid, 0, sizeof(voltageValid));
+    memset(temperatureValid, 0, sizeof(temperatureValid));
+    scanCount = 0;
+    scanTimeUs = 0;
+}
+
+// Time one full scan, so that the cost of walking the whole battery shows up
+// in the status output
+void CellStore::print() {
+    uint16_t lowest, highest;
+    uint32_t total;
+    scan_voltages(&lowest, &highest, &total);
+    uint32_t meanNs = scanCount > 0 ? scanTimeUs * 1000 / scanCount : 0;
+    printf("[cells] %d cells lo:%u hi:%u sum:%lumV, full scan mean:%luns\n", NUM_CELLS, lowest, highest, total,
+        meanNs);
+}
+
+// Lowest, highest and total voltage of every cell in the battery, in one pass
+void CellStore::scan_voltages(uint16_t* lowest, uint16_t* highest, uint32_t* total) {
+    uint64_t startTime = time_us_64();
+    const uint16_t* cell = &voltage[0][0][0];
+    uint16_t lo = 0xFFFF;
+    uint16_t hi = 0;
+    uint32_t sum = 0;
+    for ( int c = 0; c < NUM_CELLS; c++ ) {
+        uint16_t v = cell[c];
+        lo = v < lo ? v : lo;
+        hi = v > hi ? v : hi;
+        sum += v;
+    }
+    *lowest = lo;
+    *highest = hi;
+    *total = sum;
+    scanTimeUs += time_us_64() - startTime;
+    scanCount++;
+}
@@ -31,13 +31,42 @@ typedef uint8_t crc;
 #define WIDTH  (8 * sizeof(crc))
 #define TOPBIT (1 << (WIDTH - 1))
 
+struct CRC8Table {
+    crc entries[256];
+};
+
+constexpr CRC8Table make_crc8_table() {
+    CRC8Table table = {};
+    for (int dividend = 0; dividend < 256; ++dividend) {
+        crc remainder = dividend << (WIDTH - 8);
+
+        for (uint8_t bit = 8; bit > 0; --bit) {
+            if (remainder & TOPBIT) {
+                remainder = (remainder << 1) ^ POLYNOMIAL;
+            } else {
+                remainder = (remainder << 1);
+            }
+        }
+        table.entries[dividend] = remainder;
+    }
+    return table;
+}
+
+// Worked out by the compiler, so there is one copy, in flash
+inline constexpr CRC8Table CRC8_TABLE = make_crc8_table();
+
 class CRC8 {
  public:
-    CRC8();
-    void begin();
-    crc get_crc8(uint8_t const message[], int nBytes, uint8_t final);
- private:
-    uint8_t crcTable[256];
+    static constexpr crc get_crc8(uint8_t const message[], int nBytes, uint8_t final) {
+        crc remainder = 0xFF;
+
+        for (int byte = 0; byte < nBytes; ++byte) {
+            uint8_t data = message[byte] ^ (remainder >> (WIDTH - 8));
+            remainder = CRC8_TABLE.entries[data] ^ (remainder << 8);
+        }
+
+        return remainder ^ final;
+    }
 };
 
 #endif  // BMS_SRC_INCLUDE_CRC8_H_
@@ -21,31 +21,72 @@
 #define BMS_SRC_INCLUDE_BATTERY_H_
 
 #include "include/pack.h"
+#include "include/cellstore.h"
+#include "include/cellstats.h"
 #include "include/bms.h"
 #include "settings.h"
 
 
+// The battery layout is fixed at compile time. Catch settings that don't fit.
+static_assert(NUM_PACKS >= 1, "Need at least one pack");
+static_assert(sizeof(CS_PINS) / sizeof(CS_PINS[0]) == NUM_PACKS, "One CS pin per pack");
+static_assert(sizeof(CAN_INT_PINS) / sizeof(CAN_INT_PINS[0]) == NUM_PACKS, "One INT pin per pack");
+static_assert(sizeof(CAN_SPI_CLOCKS) / sizeof(CAN_SPI_CLOCKS[0]) == NUM_PACKS, "One SPI clock per pack");
+static_assert(sizeof(CONTACTOR_FEEDBACK_PINS) / sizeof(CONTACTOR_FEEDBACK_PINS[0]) == NUM_PACKS,
+    "One contactor feedback pin per pack");
+static_assert(sizeof(INHIBIT_CONTACTOR_PINS) / sizeof(INHIBIT_CONTACTOR_PINS[0]) == NUM_PACKS,
+    "One inhibit contactor pin per pack");
+static_assert(NUM_PACKS * MODULES_PER_PACK <= 40, "The 0x353 liveness message has room for 40 modules");
+
 class Io;
 
+/*
+ * The battery-wide figures, all worked out from the same set of readings.
+ * Health checks and outbound CAN messages read these rather than going back
+ * to the packs.
+ */
+struct BatterySnapshot {
+   millivolts_t voltage;               // Total voltage of whole battery
+   uint16_t lowestCellVoltage;         // Voltage of cell with lowest voltage across whole battery
+   uint16_t highestCellVoltage;        // Voltage of cell with highest voltage across whole battery
+   uint8_t cellDelta;                  // Largest cell delta of any pack
+   uint32_t voltageDeltaBetweenPacks;  // Largest voltage difference between any two packs
+   bool hasEmptyCell;                  // A cell is at or below CELL_EMPTY_VOLTAGE
+   bool hasFullCell;                   // A cell is at or above CELL_FULL_VOLTAGE
+   int8_t lowestSensorTemperature;     // Coldest sensor, in C
+   int8_t highestSensorTemperature;    // Hottest sensor, in C
+   Timestamp time;                     // When the snapshot was taken
+   Timestamp newestFrameTime;          // When the newest frame that went into it arrived
+
+   bool too_hot() const { return highestSensorTemperature >= MAXIMUM_TEMPERATURE; }
+   bool too_cold_to_charge() const { return lowestSensorTemperature < CHARGE_TEMPERATURE_MINIMUM; }
+   bool cell_delta_above_warn() const { return cellDelta > CELL_DELTA_WARN_THRESHOLD; }
+   bool cell_delta_above_alarm() const { return cellDelta > CELL_DELTA_ALARM_THRESHOLD; }
+};
+
 class Battery {
    private:
       BatteryPack packs[NUM_PACKS];
-      int numPacks;                    // Number of battery packs in this battery
-      uint32_t voltage;                // Total voltage of whole battery
-      uint16_t lowestCellVoltage;      // Voltage of cell with lowest voltage across whole battery
-      uint16_t highestCellVoltage;     // Voltage of cell with highest voltage across whole battery
+      CellStore* cells;                // Every cell reading, the modules in packs[] are views into it
+      CellStats* stats;                // Running statistics for every cell
+      BatterySnapshot published[2];    // Written by publish_snapshot(), readers use published[sequence & 1]
+      volatile uint32_t sequence;      // Bumped before each copy in published[] is written
+      BatterySnapshot pending;         // Being filled in by recompute
+      uint32_t snapshotRetryCount;     // Reads that started again because a publish got in
       uint32_t minimumBatteryVoltage;  // Lowest permitted voltage of the whole battery
       uint32_t maximumBatteryVoltage;  // Highest permitted voltage of the whole battery
-      uint8_t cellDelta;               // FIXME todo
-      float lowestSensorTemperature;   //
-      float highestSensorTemperature;  //
+      uint32_t recomputeCount;         // Times the battery figures were recalculated
+      uint32_t decodePassCount;        // Passes over the packs that decoded at least one frame
+      uint32_t lastRecomputeCount;     // recomputeCount at the last print
+      uint32_t lastDecodePassCount;    // decodePassCount at the last print
+      Timestamp lastPrintTime;         // When print() last ran
       Bms* bms;
       mutex_t* canMutex;
       Io* io;
 
    public:
       Battery() {};
-      Battery(Io* _io);
+      Battery(Io* _io, CellStore* _cells, CellStats* _stats);
       void initialise(Bms* _bms);
       int print();
 
@@ -55,11 +96,13 @@ class Battery {
       uint16_t get_can_tx_error_count_for_pack(int packId) { return packs[packId].get_can_tx_error_count(); }
       uint16_t get_can_rx_error_count_for_pack(int packId) { return packs[packId].get_can_rx_error_count(); }
 
+      void recompute();
+      void publish_snapshot();
+      BatterySnapshot get_snapshot();
+
       // Voltage
       uint32_t get_voltage();
-      void set_voltage(uint32_t voltage) { this->voltage = voltage; }
       void recalculate_voltage();
-      void recalculate_cell_delta();
       uint32_t get_max_voltage();
       uint32_t get_min_voltage();
       int get_index_of_high_pack();
@@ -75,8 +118,8 @@ class Battery {
       BatteryPack* get_pack_with_highest_voltage();
       bool packs_are_imbalanced();
       uint8_t get_cell_delta();
-      bool cell_delta_above_warn() { return get_cell_delta() > CELL_DELTA_WARN_THRESHOLD; }
-      bool cell_delta_above_alarm() { return get_cell_delta() > CELL_DELTA_ALARM_THRESHOLD; }
+      bool cell_delta_above_warn() { return get_snapshot().cell_delta_above_warn(); }
+      bool cell_delta_above_alarm() { return get_snapshot().cell_delta_above_alarm(); }
 
       // Temperature
       void update_highest_sensor_temperature();
@@ -22,23 +22,42 @@
 
 #include <stdio.h>
 #include <string>
-#include <time.h>
 #include "include/statemachine.h"
 #include "include/io.h"
 #include "include/led.h"
 #include "include/battery.h"
 #include "include/shunt.h"
 #include "include/util.h"
+#include "include/canport.h"
+#include "include/corequeue.h"
+#include "include/monotime.h"
+
+
+void build_limits_message(can_frame* frame);
+void build_bms_state_message(can_frame* frame);
+void build_module_liveness_message(can_frame* frame);
+void build_main_can_error_counters_message(can_frame* frame);
+void build_soc_message(can_frame* frame);
+void build_status_message(can_frame* frame);
+void build_pack_can_error_counters_message(can_frame* frame);
+void build_alarm_message(can_frame* frame);
+void handle_main_CAN_messages();
+void apply_shunt_updates();
+
+struct BatterySnapshot;
+
+// A shunt reading decoded on the CAN core, waiting to be applied on core 0
+struct ShuntUpdate {
+    uint8_t route;                                  // Index into shuntRoutes
+    int32_t value;                                  // As the shunt sent it
+};
 
-
-bool send_limits_message(struct repeating_timer *t);
-bool send_bms_state_message(struct repeating_timer *t);
-bool send_module_liveness_message(struct repeating_timer *t);
-bool send_soc_message(struct repeating_timer *t);
-bool send_status_message(struct repeating_timer *t);
-bool send_alarm_message(struct repeating_timer *t);
-bool handle_main_CAN_messages(struct repeating_timer *t);
-bool check_liveness(struct repeating_timer *t);
+// A frame for the main bus, queued on core 0 and sent by the CAN core
+struct MainTxRequest {
+    can_frame frame;
+    CanTxPriority priority;
+    uint32_t tag;                                   // For CanPort::queue_frame()
+};
 
 enum InhibitReason {
     R_NONE,
@@ -65,8 +84,7 @@ class Bms {
         uint8_t soc;                           // State of charge of the battery
         bool internalError;                    // 
         bool watchdogReboot;                   //
-        clock_t lastTimePackVoltagesMatched;   //
-        MCP2515* CAN;                          //
+        CanPort* canPort;                      // The main CAN bus
         struct can_frame canFrame;             //
         uint16_t invalidEventCounter;          // Count how many times the state machine has seen an invalid event
         bool illegalStateTransition;           //
@@ -77,7 +95,15 @@ class Bms {
         bool packContactorsWelded[NUM_PACKS];  //
 
         uint32_t canTxErrorCount;              // Track number of times we've failed to send a CAN message on the main bus
-        uint32_t canRxErrorCount;              // Track number of times we've failed to read a CAN message on the main bus
+
+        CoreQueue<ShuntUpdate, CORE_QUEUE_SIZE> shuntUpdates;       // CAN core to core 0
+        CoreQueue<MainTxRequest, CORE_QUEUE_SIZE> mainTxRequests;   // Core 0 to the CAN core
+        int mainCanTask;                       // Services the main port, posted when mainTxRequests is pushed
+
+        Timestamp lastCheckedSnapshotTime;     // Snapshot the health checks last looked at
+        uint32_t safetyLatencyMaxUs;           // Longest time from a frame arriving to a health check acting on it
+        uint64_t safetyLatencyTotalUs;         // Running total, for the mean
+        uint32_t safetyLatencyCount;           // Snapshots the health checks have acted on
 
     public:
         Bms() {};
@@ -144,10 +170,12 @@ class Bms {
 
         // Charger
         uint16_t get_max_charge_current_by_soc();
+        void update_limits();
         void update_max_charge_current();
         uint16_t get_max_charge_current();
         void update_max_discharge_current();
         uint16_t get_max_discharge_current();
+        void check_limit_change(uint16_t previous, uint16_t current);
 
         // Status light
         void led_blink();
@@ -156,14 +184,20 @@ class Bms {
         bool packs_are_imbalanced();
 
         // CAN
-        bool send_frame(can_frame* frame, bool doChecksum);
+        bool send_frame(can_frame* frame, bool doChecksum, CanTxPriority priority = CAN_TX_TELEMETRY, uint32_t tag = 0);
+        bool service_can_port();
+        bool queue_shunt_update(uint8_t route, int32_t value) { return shuntUpdates.push({ route, value }); }
+        bool next_shunt_update(ShuntUpdate* update) { return shuntUpdates.pop(update); }
+        void record_safety_latency(const BatterySnapshot& snapshot);
+        void count_discarded_frame() { canPort->count_discarded_frame(); }
         bool read_frame(can_frame* frame);
         void send_shunt_reset_message();
 
         void increment_can_tx_error_count() { canTxErrorCount++; }
-        void increment_can_rx_error_count() { canRxErrorCount++; }
         uint32_t get_can_tx_error_count() { return canTxErrorCount; }
-        uint32_t get_can_rx_error_count() { return canRxErrorCount; }
+        uint32_t get_can_rx_error_count() { return canPort->get_rx_error_count(); }
+        uint16_t get_tx_max_depth() { return canPort->get_tx_max_depth(); }
+        uint16_t get_tx_request_max_depth() { return mainTxRequests.get_max_depth(); }
 };
 
 #endif  // BMS_SRC_INCLUDE_BMS_H_
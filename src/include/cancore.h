@@ -0,0 +1,35 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_SRC_INCLUDE_CANCORE_H_
+#define BMS_SRC_INCLUDE_CANCORE_H_
+
+#include "pico/stdlib.h"
+#include "include/scheduler.h"
+#include "include/monotime.h"
+#include "settings.h"
+
+#define CAN_CORE ( CAN_ON_CORE1 ? 1 : 0 )          // Core that services the CAN ports and decodes frames
+
+void initialise_can_core();
+int add_can_task(const char* name, TaskCallback callback, TaskPriority priority, Duration period, Duration deadline);
+Scheduler* get_can_scheduler();
+void start_can_core();
+
+#endif  // BMS_SRC_INCLUDE_CANCORE_H_
@@ -0,0 +1,201 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_SRC_INCLUDE_CANPORT_H_
+#define BMS_SRC_INCLUDE_CANPORT_H_
+
+#include "pico/multicore.h"
+#include "pico/critical_section.h"
+#include "mcp2515/mcp2515.h"
+#include "include/monotime.h"
+#include "include/scheduler.h"
+#include "settings.h"
+
+#define NUM_CAN_PORTS ( NUM_PACKS + 1 )             // One port per pack, plus the main bus
+#define MAIN_CAN_PORT 0                             // Index of the main bus in CAN_ACCEPTANCE
+#define PACK_CAN_PORT(pack) ( 1 + (pack) )          // Index of a pack bus in CAN_ACCEPTANCE
+
+// Standard IDs accepted by a controller. A frame gets in when
+// ( id & mask ) == ( filter & mask ).
+struct CanAcceptance {
+    uint16_t mask;
+    uint16_t filter;
+};
+
+const CanAcceptance CAN_ACCEPTANCE[NUM_CAN_PORTS] = {
+    { 0x7E0, 0x520 },                               // main : ISA shunt, 0x521 - 0x528, cell and task stats queries, 0x530 and 0x533
+    { 0x700, 0x100 },                               // pack0 : battery modules, 0x1xx
+    { 0x700, 0x100 },                               // pack1 : battery modules, 0x1xx
+};
+
+static_assert((CAN_RX_RING_SIZE & (CAN_RX_RING_SIZE - 1)) == 0, "CAN_RX_RING_SIZE must be a power of two");
+static_assert((CAN_TX_QUEUE_SIZE & (CAN_TX_QUEUE_SIZE - 1)) == 0, "CAN_TX_QUEUE_SIZE must be a power of two");
+
+// Transmit priorities. These are written straight into the TXP bits, so when
+// more than one TX buffer is loaded the controller sends the highest first.
+enum CanTxPriority {
+    CAN_TX_TELEMETRY = 0,                           // Status, counters, anything that will be sent again shortly
+    CAN_TX_POLL      = 1,                           // Module polls
+    CAN_TX_CONTROL   = 2,                           // Limits and BMS state
+    CAN_TX_ALARM     = 3,                           // Alarms
+    NUM_CAN_TX_PRIORITIES
+};
+
+// Called from service_tx() for each frame the controller reports sent, with the
+// tag it was queued with. Runs on the CAN core, possibly from the INT handler.
+typedef void (*CanTxSentHandler)(uint32_t canId, uint32_t tag, Timestamp sentTime);
+
+void handle_can_interrupt(uint gpio);
+void enable_can_interrupts();
+
+/*
+ * One MCP2515 CAN controller. Inbound frames are moved out of the controller's
+ * two receive buffers and into a ring as soon as the controller pulls its INT
+ * line low. Each pass keeps reading until the controller is empty, or until
+ * CAN_RX_BUDGET_PER_PASS frames have been read. Decoding then runs off the
+ * ring. Ports without an INT line are drained from service() instead.
+ *
+ * A pass started by INT is a chain of queued SPI transactions, each one
+ * queueing the next from its callback, so the CPU isn't held up while frames
+ * are being read. The callbacks can run on either core, see SpiBus.
+ *
+ * If a decode task has been set with set_rx_task(), it's posted after every
+ * pass that finds a frame, so frames are decoded as soon as they are read.
+ *
+ * Outbound frames are queued by priority and loaded into whichever of
+ * TXB0-TXB2 are free, from the caller if the SPI bus is free, otherwise from
+ * the next TX complete interrupt or service().
+ *
+ * The INT handler runs on the CAN core and can interrupt that core's tasks in
+ * the middle of queueing a frame or starting a pass. That's true whether the
+ * ports have core 1 to themselves or share core 0's scheduler, and the SPI and
+ * DMA interrupts can get in the same way, so the TX queues and the claim on a
+ * pass are only changed under lock.
+ */
+class CanPort {
+    private:
+        char name[16];                                // Used as the prefix for log messages
+        MCP2515* CAN;                                 // The controller for this port
+        mutex_t* canMutex;                            // Shared by every controller on the SPI bus
+        int intPin;                                   // Pin the controller's INT line is wired to, -1 if none
+        critical_section_t lock;                      // Guards the TX queues and rxDraining against the INT handler
+
+        can_frame rxRing[CAN_RX_RING_SIZE];           // Frames read from the controller, waiting to be decoded
+        Timestamp rxTimestamp[CAN_RX_RING_SIZE];      // When each frame in the ring was seen
+        volatile uint16_t rxHead;                     // Next free slot in the ring, only moved by the drain
+        volatile uint16_t rxTail;                     // Oldest frame in the ring, only moved by the decoder
+        volatile bool rxPending;                      // INT fired while the port was already being drained
+        volatile bool rxDraining;                     // A pass over the controller is in progress, see claim_drain()
+        Timestamp rxDrainStartTime;                   // When the pass in progress claimed the port
+        SpiTransaction rxTransaction;                 // The transaction the INT driven pass is waiting on
+        uint8_t rxBuffer[MCP2515::RX_BUFFER_READ_LENGTH];
+        uint16_t rxAsyncFrameCount;                   // Frames read so far in the INT driven pass
+        volatile uint64_t lastInterruptTime;          // When INT last fired, in us
+        Scheduler* rxScheduler;                       // Where to post rxTask when frames arrive, may be NULL
+        int rxTask;                                   // The task that decodes this port's frames
+
+        uint32_t rxFrameCount;                        // Frames moved into the ring
+        uint32_t rxRingOverflowCount;                 // Frames dropped because the ring was full
+        uint32_t rxHardwareOverflowCount;             // Frames lost in the controller (RXnOVR)
+        uint32_t rxPassCount;                         // Passes over the controller that found at least one frame
+        uint16_t rxLastPassFrameCount;                // Frames read in the most recent pass
+        uint16_t rxMaxPassFrameCount;                 // Most frames read in a single pass
+        uint32_t rxBudgetExhaustedCount;              // Passes cut short by CAN_RX_BUDGET_PER_PASS
+        uint32_t rxErrorCount;                        // Failed reads, including failing to get the SPI bus
+        uint32_t rxDiscardCount;                      // Frames that got past the filters but weren't decoded
+        uint32_t rxPoppedCount;                       // Frames taken out of the ring to be decoded
+        uint32_t rxLatencyMaxUs;                      // Longest time from seeing a frame to decoding it
+        uint64_t rxLatencyTotalUs;                    // Running total over rxPoppedCount frames, for the mean
+
+        can_frame txQueue[NUM_CAN_TX_PRIORITIES][CAN_TX_QUEUE_SIZE];
+        Timestamp txTimestamp[NUM_CAN_TX_PRIORITIES][CAN_TX_QUEUE_SIZE];
+        bool txInBatch[NUM_CAN_TX_PRIORITIES][CAN_TX_QUEUE_SIZE];
+        uint32_t txTag[NUM_CAN_TX_PRIORITIES][CAN_TX_QUEUE_SIZE];  // Passed back to txSentHandler, 0 if none
+        volatile uint16_t txHead[NUM_CAN_TX_PRIORITIES];  // Next free slot in each queue
+        volatile uint16_t txTail[NUM_CAN_TX_PRIORITIES];  // Oldest frame in each queue
+        volatile uint16_t txDepth;                    // Frames waiting across all priorities
+        uint16_t txMaxDepth;                          // Most frames ever waiting
+
+        uint32_t txQueuedCount;                       // Frames accepted by queue_frame()
+        uint32_t txLoadedCount;                       // Frames handed to the controller
+        uint32_t txSentCount;                         // Frames the controller reported as sent (TXnIF)
+        uint32_t txDropCount;                         // Frames refused because their queue was full
+        uint32_t txLatencyMaxUs;                      // Longest time from queueing a frame to loading it
+        uint64_t txLatencyTotalUs;                    // Running total, for the mean
+
+        uint8_t txBatchBuffers;                       // TX buffers holding a frame from the current batch
+        uint16_t txBatchRemaining;                    // Frames from the current batch not yet seen sent
+        Timestamp txBatchStartTime;                   // When the first frame of the current batch was loaded
+        uint32_t txBatchSpanUs;                       // First load to last sent, for the most recent batch
+        uint32_t txBatchSpanMaxUs;                    // Longest span seen
+
+        uint32_t txBufferId[3];                       // ID of the frame last loaded into each of TXB0-TXB2
+        uint32_t txBufferTag[3];                      // Tag it was queued with
+        CanTxSentHandler txSentHandler;               // Told about each frame seen sent, may be NULL
+
+        void drain_rx();
+        void record_pass(uint16_t framesRead);
+        void service_tx();
+        void try_service_tx();
+        bool claim_drain();
+        void release_drain();
+        bool drain_is_overdue();
+        void start_async_drain();
+        void end_async_drain();
+        static void rx_status_done(SpiTransaction* transaction);
+        static void rx_read_done(SpiTransaction* transaction);
+        MCP2515::ERROR set_acceptance(const CanAcceptance* acceptance);
+        MCP2515::ERROR reset_at_working_clock(uint32_t spiClock);
+        void benchmark_spi();
+        void push_frame(can_frame* frame, Timestamp timestamp);
+
+    public:
+        CanPort() {};
+        CanPort(const char* _name, uint8_t csPin, int _intPin, uint32_t spiClock, const CanAcceptance* acceptance,
+            mutex_t* _canMutex);
+        void print();
+
+        int get_interrupt_pin() { return intPin; }
+        void handle_interrupt();
+        void set_rx_task(Scheduler* scheduler, int task) { rxScheduler = scheduler; rxTask = task; }
+        void set_tx_sent_handler(CanTxSentHandler handler) { txSentHandler = handler; }
+        bool service();
+        bool pop_frame(can_frame* frame, Timestamp* timestamp = NULL);
+        bool queue_frame(const can_frame* frame, CanTxPriority priority, uint32_t tag = 0);
+        int queue_batch(const can_frame* frames, int count, CanTxPriority priority);
+        void count_discarded_frame() { rxDiscardCount++; }
+
+        uint32_t get_rx_frame_count() { return rxFrameCount; }
+        uint32_t get_rx_ring_overflow_count() { return rxRingOverflowCount; }
+        uint32_t get_rx_hardware_overflow_count() { return rxHardwareOverflowCount; }
+        uint16_t get_rx_last_pass_frame_count() { return rxLastPassFrameCount; }
+        uint16_t get_rx_max_pass_frame_count() { return rxMaxPassFrameCount; }
+        uint32_t get_rx_error_count() { return rxErrorCount; }
+        uint32_t get_rx_discard_count() { return rxDiscardCount; }
+        uint32_t get_rx_latency_max_us() { return rxLatencyMaxUs; }
+        uint16_t get_tx_depth() { return txDepth; }
+        uint16_t get_tx_max_depth() { return txMaxDepth; }
+        uint32_t get_tx_drop_count() { return txDropCount; }
+        uint32_t get_tx_latency_max_us() { return txLatencyMaxUs; }
+        uint32_t get_tx_batch_span_us() { return txBatchSpanUs; }
+        uint32_t get_spi_transaction_count() { return CAN->getSpiTransactionCount(); }
+        uint32_t get_spi_byte_count() { return CAN->getSpiByteCount(); }
+};
+
+#endif  // BMS_SRC_INCLUDE_CANPORT_H_
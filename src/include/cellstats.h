@@ -0,0 +1,73 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_SRC_INCLUDE_CELLSTATS_H_
+#define BMS_SRC_INCLUDE_CELLSTATS_H_
+
+#include "pico/stdlib.h"
+#include "include/monotime.h"
+#include "settings.h"
+
+#define CELL_STATS_FRACTION_BITS 8                  // Fixed point fraction of mean, variance and rate
+
+// One cell's statistics, in whole units
+struct CellStatsSample {
+    uint16_t mean;                                  // Smoothed voltage, in mV
+    uint32_t variance;                              // Smoothed variance, in mV^2 x 256
+    uint16_t minimum;                               // Lowest reading since the last reset, in mV
+    uint16_t maximum;                               // Highest reading since the last reset, in mV
+    int16_t rate;                                   // Smoothed rate of change, in mV/minute
+};
+
+/*
+ * Running statistics for every cell, kept alongside the readings in CellStore
+ * and laid out the same way. Each new reading updates its cell in constant
+ * time with integer maths only: exponentially weighted mean, variance and rate
+ * of change, plus the lowest and highest reading since the cell was last
+ * reset. Nothing is allocated, the whole lot is sized here at compile time.
+ */
+class CellStats {
+    private:
+        int32_t mean[NUM_PACKS][MODULES_PER_PACK][CELLS_PER_MODULE];            // mV << CELL_STATS_FRACTION_BITS
+        uint32_t variance[NUM_PACKS][MODULES_PER_PACK][CELLS_PER_MODULE];       // mV^2 << CELL_STATS_FRACTION_BITS
+        int32_t rate[NUM_PACKS][MODULES_PER_PACK][CELLS_PER_MODULE];            // mV/min << CELL_STATS_FRACTION_BITS
+        uint16_t minimum[NUM_PACKS][MODULES_PER_PACK][CELLS_PER_MODULE];        // Since reset, in mV
+        uint16_t maximum[NUM_PACKS][MODULES_PER_PACK][CELLS_PER_MODULE];        // Since reset, in mV
+        uint16_t last[NUM_PACKS][MODULES_PER_PACK][CELLS_PER_MODULE];           // Previous reading, in mV
+        uint32_t lastTimeMs[NUM_PACKS][MODULES_PER_PACK][CELLS_PER_MODULE];     // When it was taken
+        uint16_t seeded[NUM_PACKS][MODULES_PER_PACK];                           // One bit per cell with a reading
+                                                                                // since reset
+
+        uint32_t updateFrameCount;                                              // Frames passed to update()
+        uint64_t updateTimeUs;                                                  // Time spent in update()
+
+    public:
+        CellStats();
+        void print();
+
+        void update(int pack, int module, int firstCell, const uint16_t* voltages, int count, Timestamp now);
+        bool get(int pack, int module, int cell, CellStatsSample* sample);
+        void reset(int pack, int module, int cell);
+        void reset_all();
+};
+
+static_assert(CELLS_PER_MODULE <= 16, "seeded has one bit per cell");
+static_assert(sizeof(CellStats) <= CELL_STATS_RAM_BUDGET, "Cell statistics are over CELL_STATS_RAM_BUDGET");
+
+#endif  // BMS_SRC_INCLUDE_CELLSTATS_H_
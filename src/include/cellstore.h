@@ -0,0 +1,59 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_SRC_INCLUDE_CELLSTORE_H_
+#define BMS_SRC_INCLUDE_CELLSTORE_H_
+
+#include "pico/stdlib.h"
+#include "settings.h"
+
+static_assert(CELLS_PER_MODULE <= 16, "voltageValid has one bit per cell");
+static_assert(TEMPS_PER_MODULE <= 16, "temperatureValid has one bit per sensor");
+
+/*
+ * Every cell reading in the battery, one array per kind of reading, laid out
+ * [pack][module][cell]. BatteryModule works on its own slice of each array, so
+ * anything that needs the whole battery can walk a single block of memory.
+ */
+class CellStore {
+    private:
+        uint16_t voltage[NUM_PACKS][MODULES_PER_PACK][CELLS_PER_MODULE];        // Cell voltages, in mV
+        int8_t temperature[NUM_PACKS][MODULES_PER_PACK][TEMPS_PER_MODULE];      // Sensor temperatures, in C
+        uint16_t voltageValid[NUM_PACKS][MODULES_PER_PACK];                     // One bit per cell with a reading
+        uint16_t temperatureValid[NUM_PACKS][MODULES_PER_PACK];                 // One bit per sensor with a reading
+
+        uint32_t scanCount;                                                     // Full scans done by scan_voltages()
+        uint64_t scanTimeUs;                                                    // Time spent in them
+
+    public:
+        static const int NUM_CELLS = NUM_PACKS * MODULES_PER_PACK * CELLS_PER_MODULE;
+        static const int NUM_TEMPERATURES = NUM_PACKS * MODULES_PER_PACK * TEMPS_PER_MODULE;
+
+        CellStore();
+        void print();
+
+        uint16_t* module_voltages(int pack, int module) { return voltage[pack][module]; }
+        int8_t* module_temperatures(int pack, int module) { return temperature[pack][module]; }
+        uint16_t* module_voltage_valid(int pack, int module) { return &voltageValid[pack][module]; }
+        uint16_t* module_temperature_valid(int pack, int module) { return &temperatureValid[pack][module]; }
+
+        void scan_voltages(uint16_t* lowest, uint16_t* highest, uint32_t* total);
+};
+
+#endif  // BMS_SRC_INCLUDE_CELLSTORE_H_
@@ -0,0 +1,78 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_SRC_INCLUDE_COREQUEUE_H_
+#define BMS_SRC_INCLUDE_COREQUEUE_H_
+
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+/*
+ * Fixed size queue for handing items from one core to the other. There must be
+ * exactly one producer, which pushes, and one consumer, which pops. Each index
+ * is only written by its own side, so no lock is needed. The barriers make
+ * sure an item is in memory before the index that hands it over moves.
+ */
+template <typename T, int SIZE>
+class CoreQueue {
+    static_assert((SIZE & (SIZE - 1)) == 0, "CoreQueue size must be a power of two");
+
+    private:
+        T items[SIZE];
+        volatile uint16_t head;                     // Next free slot, only moved by the producer
+        volatile uint16_t tail;                     // Oldest item, only moved by the consumer
+        uint32_t dropCount;                         // Pushes turned away because the queue was full
+        uint16_t maxDepth;                          // Most items ever waiting
+
+    public:
+        CoreQueue() : head(0), tail(0), dropCount(0), maxDepth(0) {}
+
+        bool push(const T& item) {
+            uint16_t next = ( head + 1 ) & ( SIZE - 1 );
+            if ( next == tail ) {
+                dropCount++;
+                return false;
+            }
+            items[head] = item;
+            __dmb();
+            head = next;
+            uint16_t waiting = depth();
+            if ( waiting > maxDepth ) {
+                maxDepth = waiting;
+            }
+            return true;
+        }
+
+        bool pop(T* item) {
+            if ( tail == head ) {
+                return false;
+            }
+            __dmb();
+            *item = items[tail];
+            __dmb();
+            tail = ( tail + 1 ) & ( SIZE - 1 );
+            return true;
+        }
+
+        uint16_t depth() { return ( head - tail ) & ( SIZE - 1 ); }
+        uint16_t get_max_depth() { return maxDepth; }
+        uint32_t get_drop_count() { return dropCount; }
+};
+
+#endif  // BMS_SRC_INCLUDE_COREQUEUE_H_
@@ -0,0 +1,50 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_SRC_INCLUDE_FIXEDPOINT_H_
+#define BMS_SRC_INCLUDE_FIXEDPOINT_H_
+
+#include <stdint.h>
+
+/*
+ * Integer units for the values the BMS works with. The RP2040 has no FPU, so
+ * float and double maths ends up in the soft-float library. Keeping everything
+ * in scaled integers avoids that.
+ */
+
+typedef uint32_t millivolts_t;                  // Voltage, in mV
+typedef int32_t milliamps_t;                    // Current, in mA, signed as reported by the shunt
+typedef int16_t decidegrees_t;                  // Temperature, in tenths of a degree C
+
+// Scale factor in Q16, 65536 is 1.0
+typedef uint32_t q16_t;
+
+#define Q16_ONE ( (q16_t)1 << 16 )
+
+// numerator / denominator as a Q16 scale factor. numerator must be below 65536.
+constexpr q16_t q16_from_ratio(uint32_t numerator, uint32_t denominator) {
+    return ( numerator << 16 ) / denominator;
+}
+
+// value * factor. value must be small enough that value * factor fits in 32 bits.
+constexpr int32_t q16_scale(int32_t value, q16_t factor) {
+    return (int32_t)( ( value * (int32_t)factor ) >> 16 );
+}
+
+#endif  // BMS_SRC_INCLUDE_FIXEDPOINT_H_
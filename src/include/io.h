@@ -28,10 +28,11 @@ class Io {
     private:
         Bms* bms;
         // Inputs
-        bool ignitionOn;
-        bool chargeEnable;             // Charger is asking to charge
+        bool ignitionOn;               // As last passed to the state machine
+        bool chargeEnable;             // Charger is asking to charge, as last passed to the state machine
     public:
         Io();
+        void process_input_changes();
         void enable_drive_inhibit(std::string context);
         void disable_drive_inhibit(std::string context);
         bool drive_is_inhibited();
@@ -20,7 +20,8 @@
 #ifndef BMS_SRC_INCLUDE_MODULE_H_
 #define BMS_SRC_INCLUDE_MODULE_H_
 
-#include <time.h>
+#include "include/cellstore.h"
+#include "include/timerwheel.h"
 #include "settings.h"
 
 class BatteryPack;
@@ -28,24 +29,32 @@ class BatteryPack;
 class BatteryModule {
    private:
       int id;
-      int numCells;                              // Number of cells in this module
-      int numTemperatureSensors;                 // Number of temperature sensors in this module
-      uint16_t cellVoltage[CELLS_PER_MODULE];    // Voltages of each cell, stored in mV
-      int8_t cellTemperature[TEMPS_PER_MODULE];  // Temperatures of each cell
+      uint16_t* cellVoltage;                     // Voltages of each cell, stored in mV, in the CellStore
+      uint16_t* cellVoltageValid;                // One bit per cell that has reported a voltage
+      uint32_t voltage;                          // Sum of cellVoltage, kept up to date by set_cell_voltage
+      uint8_t lowestCell;                        // Index of the cell with the lowest voltage
+      uint8_t highestCell;                       // Index of the cell with the highest voltage
+      int8_t* cellTemperature;                   // Temperatures of each cell, in the CellStore
+      uint16_t* cellTemperatureValid;            // One bit per sensor that has reported a temperature
       bool allModuleDataPopulated;               // True when we have voltage/temp information for all cells
-      clock_t lastHeartbeat;                     // Time when we last got an update from this module
+      int livenessTimer;                         // This module's timer in the TimerWheel
       BatteryPack* pack;                         // The parent BatteryPack that contains this module
+      uint32_t pollRttUs;                        // Time from polling this module to its last response frame
+      uint32_t pollRttMaxUs;                     // Longest round trip seen
 
    public:
       BatteryModule();
-      BatteryModule(int _id, BatteryPack* _pack, int _numCells, int _numTemperatureSensors);
+      BatteryModule(int _id, BatteryPack* _pack, CellStore* cells, int packId);
       void print();
 
       // Voltage
       uint32_t get_voltage();
       uint16_t get_lowest_cell_voltage();
       uint16_t get_highest_cell_voltage();
-      void set_cell_voltage(int cellIndex, uint16_t newCellVoltage);
+      uint8_t get_lowest_cell_index() { return lowestCell; }
+      uint8_t get_highest_cell_index() { return highestCell; }
+      bool set_cell_voltage(int cellIndex, uint16_t newCellVoltage);
+      void rescan_cell_voltages();
       bool has_empty_cell();
       bool has_full_cell();
 
@@ -54,9 +63,12 @@ class BatteryModule {
       void check_if_module_data_is_populated();
       bool is_alive();
       void heartbeat();
+      void record_poll_rtt(uint32_t rtt);
+      uint32_t get_poll_rtt_us() { return pollRttUs; }
+      uint32_t get_poll_rtt_max_us() { return pollRttMaxUs; }
 
       // Temperature
-      void update_temperature(int tempSensorId, uint8_t newTemperature);
+      void update_temperature(int tempSensorId, int8_t newTemperature);
       int8_t get_lowest_temperature();
       int8_t get_highest_temperature();
       bool has_temperature_sensor_over_max();
@@ -0,0 +1,98 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_SRC_INCLUDE_MONOTIME_H_
+#define BMS_SRC_INCLUDE_MONOTIME_H_
+
+#include <stdint.h>
+#include "pico/time.h"
+#include "settings.h"
+
+/*
+ * Time on the monotonic clock, in microseconds since boot. Lengths of time are
+ * a Duration and points in time a Timestamp, so they can't be mixed up with
+ * each other or with plain numbers. A Duration can only be made with
+ * microseconds(), milliseconds() or seconds(), so the unit of every constant
+ * is spelt out where it's used.
+ *
+ * Code that times its own running cost, such as the decode and SPI counters,
+ * reads time_us_64() directly, as the fake clock would make those read zero.
+ */
+class Duration {
+    private:
+        int64_t us;
+        constexpr explicit Duration(int64_t _us) : us(_us) {}
+
+    public:
+        constexpr Duration() : us(0) {}
+        friend constexpr Duration microseconds(int64_t n);
+
+        constexpr int64_t as_us() const { return us; }
+        constexpr int64_t as_ms() const { return us / 1000; }
+        constexpr int64_t as_seconds() const { return us / 1000000; }
+
+        constexpr Duration operator+(Duration other) const { return Duration(us + other.us); }
+        constexpr Duration operator-(Duration other) const { return Duration(us - other.us); }
+        constexpr Duration operator*(int64_t n) const { return Duration(us * n); }
+        constexpr bool operator<(Duration other) const { return us < other.us; }
+        constexpr bool operator>(Duration other) const { return us > other.us; }
+        constexpr bool operator<=(Duration other) const { return us <= other.us; }
+        constexpr bool operator>=(Duration other) const { return us >= other.us; }
+        constexpr bool operator==(Duration other) const { return us == other.us; }
+};
+
+constexpr Duration microseconds(int64_t n) { return Duration(n); }
+constexpr Duration milliseconds(int64_t n) { return microseconds(n * 1000); }
+constexpr Duration seconds(int64_t n) { return microseconds(n * 1000000); }
+
+class Timestamp {
+    private:
+        uint64_t us;
+        constexpr explicit Timestamp(uint64_t _us) : us(_us) {}
+
+    public:
+        constexpr Timestamp() : us(0) {}                   // Boot, also used for "never"
+        static constexpr Timestamp from_us(uint64_t us) { return Timestamp(us); }
+
+        constexpr uint64_t as_us() const { return us; }
+        constexpr uint32_t as_ms() const { return us / 1000; }
+        constexpr bool is_set() const { return us != 0; }
+
+        constexpr Timestamp operator+(Duration d) const { return Timestamp(us + d.as_us()); }
+        constexpr Duration operator-(Timestamp earlier) const { return microseconds((int64_t)( us - earlier.us )); }
+        constexpr bool operator<(Timestamp other) const { return us < other.us; }
+        constexpr bool operator>(Timestamp other) const { return us > other.us; }
+        constexpr bool operator==(Timestamp other) const { return us == other.us; }
+};
+
+#if FAKE_CLOCK
+// Time only moves when told to, so timing logic can be stepped through off
+// target. See fake_clock_set() and fake_clock_advance().
+extern Timestamp fakeClockNow;
+
+inline Timestamp monotonic_now() { return fakeClockNow; }
+inline void fake_clock_set(Timestamp now) { fakeClockNow = now; }
+inline void fake_clock_advance(Duration d) { fakeClockNow = fakeClockNow + d; }
+#else
+inline Timestamp monotonic_now() { return Timestamp::from_us(time_us_64()); }
+#endif
+
+inline Duration elapsed_since(Timestamp then) { return monotonic_now() - then; }
+
+#endif  // BMS_SRC_INCLUDE_MONOTIME_H_
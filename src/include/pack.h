@@ -24,14 +24,45 @@
 
 #include "hardware/timer.h"
 #include "mcp2515/mcp2515.h"
+#include "include/canport.h"
 #include "include/module.h"
+#include "include/cellstore.h"
+#include "include/cellstats.h"
+#include "include/fixedpoint.h"
+#include "include/monotime.h"
 #include "include/CRC8.h"
 #include "settings.h"
 
 class Battery;
 class Bms;
 
-const uint8_t finalxor[12] = { 0xCF, 0xF5, 0xBB, 0x81, 0x27, 0x1D, 0x53, 0x69, 0x02, 0x38, 0x76, 0x4C };
+// What BatteryPack::recompute() found had changed
+#define PACK_VOLTAGES_CHANGED 0x01
+#define PACK_TEMPERATURES_CHANGED 0x02
+
+/*
+ * Where a frame from a battery module goes. Module frames are 0x1T0 | module,
+ * and the message type T picks the route.
+ */
+struct PackRoute {
+    void (BatteryPack::*decode)(can_frame* frame, int moduleId, const PackRoute* route);
+    uint8_t firstCell;                               // First cell carried by the frame
+    uint8_t numCells;                                // Number of cells carried by the frame
+    uint8_t changes;                                 // PACK_*_CHANGED flags the frame can set, 0 for heartbeats
+};
+
+#define PACK_FRAME_BASE_ID 0x100                     // CAN ID of message type 0 from module 0
+#define NUM_PACK_ROUTES 9                            // Message types 0x100 - 0x180
+#define CELLS_PER_VOLTAGE_FRAME 3
+#define POLL_CYCLES 15                               // modulePollingCycle runs from 0x0 to 0xE
+
+static_assert(MODULES_PER_PACK >= 1, "Need at least one module per pack");
+static_assert(MODULES_PER_PACK <= 16, "The module number is the low nibble of the module CAN IDs");
+static_assert(TEMPS_PER_MODULE <= 8, "Temperatures are one byte each in a single frame");
+
+constexpr uint8_t finalxor[12] = { 0xCF, 0xF5, 0xBB, 0x81, 0x27, 0x1D, 0x53, 0x69, 0x02, 0x38, 0x76, 0x4C };
+
+static_assert(MODULES_PER_PACK <= sizeof(finalxor), "No checksum xor value for some modules");
 
 class BatteryPack {
 
@@ -39,18 +70,33 @@ class BatteryPack {
       int id;
 
       BatteryPack();
-      BatteryPack(int _id, int CANCSPin, int _contactorPin, int _contactorFeedbackPin, int _numModules,
-            int _numCellsPerModule, int _numTemperatureSensorsPerModule, mutex_t* _canMutex, Bms* _bms);
+      BatteryPack(int _id, int CANCSPin, int _contactorPin, int _contactorFeedbackPin, CellStore* cells,
+            CellStats* _stats, mutex_t* _canMutex, Bms* _bms);
 
       void set_battery(Battery* battery) { this->battery = battery; }
 
       void print();
-      uint8_t getcheck(can_frame &msg, int id);
       int8_t get_module_liveness(int8_t moduleId);
       bool is_alive();
       void request_data();
+      void send_next_poll();
+      void service_polls();
       void read_message();
-      bool send_frame(can_frame *frame);
+      uint8_t recompute();
+      bool send_frame(const can_frame *frame, CanTxPriority priority = CAN_TX_POLL);
+
+      // Checksum for a frame sent to module id
+      static constexpr uint8_t getcheck(const can_frame &msg, int id) {
+         unsigned char canmes[11] = {};
+         int meslen = msg.can_dlc + 1;  // remove one for crc and add two for id bytes
+         canmes[1] = msg.can_id;
+         canmes[0] = msg.can_id >> 8;
+
+         for (int i = 0; i < (msg.can_dlc - 1); i++) {
+            canmes[i + 2] = msg.data[i];
+         }
+         return CRC8::get_crc8(canmes, meslen, finalxor[id]);
+      }
 
       void set_pack_error_status(int newErrorStatus);
       int get_pack_error_status();
@@ -60,23 +106,24 @@ class BatteryPack {
       void reset_balance_timer();
 
       // Voltage
-      float get_voltage();
-      void recalculate_total_voltage();
+      millivolts_t get_voltage();
       uint16_t get_lowest_cell_voltage();
       bool has_empty_cell();
       uint16_t get_highest_cell_voltage();
       bool has_full_cell();
       void set_cell_voltage(int moduleIndex, int cellIndex, uint32_t newCellVoltage);
-      void decode_voltages(can_frame *frame);
-      void recalculate_cell_delta();
-      void process_voltage_update();
+      void decode_status(can_frame *frame, int moduleId, const PackRoute* route);
+      void decode_heartbeat(can_frame *frame, int moduleId, const PackRoute* route);
+      void decode_voltages(can_frame *frame, int moduleId, const PackRoute* route);
+      void update_cell_extremes(int moduleId);
+      void rescan_cell_extremes();
       uint8_t get_cell_delta() { return cellDelta; }
 
       // Temperature
       bool has_temperature_sensor_over_max();
       int8_t get_lowest_temperature();
       int8_t get_highest_temperature();
-      void decode_temperatures(can_frame *temperatureMessageFrame);
+      void decode_temperatures(can_frame *temperatureMessageFrame, int moduleId, const PackRoute* route);
       void process_temperature_update();
 
       // Contactors
@@ -89,21 +136,30 @@ class BatteryPack {
       int16_t get_max_charge_current_by_temperature();
 
       void increment_can_tx_error_count() { canTxErrorCount++; }
-      void increment_can_rx_error_count() { canRxErrorCount++; }
       uint16_t get_can_tx_error_count() { return canTxErrorCount; }
-      uint16_t get_can_rx_error_count() { return canRxErrorCount; }
+      uint16_t get_can_rx_error_count() { return canPort->get_rx_error_count(); }
+      uint32_t get_decode_frame_count() { return decodeFrameCount; }
+      Timestamp get_newest_frame_time() { return newestFrameTime; }
+      void set_rx_task(Scheduler* scheduler, int task) { canPort->set_rx_task(scheduler, task); }
 
    private:
-      MCP2515* CAN;                                     // CAN bus connection to this pack
+      CanPort* canPort;                                // CAN bus connection to this pack
       mutex_t* canMutex;
       Bms* bms;
-      absolute_time_t lastUpdate;                      // Time we received last update from BMS
-      int numModules;                                  //
-      int numCellsPerModule;                           //
-      int numTemperatureSensorsPerModule;              //
+      Timestamp lastUpdate;                            // Time we received last update from BMS
       Battery* battery;                                // The parent Battery that contains this BatteryPack
-      float voltage;                                   // Voltage of the total pack
+      CellStats* stats;                                // Running statistics, fed from decode_voltages()
+      millivolts_t voltage;                            // Voltage of the total pack
       uint8_t cellDelta;                               // Difference in voltage between high and low cell, in mV
+      uint16_t lowestCellVoltage;                      // Lowest cell in any fully populated module, in mV
+      uint16_t highestCellVoltage;                     // Highest cell in any fully populated module, in mV
+      int lowestCellModule;                            // Module holding lowestCellVoltage, -1 if none
+      int highestCellModule;                           // Module holding highestCellVoltage, -1 if none
+      uint32_t cellExtremeRescanCount;                 // Times every module had to be checked for a new low/high
+      uint32_t dirtyModules;                           // Modules whose lowest/highest cell moved since the last recompute
+      bool voltagesDirty;                              // A cell voltage has been decoded since the last recompute
+      bool temperaturesDirty;                          // A temperature has been decoded since the last recompute
+      bool recomputeDue;                               // A module has answered in full, so recompute now
 
       // contactors
       int contactorInhibitPin;                         // Pin on the pico which controls contactors for this pack
@@ -112,15 +168,28 @@ class BatteryPack {
       uint32_t balanceStatus;                          // Status of the balance of the pack
       uint32_t errorStatus;                            //
       bool balancingEnabled;                           //
-      absolute_time_t nextBalanceTime;                 // Time that the next balance should occur.
+      Timestamp nextBalanceTime;                       // Time that the next balance should occur.
       uint8_t pollMessageId;                           //
       bool initialised;                                //
       BatteryModule modules[MODULES_PER_PACK];         // The child modules that make up this BatteryPack
-      CRC8 crc8;
 
       bool inStartup;
       uint8_t modulePollingCycle;
-      can_frame pollModuleFrame;
+      can_frame pollModuleFrames[MODULES_PER_PACK];    // Poll frames carrying balance data, built each cycle
+      const can_frame* pollCycleFrames;                // The frames for this cycle, one per module
+      int pollNextModule;                              // Next module to poll this cycle
+      int pollAwaitingModule;                          // Module we're waiting to hear back from, -1 if none
+      uint8_t pollResponseFrames;                      // Frames received from pollAwaitingModule since its poll
+      Timestamp pollSentTime;                          // When pollAwaitingModule was polled
+      uint32_t pollRttAverageUs;                       // Smoothed module response time
+      uint32_t pollSlotUs;                             // How long to wait for a response before moving on
+      uint32_t pollTimeoutCount;                       // Modules that didn't answer in full within their slot
+      uint32_t pollOverrunCount;                       // Cycles that hadn't finished when the next one was due
+      uint32_t pollSendFailCount;                      // Polls that couldn't be queued and had to be retried
+
+      uint32_t decodeFrameCount;                       // Frames routed to a decoder
+      uint64_t decodeTimeUs;                           // Time spent routing and decoding them
+      Timestamp newestFrameTime;                       // When the most recently decoded frame arrived
 
       uint8_t dischargeCurve[50] = {
          0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // -10C to -1C
@@ -145,12 +214,11 @@ class BatteryPack {
          50, 50, 50, 50,  // 36° to 39°
       };
 
-      clock_t lastTemperatureSampleTime;
+      Timestamp lastTemperatureSampleTime;
       int8_t lastTemperatureSample;
       int8_t temperatureDelta;
 
       int16_t canTxErrorCount;
-      int16_t canRxErrorCount;
 };
 
 #endif  // BMS_SRC_INCLUDE_PACK_H_
@@ -0,0 +1,123 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_SRC_INCLUDE_SCHEDULER_H_
+#define BMS_SRC_INCLUDE_SCHEDULER_H_
+
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+#include "include/monotime.h"
+#include "settings.h"
+
+#define MAX_TASKS 24                                // Tasks each scheduler can hold
+
+static_assert(MAX_TASKS <= 32, "Posted tasks are kept in a 32 bit mask");
+
+typedef void (*TaskCallback)();
+
+// When more than one task is ready, the highest priority runs first. Tasks of
+// the same priority run in order of release.
+enum TaskPriority {
+    TASK_BACKGROUND = 0,                            // Status print, status light
+    TASK_TELEMETRY  = 1,                            // Frames that will be sent again shortly
+    TASK_CONTROL    = 2,                            // CAN servicing, limits, calculations
+    TASK_SAFETY     = 3,                            // Health checks, liveness, inputs
+};
+
+// One task's figures, as reported over UART and CAN
+struct TaskStats {
+    const char* name;
+    uint8_t priority;
+    uint32_t periodMs;                              // 0 for tasks that only run when posted
+    uint32_t runCount;                              // Times the task has run
+    uint32_t overrunCount;                          // Runs that finished after their deadline
+    uint32_t meanExecUs;                            // Time spent in the callback
+    uint32_t maxExecUs;
+    uint32_t meanJitterUs;                          // From release, or from being posted, to starting
+    uint32_t maxJitterUs;
+};
+
+struct Task {
+    const char* name;                               // Used in the status print
+    TaskCallback callback;
+    TaskPriority priority;
+    Duration period;                                // Zero for tasks that only run when posted
+    Duration phase;                                 // Offset of the first release from when run() starts
+    Duration deadline;                              // From release or post, by when the run must be finished
+    Timestamp release;                              // Next time the task is due
+    Timestamp postedTime;                           // When the task was last posted
+
+    uint32_t runCount;
+    uint32_t overrunCount;
+    uint32_t maxExecUs;
+    uint64_t totalExecUs;                           // Running total, for the mean
+    uint32_t maxJitterUs;
+    uint64_t totalJitterUs;                         // Running total, for the mean
+};
+
+/*
+ * Run to completion scheduler for one core. Tasks are released on their
+ * period, or posted from anywhere, including interrupts and the other core.
+ * run() never returns: it keeps picking the most urgent ready task and calling
+ * it from thread mode, so tasks can take mutexes and wait on the SPI bus, and
+ * interrupt handlers stay short because all they do is post.
+ *
+ * A task is never interrupted by another task on the same core, so a long
+ * task holds up everything behind it. The overrun and jitter figures show
+ * when that happens.
+ */
+class Scheduler {
+    private:
+        const char* name;                           // Used as the prefix for log messages
+        Task tasks[MAX_TASKS];
+        int numTasks;
+        critical_section_t lock;                    // Guards posted, which any core or interrupt may set, and the
+                                                    // task figures and busyTimeUs, which the other core may read
+        volatile uint32_t posted;                   // One bit per task waiting to run because it was posted
+        volatile int currentTask;                   // Task running now, -1 when idle
+        const char* volatile currentSection;        // Part of the running task marked with enter_section(), or NULL
+
+        uint64_t busyTimeUs;                        // Time spent in tasks since run() started
+        uint64_t lastPrintBusyUs;                   // busyTimeUs at the last print, for the load figure
+        uint64_t lastPrintTimeUs;
+
+        int next_ready(Timestamp now, uint32_t ready);
+        void run_task(int task, Timestamp now);
+
+    public:
+        Scheduler() {};
+        void initialise(const char* _name);
+        void print();
+
+        int add(const char* taskName, TaskCallback callback, TaskPriority priority, Duration period,
+            Duration deadline, Duration phase = Duration());
+        void post(int task);
+        bool run_once();
+        void run();
+
+        int get_num_tasks() { return numTasks; }
+        int get_current_task() { return currentTask; }
+        const char* get_task_name(int task) { return tasks[task].name; }
+        const char* get_current_activity();
+        const char* enter_section(const char* section);
+        void leave_section(const char* previous) { currentSection = previous; }
+        bool get_stats(int task, TaskStats* stats);
+};
+
+#endif  // BMS_SRC_INCLUDE_SCHEDULER_H_
@@ -20,31 +20,33 @@
 #ifndef BMS_SRC_INCLUDE_SHUNT_H_
 #define BMS_SRC_INCLUDE_SHUNT_H_
 
+#include "include/fixedpoint.h"
+
+// Values are stored as the shunt reports them, no scaling
 class Shunt {
     private:
-        clock_t lastHeartbeat;  // Time we last got an update from the ISA Shunt
-        int32_t amps;
-        int32_t voltage1;
-        int32_t voltage2;
-        int32_t voltage3;
-        int32_t temperature;
-        int32_t watts;
+        milliamps_t amps;       // Current
+        int32_t voltage1;       // Voltage inputs, in mV
+        int32_t voltage2;       //
+        int32_t voltage3;       //
+        decidegrees_t temperature;
+        int32_t watts;          // Power, in W
         int32_t ampSeconds;
         int32_t wattHours;
     public:
         Shunt();
         void heartbeat();
         bool is_dead();
-        int32_t get_amps();
-        void set_amps(int32_t _amps);
+        milliamps_t get_amps();
+        void set_amps(milliamps_t _amps);
         int32_t get_voltage1();
         void set_voltage1(int32_t _voltage1);
         int32_t get_voltage2();
         void set_voltage2(int32_t _voltage2);
         int32_t get_voltage3();
         void set_voltage3(int32_t _voltage3);
-        int32_t get_temperature();
-        void set_temperature(int32_t _temperature);
+        decidegrees_t get_temperature();
+        void set_temperature(decidegrees_t _temperature);
         int32_t get_watts();
         void set_watts(int32_t _watts);
         int32_t get_ampSeconds();
@@ -0,0 +1,89 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_SRC_INCLUDE_SPIBUS_H_
+#define BMS_SRC_INCLUDE_SPIBUS_H_
+
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+#include "hardware/spi.h"
+#include "hardware/dma.h"
+#include "settings.h"
+
+/*
+ * One CS-framed, full duplex transfer. The buffer is sent and overwritten
+ * with what comes back, so the same memory is used for both directions. The
+ * transaction and its buffer must stay put until done is set.
+ */
+struct SpiTransaction {
+    uint8_t csPin;                                  // CS of the device to talk to
+    uint8_t* buffer;                                // Bytes to send, replaced by the bytes received
+    uint16_t length;                                // Number of bytes in the buffer
+    uint32_t baudrate;                              // SPI clock for this device, in Hz
+    void (*callback)(SpiTransaction* transaction);  // Called when the transfer is done, may be NULL
+    void* context;                                  // For the callback
+    volatile bool done;                             // Set once CS has gone high again
+};
+
+/*
+ * Every controller on the SPI bus goes through here. Transactions are queued
+ * and run one at a time with DMA, so the CPU isn't tied up while bytes are
+ * being clocked out. Callbacks run from the DMA interrupt on core 0, or from
+ * whoever is waiting in transfer() on either core, so anything they touch
+ * must be safe to reach from both.
+ */
+class SpiBus {
+    private:
+        spi_inst_t* spi;
+        uint txChannel;                             // DMA channel feeding the SPI TX FIFO
+        uint rxChannel;                             // DMA channel emptying the SPI RX FIFO
+        critical_section_t lock;                    // Guards the queue and the DMA channels
+
+        SpiTransaction* queue[SPI_QUEUE_SIZE];      // Waiting to go on the bus
+        uint8_t queueHead;
+        uint8_t queueTail;
+        SpiTransaction* current;                    // On the bus now, NULL when idle
+        uint32_t currentBaudrate;                   // What the SPI clock is set to now
+        uint64_t currentStartTime;
+
+        uint32_t transactionCount;                  // Transactions completed
+        uint32_t byteCount;                         // Bytes clocked in each direction
+        uint32_t queueFullCount;                    // Transactions turned away because the queue was full
+        uint64_t busTimeUs;                         // Time the bus spent with a transaction in progress
+        uint64_t waitTimeUs;                        // Time the CPU spent waiting in transfer(), under lock
+
+        void start_next();
+        SpiTransaction* finish_current();
+
+    public:
+        SpiBus() {};
+        SpiBus(spi_inst_t* _spi, uint8_t misoPin, uint8_t mosiPin, uint8_t clkPin, uint32_t baudrate);
+        void print();
+
+        bool submit(SpiTransaction* transaction);
+        void transfer(uint8_t csPin, uint32_t baudrate, uint8_t* buffer, uint16_t length);
+        void poll();
+
+        uint32_t get_transaction_count() { return transactionCount; }
+        uint32_t get_byte_count() { return byteCount; }
+        uint64_t get_bus_time_us() { return busTimeUs; }
+        uint64_t get_wait_time_us() { return waitTimeUs; }
+};
+
+#endif  // BMS_SRC_INCLUDE_SPIBUS_H_
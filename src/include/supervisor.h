@@ -0,0 +1,79 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_SRC_INCLUDE_SUPERVISOR_H_
+#define BMS_SRC_INCLUDE_SUPERVISOR_H_
+
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+#include "include/monotime.h"
+#include "include/scheduler.h"
+#include "settings.h"
+
+// Everything that has to check in for the watchdog to be fed
+#define SUPERVISED_PACK_RX(pack) ( pack )
+#define SUPERVISED_MAIN_RX ( NUM_PACKS )
+#define SUPERVISED_HEALTH_CHECKS ( SUPERVISED_MAIN_RX + 1 )
+#define NUM_SUPERVISED_TASKS ( SUPERVISED_HEALTH_CHECKS + 1 )
+
+// The task that stopped the watchdog being fed is written to watchdog
+// scratch registers 0 - 3, which survive the reset. The SDK uses 4 - 7.
+#define SUPERVISOR_SCRATCH_MAGIC 0x53555056         // "SUPV" in scratch 0, the name follows
+#define SUPERVISOR_NAME_LENGTH 12                   // Bytes of name that fit in scratch 1 - 3
+
+/*
+ * Feeds the hardware watchdog only while every supervised task keeps checking
+ * in. supervise() runs every SUPERVISOR_INTERVAL_MS and looks at how long it's
+ * been since each task last checked in. Once one of them has gone past its
+ * deadline the watchdog is never fed again, so a wedged decoder, a CAN mutex
+ * that's never given back or a starved health check ends in a reset rather
+ * than carrying on without it. The name of the scheduler task that was running
+ * at the time, or of the late check-in if nothing was, is kept in the scratch
+ * registers, so the next boot can say which one it was.
+ */
+class Supervisor {
+    private:
+        critical_section_t lock;                            // Check-ins come from both cores
+        Timestamp lastCheckIn[NUM_SUPERVISED_TASKS];
+        Duration deadline[NUM_SUPERVISED_TASKS];            // Longest allowed between check-ins
+        Duration longestGap[NUM_SUPERVISED_TASKS];          // Longest seen between check-ins, for tuning the deadlines
+        char name[NUM_SUPERVISED_TASKS][SUPERVISOR_NAME_LENGTH + 1];
+        Scheduler* runsOn[NUM_SUPERVISED_TASKS];            // Scheduler whose task does the checking in
+        volatile int failedTask;                            // First task to miss its deadline, -1 if none
+        char blamedTask[SUPERVISOR_NAME_LENGTH + 1];        // Scheduler task running when it did, else its own name
+        Duration failedLateBy;
+        char resetTask[SUPERVISOR_NAME_LENGTH + 1];         // Task named in the scratch registers at boot, "" if none
+
+        uint32_t feedCount;                                 // Times the watchdog has been fed
+
+        void record_failure(int task, Duration lateBy);
+
+    public:
+        Supervisor() {};
+        void initialise();
+        void start();
+        void print();
+
+        void check_in(int task);
+        void supervise();
+
+        const char* get_reset_task() { return resetTask; }
+};
+
+#endif  // BMS_SRC_INCLUDE_SUPERVISOR_H_
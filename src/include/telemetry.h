@@ -0,0 +1,119 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_SRC_INCLUDE_TELEMETRY_H_
+#define BMS_SRC_INCLUDE_TELEMETRY_H_
+
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+#include "mcp2515/mcp2515.h"
+#include "include/canport.h"
+#include "include/monotime.h"
+#include "settings.h"
+
+#define MAIN_CAN_BITS_PER_SECOND 500000             // Matches the CAN_500KBPS the ports are set up with
+#define CAN_FRAME_OVERHEAD_BITS 47                  // Standard frame, everything but the data and stuff bits
+
+// Outbound messages on the main bus, in the order of TELEMETRY_MESSAGES
+enum TelemetryMessageId {
+    TELEMETRY_LIMITS,                               // 0x351
+    TELEMETRY_BMS_STATE,                            // 0x352
+    TELEMETRY_ALARMS,                               // 0x35A
+    TELEMETRY_SOC,                                  // 0x355
+    TELEMETRY_STATUS,                               // 0x356
+    TELEMETRY_MAIN_CAN_ERRORS,                      // 0x354
+    TELEMETRY_PACK_CAN_ERRORS,                      // 0x357
+    TELEMETRY_MODULE_LIVENESS,                      // 0x353
+    NUM_TELEMETRY_MESSAGES
+};
+
+static_assert(NUM_TELEMETRY_MESSAGES <= 32, "Early sends are kept in a 32 bit mask");
+
+struct TelemetryMessage {
+    const char* name;                               // Used in the status print
+    void (*build)(can_frame* frame);                // Fills in the whole frame, ID included
+    bool doChecksum;                                // Passed on to Bms::send_frame()
+    CanTxPriority priority;
+    uint32_t periodMs;                              // 0 to never send it
+    uint32_t phaseMs;                               // How far into each period it goes out
+};
+
+extern const TelemetryMessage TELEMETRY_MESSAGES[NUM_TELEMETRY_MESSAGES];
+
+void handle_main_frame_sent(uint32_t canId, uint32_t tag, Timestamp sentTime);
+
+/*
+ * Sends everything in TELEMETRY_MESSAGES on its own period, offset by its
+ * phase, so the frames are spread across the period instead of all being
+ * queued at once and fighting over the three TX buffers. One task looks at the
+ * table every TELEMETRY_TICK_MS.
+ *
+ * When something a message reports changes, send_soon() sends it early, on
+ * top of its periodic sends. Early sends of the same message are at least
+ * FAST_TELEMETRY_MIN_INTERVAL_MS apart, and requests that come in while one is
+ * waiting are folded into it. Each early frame is queued with its own tag, so
+ * the time from the change being seen to the controller reporting that frame
+ * sent is measured, not the time to some older copy already queued.
+ *
+ * Frames and bits are counted per message, which gives each message's share
+ * of the bus. The bit count leaves out stuff bits, so it's a little low.
+ */
+class Telemetry {
+    private:
+        int task;                                   // The task that runs tick(), posted by send_soon()
+        Timestamp nextSend[NUM_TELEMETRY_MESSAGES];
+        Timestamp lastSendTime[NUM_TELEMETRY_MESSAGES];
+        bool started;                               // Set on the first tick, when the phases are counted from
+
+        uint32_t fastPending;                       // One bit per message waiting to be sent early, core 0 only
+        Timestamp fastRequestTime[NUM_TELEMETRY_MESSAGES];      // When the change behind each one was seen
+        uint32_t fastSendCount[NUM_TELEMETRY_MESSAGES];
+        uint32_t fastFoldedCount[NUM_TELEMETRY_MESSAGES];       // Requests folded into one already waiting
+
+        // An early send waiting to be seen on the bus. Set on core 0, cleared
+        // by frame_sent() from whichever core services the main port, so these
+        // and the latency figures are only touched under lock.
+        critical_section_t lock;
+        uint32_t nextTag;                           // Tag for the next early send, never 0
+        bool awaitingSent[NUM_TELEMETRY_MESSAGES];
+        uint32_t awaitingTag[NUM_TELEMETRY_MESSAGES];
+        Timestamp awaitingChangeTime[NUM_TELEMETRY_MESSAGES];
+        uint32_t fastLatencyMaxUs[NUM_TELEMETRY_MESSAGES];      // Change seen to frame sent
+        uint64_t fastLatencyTotalUs[NUM_TELEMETRY_MESSAGES];    // Running total, for the mean
+        uint32_t fastLatencyCount[NUM_TELEMETRY_MESSAGES];
+
+        uint32_t sentCount[NUM_TELEMETRY_MESSAGES];
+        uint32_t dropCount[NUM_TELEMETRY_MESSAGES]; // Frames send_frame() turned away
+        uint64_t bitCount[NUM_TELEMETRY_MESSAGES];
+        uint64_t lastPrintBitCount[NUM_TELEMETRY_MESSAGES];
+        Timestamp lastPrintTime;
+
+        void send(int message, Timestamp changeTime = Timestamp());
+
+    public:
+        Telemetry() : task(-1), fastPending(0), nextTag(1) {};
+        void initialise();
+        void print();
+
+        void tick();
+        void send_soon(int message);
+        void frame_sent(uint32_t tag, Timestamp sentTime);
+};
+
+#endif  // BMS_SRC_INCLUDE_TELEMETRY_H_
@@ -0,0 +1,89 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BMS_SRC_INCLUDE_TIMERWHEEL_H_
+#define BMS_SRC_INCLUDE_TIMERWHEEL_H_
+
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+#include "include/monotime.h"
+#include "settings.h"
+
+// Everything that has to keep proving it's still there gets a timer
+#define LIVENESS_MODULE(pack, module) ( (pack) * MODULES_PER_PACK + (module) )
+#define LIVENESS_SHUNT ( NUM_PACKS * MODULES_PER_PACK )
+#define LIVENESS_PACKS_MATCHED ( LIVENESS_SHUNT + 1 )
+#define NUM_LIVENESS_TIMERS ( LIVENESS_PACKS_MATCHED + 1 )
+
+#define LIVENESS_ALL_MODULES ( ( 1ull << LIVENESS_SHUNT ) - 1 )
+
+#define TIMER_WHEEL_SLOTS 64                        // Ticks covered by one turn of the wheel. Longer timers go round
+                                                    // more than once. Must be a power of two.
+
+static_assert(NUM_LIVENESS_TIMERS <= 64, "The liveness bitmap has one bit per timer");
+static_assert((TIMER_WHEEL_SLOTS & (TIMER_WHEEL_SLOTS - 1)) == 0, "TIMER_WHEEL_SLOTS must be a power of two");
+
+// Ticks needed to cover ttl, rounded up so a timer never fires early
+constexpr uint32_t liveness_ticks(Duration ttl) {
+    return ( ttl.as_ms() + LIVENESS_TICK_MS - 1 ) / LIVENESS_TICK_MS;
+}
+
+/*
+ * Deadlines for everything tracked by a TTL. Each heartbeat re-arms its timer
+ * and sets its bit in the liveness bitmap. The wheel advances one slot per
+ * LIVENESS_TICK_MS, and any timer in that slot whose deadline has come round
+ * is expired: its bit is cleared and the expiry handler is called. Arming and
+ * expiring are O(1), and asking whether something is alive is a bit test.
+ *
+ * Timers in each slot are kept in a doubly linked list of timer ids, so
+ * re-arming unlinks the timer from wherever it was without searching.
+ */
+class TimerWheel {
+    private:
+        critical_section_t lock;                    // Heartbeats may come from either core
+        volatile uint32_t tick;                     // Ticks since the wheel was started
+        uint32_t deadline[NUM_LIVENESS_TIMERS];     // Tick each timer expires on
+        uint32_t ttl[NUM_LIVENESS_TIMERS];          // Ticks each heartbeat buys
+        int8_t slotHead[TIMER_WHEEL_SLOTS];         // First timer in each slot, -1 if none
+        int8_t next[NUM_LIVENESS_TIMERS];           // Next timer in the same slot, -1 if none
+        int8_t prev[NUM_LIVENESS_TIMERS];           // Previous timer in the same slot, -1 if first
+        volatile uint64_t alive;                    // One bit per timer that hasn't expired
+        void (*expiryHandler)(int timer);           // Called for each timer that expires, may be NULL
+
+        uint32_t armCount;                          // Heartbeats that moved a deadline
+        uint32_t expiryCount;                       // Timers that expired
+
+        void link(int timer);
+        void unlink(int timer);
+
+    public:
+        TimerWheel() {};
+        void initialise();
+        void print();
+
+        void add(int timer, uint32_t ttlTicks);
+        void set_expiry_handler(void (*handler)(int timer)) { expiryHandler = handler; }
+        void heartbeat(int timer);
+        void advance();
+
+        bool is_alive(int timer) { return ( alive >> timer ) & 1; }
+        uint64_t get_alive() { return alive; }
+};
+
+#endif  // BMS_SRC_INCLUDE_TIMERWHEEL_H_
@@ -22,7 +22,6 @@
 
 #include "mcp2515/mcp2515.h"
 
-clock_t get_clock();
 void zero_frame(can_frame* frame);
 void print_frame(can_frame* frame);
 
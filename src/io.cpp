@@ -25,41 +25,37 @@
 #include "settings.h"
 #include "include/io.h"
 #include "include/bms.h"
+#include "include/canport.h"
+#include "include/scheduler.h"
 
 extern Bms bms;
+extern Scheduler scheduler;
+
+int inputChangeTask = -1;
 
 // Input signal handler
-// These are resistor divider inputs. High is on, low is off.
+// These are resistor divider inputs. High is on, low is off. The state machine
+// isn't run from the interrupt, the change is passed on to handle_input_changes().
 
 void gpio_callback(uint gpio, uint32_t events) {
-    extern State state;
-    int newState;
-    std::string newStateStr;
-    if ( gpio == IGNITION_ENABLE_PIN ) {
-        newState = gpio_get(IGNITION_ENABLE_PIN);
-        newStateStr = newState == 1 ? "on" : "off";
-        printf("    * Ignition signal changed to : %s\n", newStateStr.c_str());
-        if ( newState ) {
-            bms.send_event(E_IGNITION_ON);
-        } else {
-            bms.send_event(E_IGNITION_OFF);
-        }
-    }
-    if ( gpio == CHARGE_ENABLE_PIN ) {
-        newState = gpio_get(CHARGE_ENABLE_PIN);
-        newStateStr = newState == 1 ? "on" : "off";
-        printf("Charge signal changed to : %s\n", newStateStr.c_str());
-        if ( newState ) {
-            bms.send_event(E_CHARGING_INITIATED);
-        } else {
-            bms.send_event(E_CHARGING_TERMINATED);
-        }
+    if ( gpio == IGNITION_ENABLE_PIN || gpio == CHARGE_ENABLE_PIN ) {
+        scheduler.post(inputChangeTask);
     }
+    #if !CAN_ON_CORE1
+    // CAN controller INT lines. With CAN_ON_CORE1 they interrupt core 1 instead.
+    handle_can_interrupt(gpio);
+    #endif
+}
+
+void handle_input_changes() {
+    extern Io io;
+    io.process_input_changes();
 }
 
 Io::Io() {
     ignitionOn = false;
     chargeEnable = false;
+    inputChangeTask = scheduler.add("inputs", handle_input_changes, TASK_SAFETY, Duration(), milliseconds(10));
 
     // IGNITION input
     gpio_init(IGNITION_ENABLE_PIN);
@@ -97,6 +93,23 @@ Io::Io() {
     disable_heater();
 }
 
+// Send an event for each input that has changed since it was last looked at
+void Io::process_input_changes() {
+    extern Bms bms;
+    bool newIgnitionOn = gpio_get(IGNITION_ENABLE_PIN);
+    if ( newIgnitionOn != ignitionOn ) {
+        ignitionOn = newIgnitionOn;
+        printf("    * Ignition signal changed to : %s\n", ignitionOn ? "on" : "off");
+        bms.send_event(ignitionOn ? E_IGNITION_ON : E_IGNITION_OFF);
+    }
+    bool newChargeEnable = gpio_get(CHARGE_ENABLE_PIN);
+    if ( newChargeEnable != chargeEnable ) {
+        chargeEnable = newChargeEnable;
+        printf("Charge signal changed to : %s\n", chargeEnable ? "on" : "off");
+        bms.send_event(chargeEnable ? E_CHARGING_INITIATED : E_CHARGING_TERMINATED);
+    }
+}
+
 // REMINDER : THESE OUTPUTS ARE A LOW SIDE SWITCHES.
 //     gpio high == on  == output low
 //     gpio low  == off == output high/floating?
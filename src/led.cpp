@@ -20,15 +20,13 @@
 #include <stdio.h>
 #include "pico/stdlib.h"
 #include "include/bms.h"
+#include "include/scheduler.h"
 
 #include "include/led.h"
 
-struct repeating_timer ledBlinkTimer;
-
-bool process_led_blink_step(struct repeating_timer *t) {
-    Bms* bms = static_cast<Bms*>(t->user_data);
-    bms->led_blink();
-    return true;
+void process_led_blink_step() {
+    extern Bms bms;
+    bms.led_blink();
 }
 
 StatusLight::StatusLight(Bms* _bms) {
@@ -42,8 +40,9 @@ StatusLight::StatusLight(Bms* _bms) {
     gpio_init(PICO_DEFAULT_LED_PIN);
     gpio_set_dir(PICO_DEFAULT_LED_PIN, GPIO_OUT);
 
-    // timer to handle the on-ing and off-ing of the LED
-    add_repeating_timer_ms(100, process_led_blink_step, static_cast<void*>(&bms), &ledBlinkTimer);
+    // task to handle the on-ing and off-ing of the LED
+    extern Scheduler scheduler;
+    scheduler.add("status light", process_led_blink_step, TASK_BACKGROUND, milliseconds(100), milliseconds(100));
 }
 
 
@@ -40,41 +40,53 @@ EV Mustang BMS
 #include "include/led.h"
 #include "include/io.h"
 #include "include/shunt.h"
+#include "include/spibus.h"
+#include "include/cellstore.h"
+#include "include/cellstats.h"
+#include "include/timerwheel.h"
+#include "include/cancore.h"
+#include "include/scheduler.h"
+#include "include/supervisor.h"
+#include "include/telemetry.h"
 
 
 mutex_t canMutex;
+Scheduler scheduler;
+Supervisor supervisor;
+Telemetry telemetry;
+SpiBus spiBus;
 Io io;
+TimerWheel timerWheel;
 Shunt shunt;
+CellStore cellStore;
+CellStats cellStats;
 Battery battery;
 Bms bms;
 
 
-// Watchdog
-
-struct repeating_timer watchdogKeepaliveTimer;
-
-bool watchdog_keepalive(struct repeating_timer *t) {
-    watchdog_update();
-    return true;
-}
-
-void enable_watchdog_keepalive() {
-    add_repeating_timer_ms(1000, watchdog_keepalive, NULL, &watchdogKeepaliveTimer);
-}
-
 // Status print
 
-struct repeating_timer statusPrintTimer;
-
-bool status_print(struct repeating_timer *t) {
+void status_print() {
     extern Bms bms;
+    extern SpiBus spiBus;
+    extern TimerWheel timerWheel;
+    extern Scheduler scheduler;
+    extern Supervisor supervisor;
+    extern Telemetry telemetry;
     bms.print();
-    return true;
+    spiBus.print();
+    timerWheel.print();
+    supervisor.print();
+    telemetry.print();
+    scheduler.print();
+#if CAN_ON_CORE1
+    get_can_scheduler()->print();
+#endif
 }
 
 void enable_status_print() {
     printf(" * Enabling status print\n");
-    add_repeating_timer_ms(1000, status_print, NULL, &statusPrintTimer);
+    scheduler.add("status print", status_print, TASK_BACKGROUND, seconds(1), seconds(1));
 }
 
 
@@ -91,16 +103,23 @@ int main() {
 
     printf("BMS starting up ...\n");
 
+    // Every task on core 0 is added to this, and anything that goes on the
+    // CAN core to that core's own
+    scheduler.initialise("sched0");
+    initialise_can_core();
+    supervisor.initialise();
+
     // Check for unexpected reboot
     if (watchdog_caused_reboot()) {
         printf(" * !!!! Rebooted by Watchdog !!!!\n");
+        if ( supervisor.get_reset_task()[0] != '\0' ) {
+            printf(" * !!!! reset blamed on %s !!!!\n", supervisor.get_reset_task());
+        }
         bms.set_watchdog_reboot(true);
     } else {
         printf(" * Clean boot\n");
         bms.set_watchdog_reboot(false);
     }
-    watchdog_enable(5000, 1);
-    enable_watchdog_keepalive();
 
     // 8MHz clock for CAN oscillator
     clock_gpio_init(CAN_CLK_PIN, CLOCKS_CLK_GPOUT0_CTRL_AUXSRC_VALUE_CLK_SYS, 10);
@@ -108,18 +127,25 @@ int main() {
     mutex_init(&canMutex);
 
     // Initialise all of the objects
+    spiBus = SpiBus(SPI_PORT, SPI_MISO, SPI_MOSI, SPI_CLK, MAIN_CAN_SPI_CLOCK);
     io = Io();
+    timerWheel.initialise();
     shunt = Shunt();
-    battery = Battery(&io);
+    battery = Battery(&io, &cellStore, &cellStats);
     bms = Bms(&battery, &io, &shunt);
     battery.initialise(&bms);
+    telemetry.initialise();
+
+    // Everything is set up, so the CAN tasks can start
+    start_can_core();
 
     enable_status_print();
 
     printf("---- BMS READY ----\n");
 
-    while (true) {
-    }
+    // The watchdog is only fed while every supervised task keeps checking in
+    supervisor.start();
+    scheduler.run();
 
     return 0;
 }
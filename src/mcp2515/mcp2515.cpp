@@ -12,42 +12,29 @@ const struct MCP2515::RXBn_REGS MCP2515::RXB[N_RXBUFFERS] = {
     {MCP_RXB1CTRL, MCP_RXB1SIDH, MCP_RXB1DATA, CANINTF_RX1IF}
 };
 
-MCP2515::MCP2515(spi_inst_t* CHANNEL, uint8_t CS_PIN, uint8_t TX_PIN, uint8_t RX_PIN, uint8_t SCK_PIN, uint32_t SPI_CLOCK)
+MCP2515::MCP2515(SpiBus* BUS, uint8_t CS_PIN, uint32_t _SPI_CLOCK)
 {
-    this->SPI_CHANNEL = CHANNEL;
-    spi_init(this->SPI_CHANNEL, SPI_CLOCK);
-    gpio_set_function(TX_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(RX_PIN, GPIO_FUNC_SPI);
-    gpio_set_function(SCK_PIN, GPIO_FUNC_SPI);
-    spi_set_format(this->SPI_CHANNEL, 8, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
-
+    this->SPI_BUS = BUS;
     this->SPI_CS_PIN = CS_PIN;
+    this->SPI_CLOCK = _SPI_CLOCK;
+    this->spiTransactionCount = 0;
+    this->spiByteCount = 0;
     gpio_init(this->SPI_CS_PIN);
     gpio_set_dir(this->SPI_CS_PIN, GPIO_OUT);
-
-    endSPI();
-}
-
-inline void MCP2515::startSPI() {
-    asm volatile("nop \n nop \n nop");
-    gpio_put(this->SPI_CS_PIN, 0);
-    asm volatile("nop \n nop \n nop");
+    gpio_put(this->SPI_CS_PIN, 1);
 }
 
-inline void MCP2515::endSPI() {
-    asm volatile("nop \n nop \n nop");
-    gpio_put(this->SPI_CS_PIN, 1);
-    asm volatile("nop \n nop \n nop");
+// Send the buffer and replace it with what comes back, in one CS frame
+inline void MCP2515::transfer(uint8_t *buffer, const uint16_t n) {
+    spiTransactionCount++;
+    spiByteCount += n;
+    SPI_BUS->transfer(this->SPI_CS_PIN, this->SPI_CLOCK, buffer, n);
 }
 
 MCP2515::ERROR MCP2515::reset(void)
 {
-    startSPI();
-
     uint8_t instruction = INSTRUCTION_RESET;
-    spi_write_blocking(this->SPI_CHANNEL, &instruction, 1);
-
-    endSPI();
+    transfer(&instruction, 1);
 
     //Depends on oscillator & capacitors used
     sleep_ms(10);
@@ -97,71 +84,53 @@ MCP2515::ERROR MCP2515::reset(void)
 
 uint8_t MCP2515::readRegister(const REGISTER reg)
 {
-    startSPI();
-
-    uint8_t data[2] = {
+    uint8_t data[3] = {
         INSTRUCTION_READ,
-        reg
+        reg,
+        0x00
     };
 
-    spi_write_blocking(this->SPI_CHANNEL, data, 2);
-
-    uint8_t ret;
-    spi_read_blocking(this->SPI_CHANNEL, 0x00, &ret, 1);
+    transfer(data, 3);
 
-    endSPI();
-
-    return ret;
+    return data[2];
 }
 
 void MCP2515::readRegisters(const REGISTER reg, uint8_t values[], const uint8_t n)
 {
-    startSPI();
-
-    uint8_t data[2] = {
+    uint8_t data[2 + MAX_REGISTER_BURST] = {
         INSTRUCTION_READ,
         reg
     };
-    spi_write_blocking(this->SPI_CHANNEL, data, 2);
 
-    spi_read_blocking(this->SPI_CHANNEL, 0x00, values, n);
+    transfer(data, 2 + n);
 
-    endSPI();
+    memcpy(values, &data[2], n);
 }
 
 void MCP2515::setRegister(const REGISTER reg, const uint8_t value)
 {
-    startSPI();
-
     uint8_t data[3] = {
         INSTRUCTION_WRITE,
         reg,
         value
     };
-    spi_write_blocking(this->SPI_CHANNEL, data, 3);
 
-    endSPI();
+    transfer(data, 3);
 }
 
 void MCP2515::setRegisters(const REGISTER reg, const uint8_t values[], const uint8_t n)
 {
-    startSPI();
-
-    uint8_t data[2] = {
+    uint8_t data[2 + MAX_REGISTER_BURST] = {
         INSTRUCTION_WRITE,
         reg
     };
-    spi_write_blocking(this->SPI_CHANNEL, data, 2);
-
-    spi_write_blocking(this->SPI_CHANNEL, values, n);
+    memcpy(&data[2], values, n);
 
-    endSPI();
+    transfer(data, 2 + n);
 }
 
 void MCP2515::modifyRegister(const REGISTER reg, const uint8_t mask, const uint8_t data)
 {
-    startSPI();
-
     uint8_t d[4] = {
         INSTRUCTION_BITMOD,
         reg,
@@ -169,24 +138,31 @@ void MCP2515::modifyRegister(const REGISTER reg, const uint8_t mask, const uint8
         data
     };
 
-    spi_write_blocking(this->SPI_CHANNEL, d, 4);
-
-    endSPI();
+    transfer(d, 4);
 }
 
 uint8_t MCP2515::getStatus(void)
 {
-    startSPI();
+    uint8_t data[2] = {
+        INSTRUCTION_READ_STATUS,
+        0x00
+    };
 
-    uint8_t instruction = INSTRUCTION_READ_STATUS;
-    spi_write_blocking(this->SPI_CHANNEL, &instruction, 1);
+    transfer(data, 2);
 
-    uint8_t ret;
-    spi_read_blocking(this->SPI_CHANNEL, 0x00, &ret, 1);
+    return data[1];
+}
 
-    endSPI();
+uint8_t MCP2515::getRxStatus(void)
+{
+    uint8_t data[2] = {
+        INSTRUCTION_RX_STATUS,
+        0x00
+    };
+
+    transfer(data, 2);
 
-    return ret;
+    return data[1];
 }
 
 MCP2515::ERROR MCP2515::setConfigMode()
@@ -621,37 +597,101 @@ MCP2515::ERROR MCP2515::setFilter(const RXF num, const bool ext, const uint32_t
     return ERROR_OK;
 }
 
-MCP2515::ERROR MCP2515::sendMessage(const TXBn txbn, const struct can_frame *frame)
+/*
+ * Write a pattern into the TXB0 data registers and read it back, to check that
+ * the SPI clock isn't too fast for the wiring. Call it straight after reset(),
+ * while TXB0 isn't in use.
+ */
+bool MCP2515::checkReadback(void)
+{
+    uint8_t pattern[CAN_MAX_DLEN];
+    uint8_t readback[CAN_MAX_DLEN];
+    bool ok = true;
+
+    for (int p=0; p<2 && ok; p++) {
+        for (int i=0; i<CAN_MAX_DLEN; i++) {
+            pattern[i] = (p == 0) ? (0x55 ^ i) : (0xAA ^ (i << 4));
+        }
+        setRegisters(MCP_TXB0DATA, pattern, CAN_MAX_DLEN);
+        readRegisters(MCP_TXB0DATA, readback, CAN_MAX_DLEN);
+        ok = (memcmp(pattern, readback, CAN_MAX_DLEN) == 0);
+    }
+
+    memset(pattern, 0, sizeof(pattern));
+    setRegisters(MCP_TXB0DATA, pattern, CAN_MAX_DLEN);
+
+    return ok;
+}
+
+/*
+ * Put a frame in a transmit buffer with LOAD TX BUFFER, without asking for it
+ * to be sent.
+ */
+MCP2515::ERROR MCP2515::loadTxBuffer(const TXBn txbn, const struct can_frame *frame)
 {
     if (frame->can_dlc > CAN_MAX_DLEN) {
         return ERROR_FAILTX;
     }
 
-    const struct TXBn_REGS *txbuf = &TXB[txbn];
+    static const uint8_t loadInstruction[N_TXBUFFERS] = {
+        INSTRUCTION_LOAD_TX0, INSTRUCTION_LOAD_TX1, INSTRUCTION_LOAD_TX2
+    };
 
-    uint8_t data[13];
+    uint8_t data[14];
 
     bool ext = (frame->can_id & CAN_EFF_FLAG);
     bool rtr = (frame->can_id & CAN_RTR_FLAG);
     uint32_t id = (frame->can_id & (ext ? CAN_EFF_MASK : CAN_SFF_MASK));
 
-    prepareId(data, ext, id);
+    // The LOAD TX BUFFER instruction points the address at TXBnSIDH, so the
+    // buffer is the instruction followed by the same layout as before.
+    data[0] = loadInstruction[txbn];
+    prepareId(&data[1], ext, id);
+
+    data[1 + MCP_DLC] = rtr ? (frame->can_dlc | RTR_MASK) : frame->can_dlc;
+
+    memcpy(&data[1 + MCP_DATA], frame->data, frame->can_dlc);
 
-    data[MCP_DLC] = rtr ? (frame->can_dlc | RTR_MASK) : frame->can_dlc;
+    transfer(data, 1 + 5 + frame->can_dlc);
 
-    memcpy(&data[MCP_DATA], frame->data, frame->can_dlc);
+    return ERROR_OK;
+}
 
-    setRegisters(txbuf->SIDH, data, 5 + frame->can_dlc);
+/*
+ * Set the buffer's TXP bits and TXREQ in one bit modify. When more than one
+ * buffer is waiting, the controller sends the one with the highest TXP first.
+ */
+void MCP2515::requestToSend(const TXBn txbn, const uint8_t priority)
+{
+    modifyRegister(TXB[txbn].CTRL, TXB_TXP | TXB_TXREQ, (priority & TXB_TXP) | TXB_TXREQ);
+}
 
-    modifyRegister(txbuf->CTRL, TXB_TXREQ, TXB_TXREQ);
+/*
+ * Load the frame with LOAD TX BUFFER and start it with RTS. That's two short
+ * SPI transactions, where writing SIDH..DATA and then setting TXREQ with a
+ * bit modify would need more.
+ */
+MCP2515::ERROR MCP2515::sendMessage(const TXBn txbn, const struct can_frame *frame)
+{
+    static const uint8_t rtsInstruction[N_TXBUFFERS] = {
+        INSTRUCTION_RTS_TX0, INSTRUCTION_RTS_TX1, INSTRUCTION_RTS_TX2
+    };
 
-    uint8_t ctrl = readRegister(txbuf->CTRL);
-    if ((ctrl & (TXB_ABTF | TXB_MLOA | TXB_TXERR)) != 0) {
-        return ERROR_FAILTX;
+    ERROR result = loadTxBuffer(txbn, frame);
+    if (result != ERROR_OK) {
+        return result;
     }
+
+    uint8_t rts = rtsInstruction[txbn];
+    transfer(&rts, 1);
+
     return ERROR_OK;
 }
 
+/*
+ * Send from the first transmit buffer that isn't busy. One READ STATUS gives
+ * the TXREQ bit of all three buffers.
+ */
 MCP2515::ERROR MCP2515::sendMessage(const struct can_frame *frame)
 {
     if (frame->can_dlc > CAN_MAX_DLEN) {
@@ -659,11 +699,12 @@ MCP2515::ERROR MCP2515::sendMessage(const struct can_frame *frame)
     }
 
     TXBn txBuffers[N_TXBUFFERS] = {TXB0, TXB1, TXB2};
+    uint8_t txreq[N_TXBUFFERS] = {STAT_TX0REQ, STAT_TX1REQ, STAT_TX2REQ};
+
+    uint8_t stat = getStatus();
 
     for (int i=0; i<N_TXBUFFERS; i++) {
-        const struct TXBn_REGS *txbuf = &TXB[txBuffers[i]];
-        uint8_t ctrlval = readRegister(txbuf->CTRL);
-        if ( (ctrlval & TXB_TXREQ) == 0 ) {
+        if ( (stat & txreq[i]) == 0 ) {
             return sendMessage(txBuffers[i], frame);
         }
     }
@@ -671,21 +712,22 @@ MCP2515::ERROR MCP2515::sendMessage(const struct can_frame *frame)
     return ERROR_ALLTXBUSY;
 }
 
-MCP2515::ERROR MCP2515::readMessage(const RXBn rxbn, struct can_frame *frame)
+/*
+ * Turn the SIDH..D7 registers of a receive buffer into a frame.
+ */
+MCP2515::ERROR MCP2515::decodeRxBuffer(const uint8_t *tbufdata, struct can_frame *frame)
 {
-    const struct RXBn_REGS *rxb = &RXB[rxbn];
-
-    uint8_t tbufdata[5];
-
-    readRegisters(rxb->SIDH, tbufdata, 5);
-
     uint32_t id = (tbufdata[MCP_SIDH]<<3) + (tbufdata[MCP_SIDL]>>5);
+    bool rtr;
 
     if ( (tbufdata[MCP_SIDL] & TXB_EXIDE_MASK) ==  TXB_EXIDE_MASK ) {
         id = (id<<2) + (tbufdata[MCP_SIDL] & 0x03);
         id = (id<<8) + tbufdata[MCP_EID8];
         id = (id<<8) + tbufdata[MCP_EID0];
         id |= CAN_EFF_FLAG;
+        rtr = tbufdata[MCP_DLC] & RTR_MASK;
+    } else {
+        rtr = tbufdata[MCP_SIDL] & RXBnSIDL_SRR;
     }
 
     uint8_t dlc = (tbufdata[MCP_DLC] & DLC_MASK);
@@ -693,29 +735,46 @@ MCP2515::ERROR MCP2515::readMessage(const RXBn rxbn, struct can_frame *frame)
         return ERROR_FAIL;
     }
 
-    uint8_t ctrl = readRegister(rxb->CTRL);
-    if (ctrl & RXBnCTRL_RTR) {
+    if (rtr) {
         id |= CAN_RTR_FLAG;
     }
 
     frame->can_id = id;
     frame->can_dlc = dlc;
 
-    readRegisters(rxb->DATA, frame->data, dlc);
-
-    modifyRegister(MCP_CANINTF, rxb->CANINTF_RXnIF, 0);
+    memcpy(frame->data, &tbufdata[MCP_DATA], dlc);
 
     return ERROR_OK;
 }
 
+/*
+ * Read a whole frame in one transaction with READ RX BUFFER. The address
+ * starts at RXBnSIDH and the controller clears RXnIF itself when CS goes high.
+ * A DMA transfer can't stop part way once DLC is known, so all 8 data bytes
+ * are clocked in.
+ */
+MCP2515::ERROR MCP2515::readMessage(const RXBn rxbn, struct can_frame *frame)
+{
+    uint8_t data[RX_BUFFER_READ_LENGTH];
+    data[0] = (rxbn == RXB0) ? INSTRUCTION_READ_RX0 : INSTRUCTION_READ_RX1;
+
+    transfer(data, RX_BUFFER_READ_LENGTH);
+
+    return decodeRxBuffer(&data[1], frame);
+}
+
+/*
+ * RX STATUS says which buffer to read. RXB0 goes first, since with rollover
+ * enabled it holds the older frame.
+ */
 MCP2515::ERROR MCP2515::readMessage(struct can_frame *frame)
 {
     ERROR rc;
-    uint8_t stat = getStatus();
+    uint8_t stat = getRxStatus();
 
-    if ( stat & STAT_RX0IF ) {
+    if ( stat & RXSTATUS_RXB0 ) {
         rc = readMessage(RXB0, frame);
-    } else if ( stat & STAT_RX1IF ) {
+    } else if ( stat & RXSTATUS_RXB1 ) {
         rc = readMessage(RXB1, frame);
     } else {
         rc = ERROR_NOMSG;
@@ -724,6 +783,52 @@ MCP2515::ERROR MCP2515::readMessage(struct can_frame *frame)
     return rc;
 }
 
+/*
+ * Queue an RX STATUS without waiting for it. The callback gets the answer in
+ * buffer[1], which rxStatusBuffer() turns into the buffer to read.
+ */
+bool MCP2515::queueRxStatus(SpiTransaction *transaction, uint8_t *buffer)
+{
+    buffer[0] = INSTRUCTION_RX_STATUS;
+    buffer[1] = 0x00;
+    transaction->csPin = this->SPI_CS_PIN;
+    transaction->baudrate = this->SPI_CLOCK;
+    transaction->buffer = buffer;
+    transaction->length = 2;
+    spiTransactionCount++;
+    spiByteCount += 2;
+    return SPI_BUS->submit(transaction);
+}
+
+// Which receive buffer to read after queueRxStatus(), or -1 if both are empty
+int MCP2515::rxStatusBuffer(const uint8_t *buffer)
+{
+    if ( buffer[1] & RXSTATUS_RXB0 ) {
+        return RXB0;
+    }
+    if ( buffer[1] & RXSTATUS_RXB1 ) {
+        return RXB1;
+    }
+    return -1;
+}
+
+/*
+ * Queue a READ RX BUFFER without waiting for it. buffer must hold
+ * RX_BUFFER_READ_LENGTH bytes. Once the callback runs, decodeRxBuffer(&buffer[1])
+ * gives the frame.
+ */
+bool MCP2515::queueReadMessage(const RXBn rxbn, SpiTransaction *transaction, uint8_t *buffer)
+{
+    buffer[0] = (rxbn == RXB0) ? INSTRUCTION_READ_RX0 : INSTRUCTION_READ_RX1;
+    transaction->csPin = this->SPI_CS_PIN;
+    transaction->baudrate = this->SPI_CLOCK;
+    transaction->buffer = buffer;
+    transaction->length = RX_BUFFER_READ_LENGTH;
+    spiTransactionCount++;
+    spiByteCount += RX_BUFFER_READ_LENGTH;
+    return SPI_BUS->submit(transaction);
+}
+
 bool MCP2515::checkReceive(void)
 {
     uint8_t res = getStatus();
@@ -775,6 +880,16 @@ void MCP2515::clearTXInterrupts(void)
     modifyRegister(MCP_CANINTF, (CANINTF_TX0IF | CANINTF_TX1IF | CANINTF_TX2IF), 0);
 }
 
+void MCP2515::clearTXInterrupt(const TXBn txbn)
+{
+    modifyRegister(MCP_CANINTF, CANINTF_TX0IF << txbn, 0);
+}
+
+void MCP2515::setInterruptMask(const uint8_t mask)
+{
+    setRegister(MCP_CANINTE, mask);
+}
+
 void MCP2515::clearRXnOVR(void)
 {
 	uint8_t eflg = getErrorFlags();
@@ -2,6 +2,7 @@
 #define _MCP2515_H_
 
 #include "can.h"
+#include "include/spibus.h"
 
 #include "hardware/spi.h"
 #include "pico/time.h"
@@ -254,6 +255,18 @@ class MCP2515 {
             CANINTF_MERRF = 0x80
         };
 
+        // Bits of the byte returned by READ STATUS
+        enum /*class*/ STAT : uint8_t {
+            STAT_RX0IF  = (1<<0),
+            STAT_RX1IF  = (1<<1),
+            STAT_TX0REQ = (1<<2),
+            STAT_TX0IF  = (1<<3),
+            STAT_TX1REQ = (1<<4),
+            STAT_TX1IF  = (1<<5),
+            STAT_TX2REQ = (1<<6),
+            STAT_TX2IF  = (1<<7)
+        };
+
         enum /*class*/ EFLG : uint8_t {
             EFLG_RX1OVR = (1<<7),
             EFLG_RX0OVR = (1<<6),
@@ -308,13 +321,15 @@ class MCP2515 {
         static const uint8_t MCP_DLC  = 4;
         static const uint8_t MCP_DATA = 5;
 
-        enum /*class*/ STAT : uint8_t {
-            STAT_RX0IF = (1<<0),
-            STAT_RX1IF = (1<<1)
-        };
-
         static const uint8_t STAT_RXIF_MASK = STAT_RX0IF | STAT_RX1IF;
 
+        // RX STATUS bits 7:6 say which receive buffers hold a message
+        static const uint8_t RXSTATUS_RXB0 = 0x40;
+        static const uint8_t RXSTATUS_RXB1 = 0x80;
+
+        // Standard frame remote request, SIDL bit 4 in the receive buffers
+        static const uint8_t RXBnSIDL_SRR = 0x10;
+
         enum /*class*/ TXBnCTRL : uint8_t {
             TXB_ABTF   = 0x40,
             TXB_MLOA   = 0x20,
@@ -429,6 +444,7 @@ class MCP2515 {
         };
 
         static const uint32_t DEFAULT_SPI_CLOCK = 10000000; // 10MHz
+        static const uint8_t MAX_REGISTER_BURST = 14;     // A whole TXBn, CTRL..D7
 
         static const int N_TXBUFFERS = 3;
         static const int N_RXBUFFERS = 2;
@@ -446,13 +462,16 @@ class MCP2515 {
             CANINTF  CANINTF_RXnIF;
         } RXB[N_RXBUFFERS];
 
-        spi_inst_t* SPI_CHANNEL;
+        SpiBus* SPI_BUS;
         uint8_t SPI_CS_PIN;
+        uint32_t SPI_CLOCK;
+
+        uint32_t spiTransactionCount;
+        uint32_t spiByteCount;
 
     private:
 
-        inline void startSPI();
-        inline void endSPI();
+        inline void transfer(uint8_t *buffer, const uint16_t n);
 
         ERROR setMode(const CANCTRL_REQOP_MODE mode);
 
@@ -463,14 +482,15 @@ class MCP2515 {
         void modifyRegister(const REGISTER reg, const uint8_t mask, const uint8_t data);
 
         void prepareId(uint8_t *buffer, const bool ext, const uint32_t id);
+
+        uint8_t getRxStatus(void);
     
     public:
+        static const uint8_t RX_BUFFER_READ_LENGTH = 14;  // READ RX BUFFER instruction, then SIDH..D7
+
         MCP2515(
-            spi_inst_t* CHANNEL = spi0,
+            SpiBus* BUS,
             uint8_t CS_PIN = PICO_DEFAULT_SPI_CSN_PIN,
-            uint8_t TX_PIN = PICO_DEFAULT_SPI_TX_PIN,
-            uint8_t RX_PIN = PICO_DEFAULT_SPI_RX_PIN,
-            uint8_t SCK_PIN = PICO_DEFAULT_SPI_SCK_PIN,
             uint32_t _SPI_CLOCK = DEFAULT_SPI_CLOCK
         );
         ERROR reset(void);
@@ -484,10 +504,21 @@ class MCP2515 {
         ERROR setBitrate(const CAN_SPEED canSpeed, const CAN_CLOCK canClock);
         ERROR setFilterMask(const MASK num, const bool ext, const uint32_t ulData);
         ERROR setFilter(const RXF num, const bool ext, const uint32_t ulData);
+        void setSpiClock(const uint32_t clock) { SPI_CLOCK = clock; }
+        uint32_t getSpiClock(void) { return SPI_CLOCK; }
+        bool checkReadback(void);
+        ERROR loadTxBuffer(const TXBn txbn, const struct can_frame *frame);
+        void requestToSend(const TXBn txbn, const uint8_t priority);
         ERROR sendMessage(const TXBn txbn, const struct can_frame *frame);
         ERROR sendMessage(const struct can_frame *frame);
         ERROR readMessage(const RXBn rxbn, struct can_frame *frame);
         ERROR readMessage(struct can_frame *frame);
+        ERROR decodeRxBuffer(const uint8_t *tbufdata, struct can_frame *frame);
+        bool queueRxStatus(SpiTransaction *transaction, uint8_t *buffer);
+        static int rxStatusBuffer(const uint8_t *buffer);
+        bool queueReadMessage(const RXBn rxbn, SpiTransaction *transaction, uint8_t *buffer);
+        uint32_t getSpiTransactionCount(void) { return spiTransactionCount; }
+        uint32_t getSpiByteCount(void) { return spiByteCount; }
         bool checkReceive(void);
         bool checkError(void);
         uint8_t getErrorFlags(void);
@@ -496,6 +527,8 @@ class MCP2515 {
         uint8_t getInterruptMask(void);
         void clearInterrupts(void);
         void clearTXInterrupts(void);
+        void clearTXInterrupt(const TXBn txbn);
+        void setInterruptMask(const uint8_t mask);
         uint8_t getStatus(void);
         void clearRXnOVR(void);
         void clearMERR();
@@ -24,51 +24,64 @@
 */
 
 #include <stdio.h>
-#include <time.h>
 
 #include "include/module.h"
 #include "include/pack.h"
 #include "include/util.h"
 
+extern TimerWheel timerWheel;
 
 BatteryModule::BatteryModule() {}
 
 //
-BatteryModule::BatteryModule(int _id, BatteryPack* _pack, int _numCells, int _numTemperatureSensors) {
-    // printf("Creating module (id:%d, pack:%d, cpm:%d, t:%d)\n", _id, _pack->id, _numCells, _numTemperatureSensors);
+BatteryModule::BatteryModule(int _id, BatteryPack* _pack, CellStore* cells, int packId) {
+    // printf("Creating module (id:%d, pack:%d, cpm:%d, t:%d)\n", _id, _pack->id, CELLS_PER_MODULE, TEMPS_PER_MODULE);
     id = _id;
     // Point back to parent pack
     pack = _pack;
+    // Readings live in the battery-wide store
+    cellVoltage = cells->module_voltages(packId, id);
+    cellVoltageValid = cells->module_voltage_valid(packId, id);
+    cellTemperature = cells->module_temperatures(packId, id);
+    cellTemperatureValid = cells->module_temperature_valid(packId, id);
     // Initialise all cell voltages to zero
-    numCells = _numCells;
-    for ( int c = 0; c < numCells; c++ ) {
+    for ( int c = 0; c < CELLS_PER_MODULE; c++ ) {
         cellVoltage[c] = 0;
     }
+    *cellVoltageValid = 0;
+    voltage = 0;
+    lowestCell = 0;
+    highestCell = 0;
     // Initialise temperature sensor readings to zero
-    numTemperatureSensors = _numTemperatureSensors;
-    for ( int t = 0; t < numTemperatureSensors; t++ ) {
+    for ( int t = 0; t < TEMPS_PER_MODULE; t++ ) {
         cellTemperature[t] = -127;
     }
+    *cellTemperatureValid = 0;
     allModuleDataPopulated = false;
+    // Counts as alive until MODULE_TTL passes without a heartbeat
+    livenessTimer = LIVENESS_MODULE(packId, id);
+    timerWheel.add(livenessTimer, liveness_ticks(seconds(MODULE_TTL)));
+    pollRttUs = 0;
+    pollRttMaxUs = 0;
 }
 
 void BatteryModule::print() {
-    // printf("    Module id : %d (numCells : %d)\n", id, numCells);
+    // printf("    Module id : %d (numCells : %d)\n", id, CELLS_PER_MODULE);
     // printf("        Cell Voltages : ");
-    // for ( int c = 0; c < numCells; c++ ) {
+    // for ( int c = 0; c < CELLS_PER_MODULE; c++ ) {
     //     printf("%d:%umV ", c, cellVoltage[c]);
     // }
     // printf("\n");
     // printf("        Temperatures : ");
-    // for ( int t = 0; t < numTemperatureSensors; t++ ) {
+    // for ( int t = 0; t < TEMPS_PER_MODULE; t++ ) {
     //     printf("%d:%dC ", t, cellTemperature[t]);
     // }
     // printf("\n");
     printf("  %d : ", id);
-    for ( int c = 0; c < numCells; c++ ) {
+    for ( int c = 0; c < CELLS_PER_MODULE; c++ ) {
         printf("%u ", cellVoltage[c]);
     }
-    printf("\n");
+    printf(" rtt:%lu/%luus\n", pollRttUs, pollRttMaxUs);
 }
 
 
@@ -78,60 +91,80 @@ void BatteryModule::print() {
 //
 //// ----
 
-// Return total module voltage by summing the cell voltages
+// Return total module voltage, the sum of the cell voltages
 uint32_t BatteryModule::get_voltage() {
-    uint32_t voltage = 0;
-    for ( int c = 0; c < numCells; c++ ) {
-        voltage += cellVoltage[c];
-    }
     return voltage;
 }
 
 // Return the voltage of the lowest cell voltage in the module
 uint16_t BatteryModule::get_lowest_cell_voltage() {
-    uint16_t lowestCellVoltage = 10000;
-    for ( int c = 0; c < numCells; c++ ) {
-        if ( cellVoltage[c] < lowestCellVoltage ) {
-            lowestCellVoltage = cellVoltage[c];
-        }
-    }
-    return lowestCellVoltage;
+    return cellVoltage[lowestCell];
 }
 
 // Return the voltage of the highest cell in the module
 uint16_t BatteryModule::get_highest_cell_voltage() {
-    uint16_t highestCellVoltage = 0;
-    for ( int c = 0; c < numCells; c++ ) {
-        if ( cellVoltage[c] > highestCellVoltage ) {
-            highestCellVoltage = cellVoltage[c];
+    return cellVoltage[highestCell];
+}
+
+/*
+ * Update the voltage for a single cell, keeping the module voltage and the
+ * lowest/highest cells up to date as we go. The cells only need to be scanned
+ * again when the cell holding the lowest or highest voltage moves back towards
+ * the others. Returns true if the lowest or highest cell voltage changed.
+ */
+bool BatteryModule::set_cell_voltage(int cellIndex, uint16_t newCellVoltage) {
+    uint16_t oldCellVoltage = cellVoltage[cellIndex];
+    if ( newCellVoltage == oldCellVoltage ) {
+        return false;
+    }
+    uint16_t oldLowest = get_lowest_cell_voltage();
+    uint16_t oldHighest = get_highest_cell_voltage();
+
+    cellVoltage[cellIndex] = newCellVoltage;
+    voltage = voltage - oldCellVoltage + newCellVoltage;
+    if ( newCellVoltage != 0 ) {
+        *cellVoltageValid |= 1u << cellIndex;
+    } else {
+        *cellVoltageValid &= ~(1u << cellIndex);
+    }
+
+    if ( ( cellIndex == lowestCell && newCellVoltage > oldCellVoltage )
+            || ( cellIndex == highestCell && newCellVoltage < oldCellVoltage ) ) {
+        rescan_cell_voltages();
+    } else {
+        if ( newCellVoltage < oldLowest ) {
+            lowestCell = cellIndex;
+        }
+        if ( newCellVoltage > oldHighest ) {
+            highestCell = cellIndex;
         }
     }
-    return highestCellVoltage;
+
+    return ( get_lowest_cell_voltage() != oldLowest || get_highest_cell_voltage() != oldHighest );
 }
 
-// Update the voltage for a single cell
-void BatteryModule::set_cell_voltage(int cellIndex, uint16_t newCellVoltage) {
-    cellVoltage[cellIndex] = newCellVoltage;
+// Find the lowest and highest cells from scratch
+void BatteryModule::rescan_cell_voltages() {
+    lowestCell = 0;
+    highestCell = 0;
+    for ( int c = 1; c < CELLS_PER_MODULE; c++ ) {
+        if ( cellVoltage[c] < cellVoltage[lowestCell] ) {
+            lowestCell = c;
+        }
+        if ( cellVoltage[c] > cellVoltage[highestCell] ) {
+            highestCell = c;
+        }
+    }
 }
 
 // Return true if any of the cells in the module are under min voltage
 bool BatteryModule::has_empty_cell() {
-    for ( int c = 0; c < numCells; c++ ) {
-        if ( cellVoltage[c] <= CELL_EMPTY_VOLTAGE ) {
-            return true;
-        }
-    }
-    return false;
+    return ( get_lowest_cell_voltage() <= CELL_EMPTY_VOLTAGE );
 }
 
 // Return true if any of the cells in the module are over max voltage
 bool BatteryModule::has_full_cell() {
-    for ( int c = 0; c < numCells; c++ ) {
-        if ( cellVoltage[c] >= CELL_FULL_VOLTAGE ) {
-            return true;
-        }
-    }
-    return false;
+    return ( get_highest_cell_voltage() >= CELL_FULL_VOLTAGE );
 }
 
 //// ----
@@ -146,27 +179,24 @@ bool BatteryModule::all_module_data_populated() {
 }
 
 void BatteryModule::check_if_module_data_is_populated() {
-    bool voltageMissing = false;
-    for ( int c = 0; c < numCells; c++ ) {
-        if ( cellVoltage[c] == 0 ) {
-            voltageMissing = true;
-        }
-    }
-    bool temperatureMissing = false;
-    for ( int t = 0; t < numTemperatureSensors; t++ ) {
-        if ( cellTemperature[t] < -126 ) {
-            temperatureMissing = true;
-        }
-    }
+    bool voltageMissing = ( *cellVoltageValid != ( 1u << CELLS_PER_MODULE ) - 1 );
+    bool temperatureMissing = ( *cellTemperatureValid != ( 1u << TEMPS_PER_MODULE ) - 1 );
     allModuleDataPopulated = voltageMissing && temperatureMissing;
 }
 
 bool BatteryModule::is_alive() {
-    return ( ((double)(get_clock() - lastHeartbeat) / CLOCKS_PER_SEC) < MODULE_TTL );
+    return timerWheel.is_alive(livenessTimer);
+}
+
+void BatteryModule::record_poll_rtt(uint32_t rtt) {
+    pollRttUs = rtt;
+    if ( rtt > pollRttMaxUs ) {
+        pollRttMaxUs = rtt;
+    }
 }
 
 void BatteryModule::heartbeat() {
-    lastHeartbeat = get_clock();
+    timerWheel.heartbeat(livenessTimer);
 }
 
 //// ----
@@ -176,14 +206,15 @@ void BatteryModule::heartbeat() {
 //// ----
 
 // Update the value for one of the temperature sensors
-void BatteryModule::update_temperature(int tempSensorId, uint8_t newTemperature) {
+void BatteryModule::update_temperature(int tempSensorId, int8_t newTemperature) {
     cellTemperature[tempSensorId] = newTemperature;
+    *cellTemperatureValid |= 1u << tempSensorId;
 }
 
 // Return the temperature of the coldest sensor in the module
 int8_t BatteryModule::get_lowest_temperature() {
     int8_t lowestTemperature = 126;
-    for ( int t = 0; t < numTemperatureSensors; t++ ) {
+    for ( int t = 0; t < TEMPS_PER_MODULE; t++ ) {
         // Skip uninitialised readings
         if ( cellTemperature[t] < -126 ) {
             continue;
@@ -199,7 +230,7 @@ int8_t BatteryModule::get_lowest_temperature() {
 // Return the temperature of the hottest sensor in the module
 int8_t BatteryModule::get_highest_temperature() {
     int8_t highestTemperature = -126;
-    for ( int t = 0; t < numTemperatureSensors; t++ ) {
+    for ( int t = 0; t < TEMPS_PER_MODULE; t++ ) {
         // Skip uninitialised readings
         if ( cellTemperature[t] < -126 ) {
             continue;
@@ -221,8 +252,8 @@ bool BatteryModule::has_temperature_sensor_over_max() {
 // returns true when any temperature sensor in this module is over the warning
 // level, but below the critical level.
 bool BatteryModule::temperature_at_warning_level() {
-    for ( int c = 0; c < numCells; c++ ) {
-        if ( cellTemperature[c] >= WARNING_TEMPERATURE && cellTemperature[c] < MAXIMUM_TEMPERATURE ) {
+    for ( int t = 0; t < TEMPS_PER_MODULE; t++ ) {
+        if ( cellTemperature[t] >= WARNING_TEMPERATURE && cellTemperature[t] < MAXIMUM_TEMPERATURE ) {
             return true;
         }
     }
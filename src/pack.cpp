@@ -18,6 +18,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
 #include "hardware/gpio.h"
@@ -27,49 +28,34 @@
 #include "settings.h"
 #include "include/statemachine.h"
 #include "include/bms.h"
+#include "include/supervisor.h"
 
 #include "settings.h"
 
+extern Supervisor supervisor;
+
 
 BatteryPack::BatteryPack() {}
 
 BatteryPack::BatteryPack(int _id, int CANCSPin, int _contactorInhibitPin, int _contactorFeedbackPin,
-        int _numModules, int _numCellsPerModule, int _numTemperatureSensorsPerModule, mutex_t* _canMutex, Bms* _bms) {
+        CellStore* cells, CellStats* _stats, mutex_t* _canMutex, Bms* _bms) {
 
     id = _id;
-    numModules = _numModules;
-    numCellsPerModule = _numCellsPerModule;
-    numTemperatureSensorsPerModule = _numTemperatureSensorsPerModule;
+    stats = _stats;
     canMutex = _canMutex;
     bms = _bms;
 
     // Initialise modules
-    for ( int m = 0; m < numModules; m++ ) {
-        modules[m] = BatteryModule(m, this, numCellsPerModule, numTemperatureSensorsPerModule);
+    for ( int m = 0; m < MODULES_PER_PACK; m++ ) {
+        modules[m] = BatteryModule(m, this, cells, id);
     }
 
     // Set up dedicated CAN port for communicating with this pack
-    printf("[pack%d] creating CAN port\n", id);
-    //mutex_enter_timeout_ms(canMutex, 3000);
-    CAN = new MCP2515(spi0, CANCSPin, SPI_MISO, SPI_MOSI, SPI_CLK, 500000);
-    printf("[pack%d] memory address of CAN port : %p\n", id, CAN);
-    MCP2515::ERROR response;
-    printf("[pack%d] resetting battery CAN port\n", id);
-    response = CAN->reset();
-    if ( response != MCP2515::ERROR_OK ) {
-        printf("[pack%d] WARNING problem resetting battery CAN port: %d\n", id, response);
-    }
-    response = CAN->setBitrate(CAN_500KBPS, MCP_8MHZ);
-    if ( response != MCP2515::ERROR_OK ) {
-        printf("[pack%d] WARNING problem setting bitrate on battery CAN port : %d\n", id, response);
-    }
-    response = CAN->setNormalMode();
-    if ( response != MCP2515::ERROR_OK ) {
-        printf("[pack%d] WARNING problem setting normal mode on battery CAN port : %d\n", id, response);
-    }
-    //mutex_exit(canMutex);
-    
-    printf("[pack%d] CAN port status : %d\n", id, CAN->getStatus());
+    extern mutex_t canMutex;
+    char portName[16];
+    snprintf(portName, sizeof(portName), "pack%d-can", id);
+    canPort = new CanPort(portName, CANCSPin, CAN_INT_PINS[id], CAN_SPI_CLOCKS[id],
+                          &CAN_ACCEPTANCE[PACK_CAN_PORT(id)], &canMutex);
 
     can_frame testFrame;
     testFrame.can_id = 0x000;
@@ -85,10 +71,16 @@ BatteryPack::BatteryPack(int _id, int CANCSPin, int _contactorInhibitPin, int _c
     }
 
     // Set last update time to now
-    lastUpdate = get_absolute_time();
+    lastUpdate = monotonic_now();
 
-    voltage = 0.0000f;
+    voltage = 0;
     cellDelta = 0;
+    cellExtremeRescanCount = 0;
+    rescan_cell_extremes();
+    dirtyModules = 0;
+    voltagesDirty = false;
+    temperaturesDirty = false;
+    recomputeDue = false;
 
     // Set up contactor control.
     contactorInhibitPin = _contactorInhibitPin;
@@ -104,53 +96,55 @@ BatteryPack::BatteryPack(int _id, int CANCSPin, int _contactorInhibitPin, int _c
     gpio_set_irq_enabled(NEG_CONTACTOR_FEEDBACK_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true);
 
     // Set next balance time to 10 seconds from now
-    nextBalanceTime = delayed_by_us(get_absolute_time(), 10000);
+    nextBalanceTime = monotonic_now() + seconds(10);
 
     inStartup = true;
     modulePollingCycle = 0;
+    balancingEnabled = false;
+    pollCycleFrames = pollModuleFrames;
+    pollNextModule = MODULES_PER_PACK;
+    pollAwaitingModule = -1;
+    pollResponseFrames = 0;
+    pollSentTime = Timestamp();
+    pollRttAverageUs = 0;
+    pollSlotUs = POLL_INTERVAL_MS * 1000 / MODULES_PER_PACK;
+    pollTimeoutCount = 0;
+    pollOverrunCount = 0;
+    pollSendFailCount = 0;
+    decodeFrameCount = 0;
+    decodeTimeUs = 0;
+    newestFrameTime = Timestamp();
 
     canTxErrorCount = 0;
-    canRxErrorCount = 0;
-
-    crc8.begin();
 
     printf("[pack%d] setup complete\n", id);
 }
 
 void BatteryPack::print() {
-    printf("[pack%d] %3.2fV : Hi %d : Lo %d : %dmV\n", id, (voltage/1000), get_highest_cell_voltage(), get_lowest_cell_voltage(), cellDelta);
-    for ( int m = 0; m < numModules; m++ ) {
+    printf("[pack%d] %lu.%02luV : Hi %d : Lo %d : %dmV\n", id, voltage / 1000, ( voltage % 1000 ) / 10, get_highest_cell_voltage(), get_lowest_cell_voltage(), cellDelta);
+    canPort->print();
+    printf("[pack%d] poll slot:%luus rtt(avg):%luus timeouts:%lu overruns:%lu sendFails:%lu\n", id, pollSlotUs,
+        pollRttAverageUs, pollTimeoutCount, pollOverrunCount, pollSendFailCount);
+    uint32_t decodeMeanNs = decodeFrameCount > 0 ? decodeTimeUs * 1000 / decodeFrameCount : 0;
+    printf("[pack%d] decoded:%lu mean:%luns/frame rescans:%lu\n", id, decodeFrameCount, decodeMeanNs,
+        cellExtremeRescanCount);
+    for ( int m = 0; m < MODULES_PER_PACK; m++ ) {
         modules[m].print();
     }
 }
 
-uint8_t BatteryPack::getcheck(can_frame &msg, int id) {
-    unsigned char canmes[11];
-    int meslen = msg.can_dlc + 1;  // remove one for crc and add two for id bytes
-    canmes[1] = msg.can_id;
-    canmes[0] = msg.can_id >> 8;
-
-    for (int i = 0; i < (msg.can_dlc - 1); i++) {
-        canmes[i + 2] = msg.data[i];
-    }
-    return (crc8.get_crc8(canmes, meslen, finalxor[id]));
-}
-
 int8_t BatteryPack::get_module_liveness(int8_t moduleId) {
     return modules[moduleId].is_alive();
 }
 
 bool BatteryPack::is_alive() {
-    for ( int m = 0; m < numModules; m++ ) {
-        if ( !modules[m].is_alive() ) {
-            return false;
-        }
-    }
-    return true;
+    extern TimerWheel timerWheel;
+    uint64_t packModules = ( ( 1ull << MODULES_PER_PACK ) - 1 ) << LIVENESS_MODULE(id, 0);
+    return ( timerWheel.get_alive() & packModules ) == packModules;
 }
 
 /*
- * Send CAN frame to each module to request voltage and temperature data.
+ * Poll frame asking one module for voltage and temperature data.
  *
  * Contents of message
  *   byte 0 : balance data
@@ -167,44 +161,152 @@ bool BatteryPack::is_alive() {
  *     bits 4-7 : module number
  *   byte 7 : checksum
  */
+constexpr void build_poll_frame(can_frame* pollModuleFrame, int m, uint8_t cycle, bool inStartup, bool balancingEnabled,
+        uint16_t lowestCellVoltage) {
+    pollModuleFrame->can_id = 0x080 | (m);
+    pollModuleFrame->can_dlc = 8;
+    if ( balancingEnabled ) {
+        pollModuleFrame->data[0] = lowestCellVoltage && 0xFF;
+        pollModuleFrame->data[1] = lowestCellVoltage >> 8 && 0xFF;
+    } else {
+        pollModuleFrame->data[0] = 0xC7;
+        pollModuleFrame->data[1] = 0x10;
+    }
+    pollModuleFrame->data[2] = 0x00;
+    pollModuleFrame->data[3] = 0x00;
+    if ( inStartup ) {
+        pollModuleFrame->data[4] = 0x20;
+        pollModuleFrame->data[5] = 0x00;
+    } else {
+        pollModuleFrame->data[4] = 0x40;
+        pollModuleFrame->data[5] = 0x01;
+    }
+    pollModuleFrame->data[6] = cycle << 4;
+    if ( inStartup && cycle == 2 ) {
+        pollModuleFrame->data[6] = pollModuleFrame->data[6] + 0x04;
+    }
+    pollModuleFrame->data[7] = BatteryPack::getcheck(*pollModuleFrame, m);
+}
+
+/*
+ * Every poll frame that doesn't carry balance data, worked out at compile
+ * time. Indexed by [inStartup][cycle][module], so the frames for one cycle sit
+ * next to each other and can be queued straight from flash.
+ */
+struct PollFrameTable {
+    can_frame frames[2][POLL_CYCLES][MODULES_PER_PACK];
+};
+
+constexpr PollFrameTable make_poll_frames() {
+    PollFrameTable table = {};
+    for ( int startup = 0; startup < 2; startup++ ) {
+        for ( int cycle = 0; cycle < POLL_CYCLES; cycle++ ) {
+            for ( int m = 0; m < MODULES_PER_PACK; m++ ) {
+                build_poll_frame(&table.frames[startup][cycle][m], m, cycle, startup, false, 0);
+            }
+        }
+    }
+    return table;
+}
+
+static constexpr PollFrameTable pollFrames = make_poll_frames();
+
+// Bit at a time CRC, for checking the table driven one
+constexpr uint8_t reference_crc8(const uint8_t* message, int nBytes, uint8_t final) {
+    uint8_t remainder = 0xFF;
+    for ( int i = 0; i < nBytes; i++ ) {
+        remainder ^= message[i];
+        for ( int bit = 0; bit < 8; bit++ ) {
+            remainder = ( remainder & 0x80 ) ? ( remainder << 1 ) ^ POLYNOMIAL : ( remainder << 1 );
+        }
+    }
+    return remainder ^ final;
+}
+
+/*
+ * Byte i of the poll frame for module m, written out the way request_data()
+ * used to fill it in, with a bit at a time CRC. Nothing is shared with
+ * build_poll_frame(), so a slip in either one shows up as a mismatch.
+ */
+constexpr uint8_t reference_poll_byte(bool inStartup, int cycle, int m, int i) {
+    // The CRC covers the two ID bytes and data bytes 0 - 6
+    const uint8_t message[9] = {
+        0x00,
+        static_cast<uint8_t>(0x080 | m),
+        0xC7,
+        0x10,
+        0x00,
+        0x00,
+        static_cast<uint8_t>(inStartup ? 0x20 : 0x40),
+        static_cast<uint8_t>(inStartup ? 0x00 : 0x01),
+        static_cast<uint8_t>(( cycle << 4 ) + ( ( inStartup && cycle == 2 ) ? 0x04 : 0x00 )),
+    };
+    if ( i < 7 ) {
+        return message[i + 2];
+    }
+    return reference_crc8(message, 9, finalxor[m]);
+}
+
+// Frames in the precomputed poll table that differ from the reference
+constexpr int count_poll_frame_mismatches() {
+    int mismatches = 0;
+    for ( int startup = 0; startup < 2; startup++ ) {
+        for ( int cycle = 0; cycle < POLL_CYCLES; cycle++ ) {
+            for ( int m = 0; m < MODULES_PER_PACK; m++ ) {
+                const can_frame& frame = pollFrames.frames[startup][cycle][m];
+                bool match = frame.can_id == static_cast<uint32_t>(0x080 | m) && frame.can_dlc == 8;
+                for ( int i = 0; i < 8 && match; i++ ) {
+                    match = frame.data[i] == reference_poll_byte(startup, cycle, m, i);
+                }
+                if ( !match ) {
+                    mismatches++;
+                }
+            }
+        }
+    }
+    return mismatches;
+}
+
+static_assert(count_poll_frame_mismatches() == 0, "Precomputed poll frames don't match the module protocol");
+
+/*
+ * Send CAN frame to each module to request voltage and temperature data. The
+ * frames come straight from the precomputed table, unless they have to carry
+ * balance data.
+ */
 void BatteryPack::request_data() {
     // Counter that cycles from 0x0 to 0xE
-    if ( modulePollingCycle == 0xF ) {
+    if ( modulePollingCycle == POLL_CYCLES ) {
         modulePollingCycle = 0;
         balancingEnabled = pack_is_due_to_be_balanced();
     }
-    for ( int m = 0; m < numModules; m++ ) {
-        pollModuleFrame.can_id = 0x080 | (m);
-        pollModuleFrame.can_dlc = 8;
-        if ( balancingEnabled ) {
-            pollModuleFrame.data[0] = get_lowest_cell_voltage() && 0xFF;
-            pollModuleFrame.data[1] = get_lowest_cell_voltage() >> 8 && 0xFF;
-        } else {
-            pollModuleFrame.data[0] = 0xC7;
-            pollModuleFrame.data[1] = 0x10;
-        }
-        pollModuleFrame.data[2] = 0x00;
-        pollModuleFrame.data[3] = 0x00;
-        if ( inStartup ) {
-            pollModuleFrame.data[4] = 0x20;
-            pollModuleFrame.data[5] = 0x00;
-        } else {
-            if ( balancingEnabled ) {
-                pollModuleFrame.data[4] = 0x40;
-            } else {
-                pollModuleFrame.data[4] = 0x40;
-            }
-            pollModuleFrame.data[5] = 0x01;
-        }
-        pollModuleFrame.data[6] = modulePollingCycle << 4;
-        if ( inStartup && modulePollingCycle == 2 ) {
-            pollModuleFrame.data[6] = pollModuleFrame.data[6] + 0x04;
+    if ( balancingEnabled ) {
+        for ( int m = 0; m < MODULES_PER_PACK; m++ ) {
+            build_poll_frame(&pollModuleFrames[m], m, modulePollingCycle, inStartup, true, get_lowest_cell_voltage());
         }
-        pollModuleFrame.data[7] = getcheck(pollModuleFrame, m);
-        if ( !send_frame(&pollModuleFrame) ) {
-            printf("[pack%d][request_data] ERROR sending poll message to module %d\n", id, m);
+        pollCycleFrames = pollModuleFrames;
+    } else {
+        pollCycleFrames = pollFrames.frames[inStartup][modulePollingCycle];
+    }
+    #if POLL_STAGGERED
+    // Poll the first module now. The rest are polled from service_polls() as
+    // each one finishes answering.
+    if ( pollNextModule < MODULES_PER_PACK || pollAwaitingModule >= 0 ) {
+        pollOverrunCount++;
+    }
+    pollNextModule = 0;
+    pollAwaitingModule = -1;
+    send_next_poll();
+    #else
+    // Queue the whole cycle at once so that it goes out back to back
+    int queued = canPort->queue_batch(pollCycleFrames, MODULES_PER_PACK, CAN_TX_POLL);
+    if ( queued < MODULES_PER_PACK ) {
+        printf("[pack%d][request_data] ERROR only queued %d of %d poll messages\n", id, queued, MODULES_PER_PACK);
+        for ( int i = queued; i < MODULES_PER_PACK; i++ ) {
+            increment_can_tx_error_count();
         }
     }
+    #endif
     if ( inStartup && modulePollingCycle == 2 ) {
         inStartup = false;
     }
@@ -212,88 +314,188 @@ void BatteryPack::request_data() {
     return;
 }
 
+// Poll the next module in this cycle, if there are any left. If the poll
+// can't be queued the same module is tried again on the next pass. That can
+// be every pass while the TX queue is full, so failures are only counted, and
+// shown by print().
+void BatteryPack::send_next_poll() {
+    if ( pollNextModule >= MODULES_PER_PACK ) {
+        return;
+    }
+    int m = pollNextModule;
+    if ( !send_frame(&pollCycleFrames[m], CAN_TX_POLL) ) {
+        pollSendFailCount++;
+        return;
+    }
+    pollNextModule++;
+    pollAwaitingModule = m;
+    pollResponseFrames = 0;
+    pollSentTime = monotonic_now();
+}
+
 /*
- * Check for message from battery modules, parse as required.
+ * Move on to the next module once the one we polled has answered in full, or
+ * once its slot has run out. The slot is twice the smoothed response time,
+ * but never so long that the cycle can't fit in POLL_INTERVAL_MS.
  */
-void BatteryPack::read_message() {
-    extern mutex_t canMutex;
-    can_frame frame;
-
-    // Try to get the mutex. If we can't, we'll try again next time.
-    if ( !mutex_enter_timeout_ms(&canMutex, CAN_MUTEX_TIMEOUT_MS) ) {
-        printf("[pack%d][read_message] failed to get battery pack CAN mutex\n", this->id);
-        increment_can_rx_error_count();
-        return;
+void BatteryPack::service_polls() {
+    if ( pollAwaitingModule >= 0 ) {
+        if ( pollResponseFrames >= MODULE_RESPONSE_FRAMES ) {
+            pollAwaitingModule = -1;
+        } else if ( elapsed_since(pollSentTime) > microseconds(pollSlotUs) ) {
+            pollTimeoutCount++;
+            pollAwaitingModule = -1;
+        }
     }
+    if ( pollAwaitingModule < 0 ) {
+        send_next_poll();
+    }
+}
 
-    // Check for message
-    MCP2515::ERROR result = CAN->readMessage(&frame);
-    mutex_exit(&canMutex);
+/*
+ * Routes for each module message type, worked out at compile time.
+ *
+ *   0x100 : status
+ *   0x110 : no data, but counts as a heartbeat
+ *   0x120 - 0x170 : cell voltages, CELLS_PER_VOLTAGE_FRAME per frame
+ *   0x180 : temperatures
+ */
+struct PackRouteTable {
+    PackRoute routes[NUM_PACK_ROUTES];
+};
 
-    // Return if we don't have a message to process
-    if ( result != MCP2515::ERROR_OK ) {
-        increment_can_rx_error_count();
-        return;
+constexpr PackRouteTable make_pack_routes() {
+    PackRouteTable table = {};
+    table.routes[0x0] = { &BatteryPack::decode_status, 0, 0, PACK_VOLTAGES_CHANGED };
+    table.routes[0x1] = { &BatteryPack::decode_heartbeat, 0, 0, 0 };
+    for ( int cell = 0; cell < CELLS_PER_MODULE; cell += CELLS_PER_VOLTAGE_FRAME ) {
+        int numCells = CELLS_PER_MODULE - cell < CELLS_PER_VOLTAGE_FRAME ? CELLS_PER_MODULE - cell : CELLS_PER_VOLTAGE_FRAME;
+        table.routes[0x2 + cell / CELLS_PER_VOLTAGE_FRAME] = {
+            &BatteryPack::decode_voltages, static_cast<uint8_t>(cell), static_cast<uint8_t>(numCells), PACK_VOLTAGES_CHANGED };
     }
+    table.routes[0x8] = { &BatteryPack::decode_temperatures, 0, 0, PACK_TEMPERATURES_CHANGED };
+    return table;
+}
 
-    // printf("[pack%d][read_message] received message 0x%03X : ", this->id, frame.can_id);
-    // for ( int i = 0; i < frame.can_dlc; i++ ) {
-    //     printf("%02X ", frame.data[i]);
-    // }
-    // printf("\n");
+static_assert(0x2 + ( CELLS_PER_MODULE + CELLS_PER_VOLTAGE_FRAME - 1 ) / CELLS_PER_VOLTAGE_FRAME <= 0x8,
+    "Cell voltage frames would run into the temperature frame");
 
-    // Temperature messages
-    if ( (frame.can_id & 0xFF0) == 0x180 ) {
-        decode_temperatures(&frame);
-        this->battery->process_temperature_update();
-    }
-    // Voltage messages
-    if (frame.can_id > 0x99 && frame.can_id < 0x180) {
-        decode_voltages(&frame);
-        this->battery->process_voltage_update();
+static constexpr PackRouteTable packRoutes = make_pack_routes();
+
+/*
+ * Decode the messages from the battery modules that have been received on this
+ * pack's CAN port. Decoding only stores the new readings and marks what has
+ * changed. The pack and battery figures are recalculated once a module has
+ * answered in full, and at the start of each poll cycle.
+ */
+void BatteryPack::read_message() {
+    can_frame frame;
+    Timestamp timestamp;
+
+    // Collect anything the interrupt handler didn't get to. The supervisor
+    // only hears from us if the port could be serviced.
+    if ( canPort->service() ) {
+        supervisor.check_in(SUPERVISED_PACK_RX(id));
     }
-}
 
-bool BatteryPack::send_frame(can_frame *frame) {
-    extern mutex_t canMutex;
-    for ( int i = 0; i < SEND_FRAME_RETRIES; i++ ) {
+    while ( canPort->pop_frame(&frame, &timestamp) ) {
 
-        // printf("[pack%d][send_frame] 0x%03X  [ ", this->id, frame->can_id);
-        // for ( int i = 0; i < frame->can_dlc; i++ ) {
-        //     printf("%02X ", frame->data[i]);
+        // printf("[pack%d][read_message] received message 0x%03X : ", this->id, frame.can_id);
+        // for ( int i = 0; i < frame.can_dlc; i++ ) {
+        //     printf("%02X ", frame.data[i]);
         // }
-        // printf("]\n");
+        // printf("\n");
 
-        // Try to get the mutex. If we can't, we'll try again next time.
-        if ( !mutex_enter_timeout_ms(&canMutex, CAN_MUTEX_TIMEOUT_MS) ) {
-            printf("[pack%d][send_frame] failed to get battery pack CAN mutex\n", this->id);
-            increment_can_tx_error_count();
+        uint32_t routeId = ( frame.can_id - PACK_FRAME_BASE_ID ) >> 4;
+        int moduleId = frame.can_id & 0x00F;
+        if ( frame.can_id < PACK_FRAME_BASE_ID || routeId >= NUM_PACK_ROUTES
+                || packRoutes.routes[routeId].decode == nullptr || moduleId >= MODULES_PER_PACK ) {
+            canPort->count_discarded_frame();
             continue;
         }
-        
-        MCP2515::ERROR result = CAN->sendMessage(frame);
-        mutex_exit(&canMutex);
-
-        switch (result) {
-            case MCP2515::ERROR_FAIL:
-                printf("[pack%d][send_frame] ERROR sending message to battery pack (ERROR_FAIL)\n", this->id);
-                increment_can_tx_error_count();
-            case MCP2515::ERROR_ALLTXBUSY:
-                printf("[pack%d][send_frame] ERROR sending message to battery pack (ALLTXBUSY)\n", this->id);
-                increment_can_tx_error_count();
-            case MCP2515::ERROR_FAILINIT:
-                printf("[pack%d][send_frame] ERROR sending message to battery pack (FAILINIT)\n", this->id);
-                increment_can_tx_error_count();
-            case MCP2515::ERROR_FAILTX:
-                printf("[pack%d][send_frame] ERROR sending message to battery pack (FAILTX)\n", this->id);
-                increment_can_tx_error_count();
+
+        uint64_t decodeStart = time_us_64();
+        const PackRoute* route = &packRoutes.routes[routeId];
+        (this->*route->decode)(&frame, moduleId, route);
+        if ( route->changes & PACK_TEMPERATURES_CHANGED ) {
+            temperaturesDirty = true;
+        }
+        if ( route->changes & PACK_VOLTAGES_CHANGED ) {
+            voltagesDirty = true;
         }
+        decodeTimeUs += time_us_64() - decodeStart;
+        decodeFrameCount++;
+        newestFrameTime = timestamp;
+
+        // Is this the module we're waiting on? Heartbeats don't count towards
+        // its answer.
+        if ( static_cast<int>(frame.can_id & 0x00F) == pollAwaitingModule && route->changes != 0
+                && ++pollResponseFrames == MODULE_RESPONSE_FRAMES ) {
+            uint32_t rtt = ( timestamp - pollSentTime ).as_us();
+            modules[pollAwaitingModule].record_poll_rtt(rtt);
+            pollRttAverageUs = pollRttAverageUs == 0 ? rtt : ( pollRttAverageUs * 7 + rtt ) / 8;
+            uint32_t maxSlotUs = POLL_INTERVAL_MS * 1000 / MODULES_PER_PACK;
+            pollSlotUs = pollRttAverageUs * 2;
+            if ( pollSlotUs < POLL_SLOT_MIN_US ) {
+                pollSlotUs = POLL_SLOT_MIN_US;
+            }
+            if ( pollSlotUs > maxSlotUs ) {
+                pollSlotUs = maxSlotUs;
+            }
+            recomputeDue = true;
+        }
+    }
 
-        if ( result == MCP2515::ERROR_OK) {
-            return true;
+    if ( recomputeDue ) {
+        recomputeDue = false;
+        this->battery->recompute();
+    }
+
+    #if POLL_STAGGERED
+    service_polls();
+    #endif
+}
+
+/*
+ * Bring the pack voltage and lowest/highest cells up to date with whatever has
+ * been decoded since the last call. Returns PACK_*_CHANGED flags saying what
+ * was recalculated.
+ */
+uint8_t BatteryPack::recompute() {
+    uint8_t changed = 0;
+    if ( voltagesDirty ) {
+        millivolts_t newVoltage = 0;
+        for ( int m = 0; m < MODULES_PER_PACK; m++ ) {
+            newVoltage += modules[m].get_voltage();
         }
+        voltage = newVoltage;
+        while ( dirtyModules != 0 ) {
+            int m = __builtin_ctz(dirtyModules);
+            dirtyModules &= dirtyModules - 1;
+            update_cell_extremes(m);
+        }
+        voltagesDirty = false;
+        changed |= PACK_VOLTAGES_CHANGED;
     }
-    return false;
+    if ( temperaturesDirty ) {
+        temperaturesDirty = false;
+        changed |= PACK_TEMPERATURES_CHANGED;
+    }
+    return changed;
+}
+
+bool BatteryPack::send_frame(const can_frame *frame, CanTxPriority priority) {
+    // printf("[pack%d][send_frame] 0x%03X  [ ", this->id, frame->can_id);
+    // for ( int i = 0; i < frame->can_dlc; i++ ) {
+    //     printf("%02X ", frame->data[i]);
+    // }
+    // printf("]\n");
+
+    if ( !canPort->queue_frame(frame, priority) ) {
+        increment_can_tx_error_count();
+        return false;
+    }
+    return true;
 }
 
 void BatteryPack::set_pack_error_status(int newErrorStatus) {
@@ -314,11 +516,11 @@ int BatteryPack::get_pack_balance_status() {
 
 // Return true if it's time for the pack to be balanced.
 bool BatteryPack::pack_is_due_to_be_balanced() {
-    return ( absolute_time_diff_us(get_absolute_time(), nextBalanceTime) < 0 );
+    return monotonic_now() > nextBalanceTime;
 }
 
 void BatteryPack::reset_balance_timer() {
-    nextBalanceTime = delayed_by_us(get_absolute_time(), CELL_BALANCE_INTERVAL);
+    nextBalanceTime = monotonic_now() + milliseconds(CELL_BALANCE_INTERVAL);
 }
 
 
@@ -329,37 +531,18 @@ void BatteryPack::reset_balance_timer() {
 //// ----
 
 // Return the voltage of the whole pack
-float BatteryPack::get_voltage() {
+millivolts_t BatteryPack::get_voltage() {
     return voltage;
 }
 
-// Update the pack voltage value by summing all of the cell voltages
-void BatteryPack::recalculate_total_voltage() {
-    float newVoltage = 0;
-    for ( int m = 0; m < numModules; m++ ) {
-        newVoltage += modules[m].get_voltage();
-    }
-    voltage = newVoltage;
-}
-
 // Return the voltage of the lowest cell in the pack
 uint16_t BatteryPack::get_lowest_cell_voltage() {
-    uint16_t lowestCellVoltage = 10000;
-    for ( int m = 0; m < numModules; m++ ) {
-        // skip modules with incomplete cell data
-        if ( !modules[m].all_module_data_populated() ) {
-            continue;
-        }
-        if ( modules[m].get_lowest_cell_voltage() < lowestCellVoltage ) {
-            lowestCellVoltage = modules[m].get_lowest_cell_voltage();
-        }
-    }
     return lowestCellVoltage;
 }
 
 // Return true if any cell in the pack is under min voltage
 bool BatteryPack::has_empty_cell() {
-    for ( int m = 0; m < numModules; m++ ) {
+    for ( int m = 0; m < MODULES_PER_PACK; m++ ) {
         if ( modules[m].has_empty_cell() ) {
             return true;
         }
@@ -369,22 +552,12 @@ bool BatteryPack::has_empty_cell() {
 
 // Return the voltage of the highest cell in the pack
 uint16_t BatteryPack::get_highest_cell_voltage() {
-    uint16_t highestCellVoltage = 0;
-    for ( int m = 0; m < numModules; m++ ) {
-        // skip modules with incomplete cell data
-        if ( !modules[m].all_module_data_populated() ) {
-            continue;
-        }
-        if ( modules[m].get_highest_cell_voltage() > highestCellVoltage ) {
-            highestCellVoltage = modules[m].get_highest_cell_voltage();
-        }
-    }
     return highestCellVoltage;
 }
 
 // Return true if any cell in the pack is over max voltage
 bool BatteryPack::has_full_cell() {
-    for ( int m = 0; m < numModules; m++ ) {
+    for ( int m = 0; m < MODULES_PER_PACK; m++ ) {
         if ( modules[m].has_full_cell() ) {
             return true;
         }
@@ -392,84 +565,103 @@ bool BatteryPack::has_full_cell() {
     return false;
 }
 
-// Update the value for the voltage of an individual cell in a pack
+// Update the value for the voltage of an individual cell in a pack. The pack
+// figures are left for recompute(), which only has to look at the modules
+// whose lowest/highest cell moved.
 void BatteryPack::set_cell_voltage(int moduleId, int cellIndex, uint32_t newCellVoltage) {
-    modules[moduleId].set_cell_voltage(cellIndex, newCellVoltage);
-}
-
-// Extract voltage readings from CAN message and update stored values
-void BatteryPack::decode_voltages(can_frame *frame) {
-    int messageId = (frame->can_id & 0x0F0);
-    int moduleId = (frame->can_id & 0x00F);
-
-    switch (messageId) {
-        case 0x000:
-            set_pack_error_status(frame->data[0] + (frame->data[1] << 8) + (frame->data[2] << 16) + (frame->data[3] << 24));
-            set_pack_balance_status((frame->data[5] << 8) + frame->data[4]);
-            break;
-        case 0x020:
-            if ( get_pack_balance_status() == 0 ) {
-                modules[moduleId].set_cell_voltage(0, static_cast<uint16_t>(frame->data[0] + (frame->data[1] & 0x3F) * 256));
-                modules[moduleId].set_cell_voltage(1, static_cast<uint16_t>(frame->data[2] + (frame->data[3] & 0x3F) * 256));
-                modules[moduleId].set_cell_voltage(2, static_cast<uint16_t>(frame->data[4] + (frame->data[5] & 0x3F) * 256));
-            }
-            break;
-        case 0x030:
-            if ( get_pack_balance_status() == 0 ) {
-                modules[moduleId].set_cell_voltage(3, static_cast<uint16_t>(frame->data[0] + (frame->data[1] & 0x3F) * 256));
-                modules[moduleId].set_cell_voltage(4, static_cast<uint16_t>(frame->data[2] + (frame->data[3] & 0x3F) * 256));
-                modules[moduleId].set_cell_voltage(5, static_cast<uint16_t>(frame->data[4] + (frame->data[5] & 0x3F) * 256));
-            }
-            break;
-        case 0x040:
-            if ( get_pack_balance_status() == 0 ) {
-                modules[moduleId].set_cell_voltage(6, static_cast<uint16_t>(frame->data[0] + (frame->data[1] & 0x3F) * 256));
-                modules[moduleId].set_cell_voltage(7, static_cast<uint16_t>(frame->data[2] + (frame->data[3] & 0x3F) * 256));
-                modules[moduleId].set_cell_voltage(8, static_cast<uint16_t>(frame->data[4] + (frame->data[5] & 0x3F) * 256));
-            }
-            break;
-        case 0x050:
-            if ( get_pack_balance_status() == 0 ) {
-                modules[moduleId].set_cell_voltage(9, static_cast<uint16_t>(frame->data[0] + (frame->data[1] & 0x3F) * 256));
-                modules[moduleId].set_cell_voltage(10, static_cast<uint16_t>(frame->data[2] + (frame->data[3] & 0x3F) * 256));
-                modules[moduleId].set_cell_voltage(11, static_cast<uint16_t>(frame->data[4] + (frame->data[5] & 0x3F) * 256));
-            }
-            break;
-        case 0x060:
-            if ( get_pack_balance_status() == 0 ) {
-                modules[moduleId].set_cell_voltage(12, static_cast<uint16_t>(frame->data[0] + (frame->data[1] & 0x3F) * 256));
-                modules[moduleId].set_cell_voltage(13, static_cast<uint16_t>(frame->data[2] + (frame->data[3] & 0x3F) * 256));
-                modules[moduleId].set_cell_voltage(14, static_cast<uint16_t>(frame->data[4] + (frame->data[5] & 0x3F) * 256));
-            }
-            break;
-        case 0x070:
-            if ( get_pack_balance_status() == 0 ) {
-                modules[moduleId].set_cell_voltage(15, static_cast<uint16_t>(frame->data[0] + (frame->data[1] & 0x3F) * 256));
-            }
-            break;
-        default:
-            break;
+    if ( modules[moduleId].set_cell_voltage(cellIndex, newCellVoltage) ) {
+        dirtyModules |= 1u << moduleId;
     }
+    voltagesDirty = true;
+}
 
-    // Check if this update has left us with a complete set of voltage/temperature readings
+/*
+ * A module's lowest or highest cell has changed, or the module has just become
+ * fully populated. Only when the module that held the pack's lowest/highest
+ * cell moves back towards the rest do all the modules have to be checked.
+ */
+void BatteryPack::update_cell_extremes(int moduleId) {
+    // skip modules with incomplete cell data
     if ( !modules[moduleId].all_module_data_populated() ) {
-        modules[moduleId].check_if_module_data_is_populated();
+        return;
     }
+    uint16_t moduleLowest = modules[moduleId].get_lowest_cell_voltage();
+    uint16_t moduleHighest = modules[moduleId].get_highest_cell_voltage();
 
-    modules[moduleId].heartbeat();
+    if ( ( moduleId == lowestCellModule && moduleLowest > lowestCellVoltage )
+            || ( moduleId == highestCellModule && moduleHighest < highestCellVoltage ) ) {
+        rescan_cell_extremes();
+        return;
+    }
+    if ( moduleLowest <= lowestCellVoltage ) {
+        lowestCellVoltage = moduleLowest;
+        lowestCellModule = moduleId;
+    }
+    if ( moduleHighest >= highestCellVoltage ) {
+        highestCellVoltage = moduleHighest;
+        highestCellModule = moduleId;
+    }
+    cellDelta = highestCellVoltage - lowestCellVoltage;
 }
 
-// Update the cellDelta
-void BatteryPack::recalculate_cell_delta() {
-    cellDelta = get_highest_cell_voltage() - get_lowest_cell_voltage();
+// Find the lowest and highest cells across all fully populated modules
+void BatteryPack::rescan_cell_extremes() {
+    lowestCellVoltage = 10000;
+    highestCellVoltage = 0;
+    lowestCellModule = -1;
+    highestCellModule = -1;
+    for ( int m = 0; m < MODULES_PER_PACK; m++ ) {
+        // skip modules with incomplete cell data
+        if ( !modules[m].all_module_data_populated() ) {
+            continue;
+        }
+        if ( modules[m].get_lowest_cell_voltage() < lowestCellVoltage ) {
+            lowestCellVoltage = modules[m].get_lowest_cell_voltage();
+            lowestCellModule = m;
+        }
+        if ( modules[m].get_highest_cell_voltage() > highestCellVoltage ) {
+            highestCellVoltage = modules[m].get_highest_cell_voltage();
+            highestCellModule = m;
+        }
+    }
+    cellDelta = highestCellVoltage - lowestCellVoltage;
+    cellExtremeRescanCount++;
 }
 
-/*
- * We have new cell voltage data. Recalculate.
- */
-void BatteryPack::process_voltage_update() {
-    recalculate_total_voltage();
-    recalculate_cell_delta();
+// Module status frame (message type 0)
+void BatteryPack::decode_status(can_frame *frame, int moduleId, const PackRoute* route) {
+    set_pack_error_status(frame->data[0] + (frame->data[1] << 8) + (frame->data[2] << 16) + (frame->data[3] << 24));
+    set_pack_balance_status((frame->data[5] << 8) + frame->data[4]);
+    decode_voltages(frame, moduleId, route);
+}
+
+// Message type 1 carries no data, it only shows the module is still there
+void BatteryPack::decode_heartbeat(can_frame *frame, int moduleId, const PackRoute* route) {
+    modules[moduleId].heartbeat();
+}
+
+// Extract voltage readings from CAN message and update stored values. The
+// route says which cells the frame carries.
+void BatteryPack::decode_voltages(can_frame *frame, int moduleId, const PackRoute* route) {
+    if ( get_pack_balance_status() == 0 ) {
+        uint16_t readings[CELLS_PER_VOLTAGE_FRAME];
+        for ( int c = 0; c < route->numCells; c++ ) {
+            readings[c] = frame->data[c * 2] + (frame->data[c * 2 + 1] & 0x3F) * 256;
+            set_cell_voltage(moduleId, route->firstCell + c, readings[c]);
+        }
+        if ( route->numCells > 0 ) {
+            stats->update(id, moduleId, route->firstCell, readings, route->numCells, monotonic_now());
+        }
+    }
+
+    // Check if this update has left us with a complete set of voltage/temperature readings
+    if ( !modules[moduleId].all_module_data_populated() ) {
+        modules[moduleId].check_if_module_data_is_populated();
+        dirtyModules |= 1u << moduleId;
+        voltagesDirty = true;
+    }
+
+    modules[moduleId].heartbeat();
 }
 
 
@@ -481,7 +673,7 @@ void BatteryPack::process_voltage_update() {
 
 // Return true if any cell in the pack is over max temperature
 bool BatteryPack::has_temperature_sensor_over_max() {
-    for ( int m = 0; m < numModules; m++ ) {
+    for ( int m = 0; m < MODULES_PER_PACK; m++ ) {
         if ( modules[m].has_temperature_sensor_over_max() ) {
             return true;
         }
@@ -492,7 +684,7 @@ bool BatteryPack::has_temperature_sensor_over_max() {
 // return the temperature of the lowest sensor in the pack
 int8_t BatteryPack::get_lowest_temperature() {
     int8_t lowestModuleTemperature = 126;
-    for ( int m = 0; m < numModules; m++ ) {
+    for ( int m = 0; m < MODULES_PER_PACK; m++ ) {
         if ( ! modules[m].all_module_data_populated() ) {
             continue;
         }
@@ -506,7 +698,7 @@ int8_t BatteryPack::get_lowest_temperature() {
 // return the temperature of the highest sensor in the pack
 int8_t BatteryPack::get_highest_temperature() {
     int8_t highestModuleTemperature = -126;
-    for ( int m = 0; m < numModules; m++ ) {
+    for ( int m = 0; m < MODULES_PER_PACK; m++ ) {
         if ( ! modules[m].all_module_data_populated() ) {
             continue;
         }
@@ -518,18 +710,17 @@ int8_t BatteryPack::get_highest_temperature() {
 }
 
 // Extract temperature sensor readings from CAN frame and update stored values
-void BatteryPack::decode_temperatures(can_frame *temperatureMessageFrame) {
-    int moduleId = (temperatureMessageFrame->can_id & 0x00F);
+void BatteryPack::decode_temperatures(can_frame *temperatureMessageFrame, int moduleId, const PackRoute* route) {
     modules[moduleId].heartbeat();
-    for ( int t = 0; t < numTemperatureSensorsPerModule; t++ ) {
-        float temperature = temperatureMessageFrame->data[t] - 40;
+    for ( int t = 0; t < TEMPS_PER_MODULE; t++ ) {
+        int8_t temperature = temperatureMessageFrame->data[t] - 40;
         modules[moduleId].update_temperature(t, temperature);
     }
 }
 
 void BatteryPack::process_temperature_update() {
-    if ( ( get_clock() - lastTemperatureSampleTime ) > PACK_TEMP_SAMPLE_INTERVAL ) {
-        lastTemperatureSampleTime = get_clock();
+    if ( elapsed_since(lastTemperatureSampleTime) > seconds(PACK_TEMP_SAMPLE_INTERVAL) ) {
+        lastTemperatureSampleTime = monotonic_now();
         temperatureDelta = get_highest_temperature() - lastTemperatureSample;
         lastTemperatureSample = get_highest_temperature();
     }
@@ -604,8 +795,8 @@ int16_t BatteryPack::get_max_charge_current_by_temperature() {
             if ( (temperatureDelta - CHARGE_TEMPERATURE_DERATING_THRESHOLD) >= 10 ) {
                 return 0;
             } else {
-                float derateScaleFactor = (10 - temperatureDelta - CHARGE_TEMPERATURE_DERATING_THRESHOLD) / 100;
-                return chargeCurrentMax[static_cast<int>(get_highest_temperature() + 10)] * derateScaleFactor;
+                q16_t derateScaleFactor = q16_from_ratio(10 - (temperatureDelta - CHARGE_TEMPERATURE_DERATING_THRESHOLD), 10);
+                return q16_scale(chargeCurrentMax[static_cast<int>(get_highest_temperature() + 10)], derateScaleFactor);
             }
         }
     }
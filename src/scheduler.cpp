@@ -0,0 +1,235 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "include/scheduler.h"
+
+
+void Scheduler::initialise(const char* _name) {
+    name = _name;
+    numTasks = 0;
+    critical_section_init(&lock);
+    posted = 0;
+    currentTask = -1;
+    currentSection = NULL;
+    busyTimeUs = 0;
+    lastPrintBusyUs = 0;
+    lastPrintTimeUs = time_us_64();
+}
+
+// Safe to call from the other core, the figures are taken under lock
+void Scheduler::print() {
+    uint64_t nowUs = time_us_64();
+    critical_section_enter_blocking(&lock);
+    uint64_t busyUs = busyTimeUs;
+    critical_section_exit(&lock);
+    uint32_t load = nowUs > lastPrintTimeUs ? ( busyUs - lastPrintBusyUs ) * 100 / ( nowUs - lastPrintTimeUs ) : 0;
+    lastPrintBusyUs = busyUs;
+    lastPrintTimeUs = nowUs;
+
+    printf("[%s] %d tasks, load:%lu%%\n", name, numTasks, load);
+    TaskStats stats;
+    for ( int t = 0; t < numTasks; t++ ) {
+        get_stats(t, &stats);
+        printf("[%s] %-18s pri:%u period:%lums runs:%lu overruns:%lu exec(mean/max):%lu/%luus "
+            "jitter(mean/max):%lu/%luus\n", name, stats.name, stats.priority, stats.periodMs, stats.runCount,
+            stats.overrunCount, stats.meanExecUs, stats.maxExecUs, stats.meanJitterUs, stats.maxJitterUs);
+    }
+}
+
+/*
+ * Add a task. It's released every period, starting phase after run() starts,
+ * and must be finished within deadline of each release. A period of zero means
+ * the task only runs when posted. Returns the task's id, for post(), or -1 if
+ * the table is full.
+ */
+int Scheduler::add(const char* taskName, TaskCallback callback, TaskPriority priority, Duration period,
+        Duration deadline, Duration phase) {
+    if ( numTasks >= MAX_TASKS ) {
+        printf("[%s] ERROR no room for task %s\n", name, taskName);
+        return -1;
+    }
+    Task* task = &tasks[numTasks];
+    task->name = taskName;
+    task->callback = callback;
+    task->priority = priority;
+    task->period = period;
+    task->phase = phase;
+    task->deadline = deadline;
+    task->release = monotonic_now() + phase;
+    task->postedTime = Timestamp();
+    task->runCount = 0;
+    task->overrunCount = 0;
+    task->maxExecUs = 0;
+    task->totalExecUs = 0;
+    task->maxJitterUs = 0;
+    task->totalJitterUs = 0;
+    return numTasks++;
+}
+
+// Ask for a task to be run as soon as nothing more urgent is ready. Safe to
+// call from an interrupt or the other core. Posting a task that's already
+// waiting to run doesn't run it twice.
+void Scheduler::post(int task) {
+    if ( task < 0 || task >= numTasks ) {
+        return;
+    }
+    critical_section_enter_blocking(&lock);
+    uint32_t bit = 1u << task;
+    if ( !( posted & bit ) ) {
+        tasks[task].postedTime = monotonic_now();
+        posted |= bit;
+    }
+    critical_section_exit(&lock);
+}
+
+// Run the most urgent ready task, if there is one
+bool Scheduler::run_once() {
+    critical_section_enter_blocking(&lock);
+    uint32_t ready = posted;
+    critical_section_exit(&lock);
+    Timestamp now = monotonic_now();
+
+    int task = next_ready(now, ready);
+    if ( task < 0 ) {
+        return false;
+    }
+    if ( ready & ( 1u << task ) ) {
+        // Cleared before running, so a post made while it runs isn't lost
+        critical_section_enter_blocking(&lock);
+        posted &= ~( 1u << task );
+        critical_section_exit(&lock);
+    }
+    run_task(task, now);
+    return true;
+}
+
+void Scheduler::run() {
+    Timestamp start = monotonic_now();
+    for ( int t = 0; t < numTasks; t++ ) {
+        tasks[t].release = start + tasks[t].phase;
+    }
+    printf("[%s] running %d tasks on core %d\n", name, numTasks, get_core_num());
+    while ( true ) {
+        if ( !run_once() ) {
+            tight_loop_contents();
+        }
+    }
+}
+
+/*
+ * Mark the running task as being inside some shared piece of work, e.g. the
+ * state machine, so that the supervisor can name that rather than whichever
+ * task called it. Returns what to hand back to leave_section().
+ */
+const char* Scheduler::enter_section(const char* section) {
+    const char* previous = currentSection;
+    currentSection = section;
+    return previous;
+}
+
+// What this core is doing now, for the supervisor. NULL when idle.
+const char* Scheduler::get_current_activity() {
+    int task = currentTask;
+    if ( task < 0 ) {
+        return NULL;
+    }
+    const char* section = currentSection;
+    return section != NULL ? section : tasks[task].name;
+}
+
+bool Scheduler::get_stats(int task, TaskStats* stats) {
+    if ( task < 0 || task >= numTasks ) {
+        return false;
+    }
+    Task* t = &tasks[task];
+    stats->name = t->name;
+    stats->priority = t->priority;
+    stats->periodMs = t->period.as_ms();
+    // One consistent set, even while the task is being run on the other core
+    critical_section_enter_blocking(&lock);
+    stats->runCount = t->runCount;
+    stats->overrunCount = t->overrunCount;
+    stats->meanExecUs = t->runCount > 0 ? t->totalExecUs / t->runCount : 0;
+    stats->maxExecUs = t->maxExecUs;
+    stats->meanJitterUs = t->runCount > 0 ? t->totalJitterUs / t->runCount : 0;
+    stats->maxJitterUs = t->maxJitterUs;
+    critical_section_exit(&lock);
+    return true;
+}
+
+// Highest priority task that is due or posted. Ties go to whichever was
+// released first.
+int Scheduler::next_ready(Timestamp now, uint32_t ready) {
+    int best = -1;
+    Timestamp bestRelease;
+    for ( int t = 0; t < numTasks; t++ ) {
+        Task* task = &tasks[t];
+        bool due = task->period > Duration() && !( now < task->release );
+        if ( !due && !( ready & ( 1u << t ) ) ) {
+            continue;
+        }
+        Timestamp release = due ? task->release : task->postedTime;
+        if ( best < 0 || task->priority > tasks[best].priority ||
+                ( task->priority == tasks[best].priority && release < bestRelease ) ) {
+            best = t;
+            bestRelease = release;
+        }
+    }
+    return best;
+}
+
+void Scheduler::run_task(int t, Timestamp now) {
+    Task* task = &tasks[t];
+    bool due = task->period > Duration() && !( now < task->release );
+    Timestamp release = due ? task->release : task->postedTime;
+
+    currentTask = t;
+    uint64_t startUs = time_us_64();
+    task->callback();
+    uint32_t execUs = time_us_64() - startUs;
+    currentTask = -1;
+    Timestamp finished = monotonic_now();
+
+    uint32_t jitterUs = ( now - release ).as_us();
+    critical_section_enter_blocking(&lock);
+    task->runCount++;
+    task->totalExecUs += execUs;
+    task->totalJitterUs += jitterUs;
+    busyTimeUs += execUs;
+    if ( execUs > task->maxExecUs ) {
+        task->maxExecUs = execUs;
+    }
+    if ( jitterUs > task->maxJitterUs ) {
+        task->maxJitterUs = jitterUs;
+    }
+    if ( finished > release + task->deadline ) {
+        task->overrunCount++;
+    }
+    critical_section_exit(&lock);
+
+    if ( due ) {
+        // Releases missed while the core was busy are skipped rather than run
+        // back to back to catch up
+        int64_t missed = ( finished - task->release ).as_us() / task->period.as_us();
+        task->release = task->release + task->period * ( missed + 1 );
+    }
+}
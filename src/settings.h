@@ -36,6 +36,16 @@
 #define CAN_CLK_PIN     21                          // pin 27
 #define MAIN_CAN_CS     17                          // pin 22
 const int CS_PINS[2] = { 20, 15 };                  // Chip select pins for the CAN controllers for each battery pack.
+#define MAIN_CAN_INT_PIN -1                         // INT line of the main CAN controller, -1 when not wired
+const int CAN_INT_PINS[2] = { -1, -1 };             // INT lines of the CAN controllers for each battery pack, -1 when
+                                                    // not wired. Ports without an INT line are drained by polling.
+#define MAIN_CAN_SPI_CLOCK 10000000                 // SPI clock for the main CAN controller, in Hz. MCP2515 max is 10MHz.
+const uint32_t CAN_SPI_CLOCKS[2] = { 10000000, 10000000 }; // SPI clock for the CAN controllers for each battery pack, in Hz.
+const uint32_t SPI_CLOCK_STEPS[5] = { 10000000, 8000000, 4000000, 2000000, 500000 };
+                                                    // If a controller fails the register read-back check at its
+                                                    // clock, try again at the next slower one of these.
+#define SPI_BENCHMARK 0                             // Time frame reads and writes at each of SPI_CLOCK_STEPS at startup
+#define SPI_BENCHMARK_FRAMES 100                    // Frames read and written at each clock by the benchmark
 
 // Inputs
 #define IGNITION_ENABLE_PIN        10               // Ignition on input signal
@@ -57,16 +67,73 @@ const int INHIBIT_CONTACTOR_PINS[2] = { 2, 3 };     // Low-side switch to disall
 #define TEMPS_PER_MODULE  4                         // The number of temperature sensors in each module
 #define MODULES_PER_PACK  6                         // The number of modules in each pack
 
+// Module polling
+#define POLL_INTERVAL_MS 100                        // Every module is polled once per interval
+#define POLL_STAGGERED 1                            // Poll one module at a time across the interval (value = 1), or
+                                                    // all modules at once as a batch (value = 0)
+#define MODULE_RESPONSE_FRAMES 8                    // Frames a module sends back for each poll : status, six voltage
+                                                    // frames and temperatures
+#define POLL_SLOT_MIN_US 2000                       // Shortest time to wait for a module to answer before polling the
+                                                    // next one anyway
+
+// Cell statistics
+#define CELL_STATS_EWMA_SHIFT 4                     // Mean, variance and rate of change follow each new reading by
+                                                    // 1/2^CELL_STATS_EWMA_SHIFT, i.e. 1/16, about 1.6s at 100ms polls
+#define CELL_STATS_RAM_BUDGET 6144                  // Bytes the per-cell statistics may use, checked at compile time
+#define CELL_STATS_QUERY_ID 0x530                   // Main bus request for one cell's statistics, see bms.cpp
+
+// Task scheduler
+#define TASK_STATS_QUERY_ID 0x533                   // Main bus request for one task's run statistics, see bms.cpp
+
+// Main bus telemetry. Each message goes out once per period, phase ms into the period, so that the frames are spread
+// out rather than queued all at once. A period of 0 turns the message off.
+#define TELEMETRY_TICK_MS 5                         // How often the table is checked, so also how finely phases work
+#define LIMITS_MESSAGE_PERIOD_MS 1000               // 0x351
+#define LIMITS_MESSAGE_PHASE_MS 0
+#define BMS_STATE_MESSAGE_PERIOD_MS 1000            // 0x352
+#define BMS_STATE_MESSAGE_PHASE_MS 125
+#define ALARM_MESSAGE_PERIOD_MS 1000                // 0x35A
+#define ALARM_MESSAGE_PHASE_MS 250
+#define SOC_MESSAGE_PERIOD_MS 1000                  // 0x355
+#define SOC_MESSAGE_PHASE_MS 375
+#define STATUS_MESSAGE_PERIOD_MS 1000               // 0x356
+#define STATUS_MESSAGE_PHASE_MS 500
+#define MAIN_CAN_ERRORS_MESSAGE_PERIOD_MS 1000      // 0x354
+#define MAIN_CAN_ERRORS_MESSAGE_PHASE_MS 625
+#define PACK_CAN_ERRORS_MESSAGE_PERIOD_MS 0         // 0x357, not sent
+#define PACK_CAN_ERRORS_MESSAGE_PHASE_MS 750
+#define MODULE_LIVENESS_MESSAGE_PERIOD_MS 5000      // 0x353
+#define MODULE_LIVENESS_MESSAGE_PHASE_MS 875
+#define FAST_TELEMETRY_MIN_INTERVAL_MS 50           // 0x351, 0x352 and 0x35A also go out early when the state, an
+                                                    // inhibit reason or a limit changes, but no closer together than
+                                                    // this
+#define FAST_LIMIT_CHANGE_THRESHOLD 5               // Smallest change in a current limit, in A, that sends 0x351 early
+
 // Timeouts
+#define FAKE_CLOCK 0                                // Take the time from a clock that only moves when told to
+                                                    // (value = 1), for stepping through timing logic off target, or
+                                                    // from the hardware timer (value = 0). See monotime.h.
+
 #define MODULE_TTL 5                                // If we have not seen an update from a module in MODULE_TTL
                                                     // seconds, them mark the module as dead.
 
 #define SHUNT_TTL 3                                 // If we have not seen an update from the ISA shunt in SHUNT_TTL
                                                     // seconds, then mark it as dead.
 
-#define PACKS_IMBALANCED_TTL 3000                   // If the packs are imbalanced for more than PACKS_IMBALANCED_TTL
+#define PACKS_IMBALANCED_TTL 30                     // If the packs are imbalanced for more than PACKS_IMBALANCED_TTL
                                                     // seconds, then actually inhibit the contactors.
 
+#define LIVENESS_TICK_MS 100                        // How often the TTLs above are checked
+
+// Watchdog
+#define WATCHDOG_TIMEOUT_MS 5000                    // Reset if the watchdog hasn't been fed for this long
+#define SUPERVISOR_INTERVAL_MS 100                  // How often the check-ins below are looked at, and the watchdog
+                                                    // fed if they are all in time
+#define RX_CHECK_IN_DEADLINE_MS 1000                // Each pack decoder, and the main bus decoder, must get its port
+                                                    // serviced at least this often
+#define HEALTH_CHECK_IN_DEADLINE_MS 1000            // The health checks must finish at least this often. They send
+                                                    // events, so this also catches a state handler that never returns.
+
 #define SAFE_VOLTAGE_DELTA_BETWEEN_PACKS 10         // When closing contactors, the voltage difference between the packs
                                                     // shall not be greater than this voltage, in millivolts.
 
@@ -95,7 +162,19 @@ const int INHIBIT_CONTACTOR_PINS[2] = { 2, 3 };     // Low-side switch to disall
 
 // Communication
 #define CAN_MUTEX_TIMEOUT_MS 200                    // Timeout for the CAN mutex
-#define SEND_FRAME_RETRIES 6                        // Number of times to retry sending a frame before giving up
-#define READ_FRAME_RETRIES 3                        // Number of times to retry reading a frame before giving up
+#define CAN_TX_QUEUE_SIZE 16                        // Frames each CAN port can hold per transmit priority. Must be a
+                                                    // power of two.
+#define CAN_RX_RING_SIZE 32                         // Frames buffered per CAN port between the controller and the
+                                                    // decoder. Must be a power of two.
+#define CAN_RX_BUDGET_PER_PASS 16                   // Most frames read from a controller in one pass before giving
+                                                    // the SPI bus up to the other ports.
+#define SPI_QUEUE_SIZE 8                            // Transactions that can be waiting for the SPI bus
+#define CAN_ON_CORE1 1                              // Service the CAN ports and decode frames on core 1 (value = 1),
+                                                    // or share core 0 with everything else (value = 0)
+#define CORE_QUEUE_SIZE 16                          // Items each queue between the cores can hold. Must be a power
+                                                    // of two.
+#define CAN_HW_FILTERS 1                            // Program the acceptance filters in CAN_ACCEPTANCE (value = 1) or
+                                                    // accept every frame (value = 0). Turning them off and comparing
+                                                    // the rx and discarded counters shows what the filters save.
 
 #endif  // BMS_SRC_SETTINGS_H_
@@ -17,9 +17,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <time.h>
 #include "include/shunt.h"
 #include "include/util.h"
+#include "include/timerwheel.h"
 #include "settings.h"
 
 Shunt::Shunt() {
@@ -34,18 +34,20 @@ Shunt::Shunt() {
 }
 
 void Shunt::heartbeat() {
-    lastHeartbeat = get_clock();
+    extern TimerWheel timerWheel;
+    timerWheel.heartbeat(LIVENESS_SHUNT);
 }
 
 bool Shunt::is_dead() {
-    return !( ((double)(get_clock() - lastHeartbeat) / CLOCKS_PER_SEC) < SHUNT_TTL );
+    extern TimerWheel timerWheel;
+    return !timerWheel.is_alive(LIVENESS_SHUNT);
 }
 
-int32_t Shunt::get_amps() {
+milliamps_t Shunt::get_amps() {
     return amps;
 }
 
-void Shunt::set_amps(int32_t _amps) {
+void Shunt::set_amps(milliamps_t _amps) {
     amps = _amps;
 }
 
@@ -73,11 +75,11 @@ void Shunt::set_voltage3(int32_t _voltage3) {
     voltage3 = _voltage3;
 }
 
-int32_t Shunt::get_temperature() {
+decidegrees_t Shunt::get_temperature() {
     return temperature;
 }
 
-void Shunt::set_temperature(int32_t _temperature) {
+void Shunt::set_temperature(decidegrees_t _temperature) {
     temperature = _temperature;
 }
 
@@ -0,0 +1,208 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "include/spibus.h"
+
+
+// The RX channel finishing means the last byte has been clocked in
+void spi_dma_irq_handler() {
+    extern SpiBus spiBus;
+    spiBus.poll();
+}
+
+SpiBus::SpiBus(spi_inst_t* _spi, uint8_t misoPin, uint8_t mosiPin, uint8_t clkPin, uint32_t baudrate) {
+    spi = _spi;
+    queueHead = 0;
+    queueTail = 0;
+    current = NULL;
+    currentBaudrate = baudrate;
+    currentStartTime = 0;
+
+    transactionCount = 0;
+    byteCount = 0;
+    queueFullCount = 0;
+    busTimeUs = 0;
+    waitTimeUs = 0;
+
+    spi_init(spi, baudrate);
+    gpio_set_function(misoPin, GPIO_FUNC_SPI);
+    gpio_set_function(mosiPin, GPIO_FUNC_SPI);
+    gpio_set_function(clkPin, GPIO_FUNC_SPI);
+    spi_set_format(spi, 8, SPI_CPOL_0, SPI_CPHA_0, SPI_MSB_FIRST);
+
+    critical_section_init(&lock);
+
+    txChannel = dma_claim_unused_channel(true);
+    rxChannel = dma_claim_unused_channel(true);
+
+    dma_channel_config config = dma_channel_get_default_config(txChannel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+    channel_config_set_dreq(&config, spi_get_dreq(spi, true));
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, false);
+    dma_channel_configure(txChannel, &config, &spi_get_hw(spi)->dr, NULL, 0, false);
+
+    config = dma_channel_get_default_config(rxChannel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+    channel_config_set_dreq(&config, spi_get_dreq(spi, false));
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    dma_channel_configure(rxChannel, &config, NULL, &spi_get_hw(spi)->dr, 0, false);
+
+    dma_channel_set_irq0_enabled(rxChannel, true);
+    irq_set_exclusive_handler(DMA_IRQ_0, spi_dma_irq_handler);
+    irq_set_enabled(DMA_IRQ_0, true);
+}
+
+void SpiBus::print() {
+    critical_section_enter_blocking(&lock);
+    uint64_t busTime = busTimeUs;
+    uint64_t waitTime = waitTimeUs;
+    critical_section_exit(&lock);
+    printf("[spi] transactions:%lu bytes:%lu queueFull:%lu bus:%lluus cpuWait:%lluus\n",
+        transactionCount, byteCount, queueFullCount, busTime, waitTime);
+}
+
+/*
+ * Queue a transaction. Returns false if the queue is full. The callback runs
+ * from the DMA interrupt, or from whoever is waiting in transfer().
+ */
+bool SpiBus::submit(SpiTransaction* transaction) {
+    transaction->done = false;
+
+    critical_section_enter_blocking(&lock);
+    uint8_t next = ( queueHead + 1 ) % SPI_QUEUE_SIZE;
+    if ( next == queueTail ) {
+        queueFullCount++;
+        critical_section_exit(&lock);
+        return false;
+    }
+    queue[queueHead] = transaction;
+    queueHead = next;
+    if ( current == NULL ) {
+        start_next();
+    }
+    critical_section_exit(&lock);
+
+    return true;
+}
+
+/*
+ * Run a transaction and wait for it. We move the queue along ourselves rather
+ * than waiting on the DMA interrupt, which is only enabled on core 0 and may
+ * be masked by the caller. That means the callbacks of other transactions
+ * queued ahead of this one can run here, on whichever core called transfer(),
+ * as well as from the DMA interrupt on core 0.
+ */
+void SpiBus::transfer(uint8_t csPin, uint32_t baudrate, uint8_t* buffer, uint16_t length) {
+    SpiTransaction transaction;
+    transaction.csPin = csPin;
+    transaction.baudrate = baudrate;
+    transaction.buffer = buffer;
+    transaction.length = length;
+    transaction.callback = NULL;
+    transaction.context = NULL;
+
+    uint64_t startTime = time_us_64();
+    while ( !submit(&transaction) ) {
+        poll();
+    }
+    while ( !transaction.done ) {
+        poll();
+    }
+    // Both cores wait in here
+    critical_section_enter_blocking(&lock);
+    waitTimeUs += time_us_64() - startTime;
+    critical_section_exit(&lock);
+}
+
+/*
+ * If the transaction on the bus has finished, release its device and start
+ * the next one. The callback is called outside the lock so that it can queue
+ * another transaction.
+ *
+ * A transaction without a callback belongs to someone waiting in transfer(),
+ * maybe on the other core, who may return and drop it from their stack as
+ * soon as done is set. So the callback is read under the lock, and done is
+ * the last thing written to the transaction.
+ */
+void SpiBus::poll() {
+    critical_section_enter_blocking(&lock);
+    dma_channel_acknowledge_irq0(rxChannel);
+    SpiTransaction* finished = NULL;
+    void (*callback)(SpiTransaction* transaction) = NULL;
+    if ( current != NULL && !dma_channel_is_busy(rxChannel) ) {
+        finished = finish_current();
+        callback = finished->callback;
+        start_next();
+    }
+    critical_section_exit(&lock);
+
+    if ( finished != NULL ) {
+        __dmb();
+        finished->done = true;
+        if ( callback != NULL ) {
+            callback(finished);
+        }
+    }
+}
+
+// Lower CS and hand the next transaction in the queue to DMA. Lock must be held.
+void SpiBus::start_next() {
+    if ( queueTail == queueHead ) {
+        return;
+    }
+    current = queue[queueTail];
+    queueTail = ( queueTail + 1 ) % SPI_QUEUE_SIZE;
+    currentStartTime = time_us_64();
+
+    // The controllers don't all have to run at the same rate
+    if ( current->baudrate != currentBaudrate ) {
+        spi_set_baudrate(spi, current->baudrate);
+        currentBaudrate = current->baudrate;
+    }
+
+    gpio_put(current->csPin, 0);
+    dma_channel_set_read_addr(txChannel, current->buffer, false);
+    dma_channel_set_trans_count(txChannel, current->length, false);
+    dma_channel_set_write_addr(rxChannel, current->buffer, false);
+    dma_channel_set_trans_count(rxChannel, current->length, false);
+    dma_start_channel_mask((1u << txChannel) | (1u << rxChannel));
+}
+
+// Raise CS on the transaction that just completed. Lock must be held.
+SpiTransaction* SpiBus::finish_current() {
+    SpiTransaction* finished = current;
+    while ( spi_is_busy(spi) ) {
+        tight_loop_contents();
+    }
+    gpio_put(finished->csPin, 1);
+    current = NULL;
+
+    transactionCount++;
+    byteCount += finished->length;
+    busTimeUs += time_us_64() - currentStartTime;
+
+    return finished;
+}
@@ -0,0 +1,171 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/watchdog.h"
+#include "include/supervisor.h"
+#include "include/scheduler.h"
+#include "include/cancore.h"
+
+
+struct repeating_timer supervisorTimer;
+
+// Runs from the timer interrupt on core 0, so it carries on when a task on
+// either scheduler never returns
+bool supervise_watchdog(struct repeating_timer *t) {
+    extern Supervisor supervisor;
+    supervisor.supervise();
+    return true;
+}
+
+void Supervisor::initialise() {
+    extern Scheduler scheduler;
+    critical_section_init(&lock);
+    for ( int p = 0; p < NUM_PACKS; p++ ) {
+        snprintf(name[SUPERVISED_PACK_RX(p)], sizeof(name[0]), "pack%d rx", p);
+        deadline[SUPERVISED_PACK_RX(p)] = milliseconds(RX_CHECK_IN_DEADLINE_MS);
+        runsOn[SUPERVISED_PACK_RX(p)] = get_can_scheduler();
+    }
+    strcpy(name[SUPERVISED_MAIN_RX], "main rx");
+    deadline[SUPERVISED_MAIN_RX] = milliseconds(RX_CHECK_IN_DEADLINE_MS);
+    runsOn[SUPERVISED_MAIN_RX] = get_can_scheduler();
+    strcpy(name[SUPERVISED_HEALTH_CHECKS], "health check");
+    deadline[SUPERVISED_HEALTH_CHECKS] = milliseconds(HEALTH_CHECK_IN_DEADLINE_MS);
+    runsOn[SUPERVISED_HEALTH_CHECKS] = &scheduler;
+    for ( int t = 0; t < NUM_SUPERVISED_TASKS; t++ ) {
+        lastCheckIn[t] = Timestamp();
+        longestGap[t] = Duration();
+    }
+    failedTask = -1;
+    blamedTask[0] = '\0';
+    failedLateBy = Duration();
+    feedCount = 0;
+
+    // Pick up the name left behind by the last reset, then clear it so that a
+    // reset for some other reason isn't blamed on the same task
+    resetTask[0] = '\0';
+    if ( watchdog_hw->scratch[0] == SUPERVISOR_SCRATCH_MAGIC ) {
+        for ( int i = 0; i < SUPERVISOR_NAME_LENGTH; i++ ) {
+            resetTask[i] = ( watchdog_hw->scratch[1 + i / 4] >> ( 8 * ( i % 4 ) ) ) & 0xFF;
+        }
+        resetTask[SUPERVISOR_NAME_LENGTH] = '\0';
+    }
+    watchdog_hw->scratch[0] = 0;
+}
+
+/*
+ * Start the clock on every supervised task and hand the watchdog over to
+ * supervise(). Called once everything is set up, as bringing the CAN ports up
+ * can take longer than the watchdog timeout. supervise() runs from a repeating
+ * timer rather than as a task, so a task that never returns can't stop it.
+ */
+void Supervisor::start() {
+    Timestamp now = monotonic_now();
+    critical_section_enter_blocking(&lock);
+    for ( int t = 0; t < NUM_SUPERVISED_TASKS; t++ ) {
+        lastCheckIn[t] = now;
+    }
+    critical_section_exit(&lock);
+
+    add_repeating_timer_ms(SUPERVISOR_INTERVAL_MS, supervise_watchdog, NULL, &supervisorTimer);
+    watchdog_enable(WATCHDOG_TIMEOUT_MS, 1);
+}
+
+void Supervisor::print() {
+    printf("[supervisor] fed:%lu last reset:%s", feedCount, resetTask[0] != '\0' ? resetTask : "-");
+    for ( int t = 0; t < NUM_SUPERVISED_TASKS; t++ ) {
+        printf(" %s:%lu/%lums", name[t], (uint32_t)longestGap[t].as_ms(), (uint32_t)deadline[t].as_ms());
+    }
+    printf("\n");
+    if ( failedTask >= 0 ) {
+        printf("[supervisor] %s was %lums past its deadline while %s was running, waiting for the watchdog\n",
+            name[failedTask], (uint32_t)failedLateBy.as_ms(), blamedTask);
+    }
+}
+
+// Called by a supervised task each time it gets its work done
+void Supervisor::check_in(int task) {
+    Timestamp now = monotonic_now();
+    critical_section_enter_blocking(&lock);
+    if ( lastCheckIn[task].is_set() ) {
+        Duration gap = now - lastCheckIn[task];
+        if ( gap > longestGap[task] ) {
+            longestGap[task] = gap;
+        }
+    }
+    lastCheckIn[task] = now;
+    critical_section_exit(&lock);
+}
+
+// Feed the watchdog, unless a supervised task has stopped checking in. Called
+// from the timer interrupt.
+void Supervisor::supervise() {
+    if ( failedTask < 0 ) {
+        Timestamp now = monotonic_now();
+        int late = -1;
+        Duration lateBy;
+        critical_section_enter_blocking(&lock);
+        for ( int t = 0; t < NUM_SUPERVISED_TASKS; t++ ) {
+            Duration gap = now - lastCheckIn[t];
+            if ( gap > deadline[t] ) {
+                late = t;
+                lateBy = gap - deadline[t];
+                break;
+            }
+        }
+        critical_section_exit(&lock);
+        if ( late >= 0 ) {
+            record_failure(late, lateBy);
+        }
+    }
+    if ( failedTask < 0 ) {
+        watchdog_update();
+        feedCount++;
+    }
+}
+
+/*
+ * Stop feeding the watchdog, and leave a name in the scratch registers. If a
+ * task is running on the scheduler the late check-in belongs to, it's the one
+ * that hasn't given the core back, so it's named rather than the check-in, or
+ * the section of it that it's in, e.g. the state machine.
+ * No printf here, as this runs in an interrupt and the task it interrupted may
+ * be holding stdio.
+ */
+void Supervisor::record_failure(int task, Duration lateBy) {
+    const char* blame = runsOn[task]->get_current_activity();
+    if ( blame == NULL ) {
+        blame = name[task];
+    }
+    strncpy(blamedTask, blame, SUPERVISOR_NAME_LENGTH);
+    blamedTask[SUPERVISOR_NAME_LENGTH] = '\0';
+    failedLateBy = lateBy;
+    failedTask = task;
+
+    uint32_t words[3] = { 0, 0, 0 };
+    for ( int i = 0; i < SUPERVISOR_NAME_LENGTH && blamedTask[i] != '\0'; i++ ) {
+        words[i / 4] |= (uint32_t)(uint8_t)blamedTask[i] << ( 8 * ( i % 4 ) );
+    }
+    for ( int w = 0; w < 3; w++ ) {
+        watchdog_hw->scratch[1 + w] = words[w];
+    }
+    watchdog_hw->scratch[0] = SUPERVISOR_SCRATCH_MAGIC;
+}
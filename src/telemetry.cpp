@@ -0,0 +1,230 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "include/telemetry.h"
+#include "include/bms.h"
+#include "include/scheduler.h"
+
+
+// Periods and phases are in settings.h
+const TelemetryMessage TELEMETRY_MESSAGES[NUM_TELEMETRY_MESSAGES] = {
+    { "limits",          build_limits_message,               false, CAN_TX_CONTROL,
+        LIMITS_MESSAGE_PERIOD_MS, LIMITS_MESSAGE_PHASE_MS },
+    { "bms state",       build_bms_state_message,            true,  CAN_TX_CONTROL,
+        BMS_STATE_MESSAGE_PERIOD_MS, BMS_STATE_MESSAGE_PHASE_MS },
+    { "alarms",          build_alarm_message,                false, CAN_TX_ALARM,
+        ALARM_MESSAGE_PERIOD_MS, ALARM_MESSAGE_PHASE_MS },
+    { "soc",             build_soc_message,                  false, CAN_TX_TELEMETRY,
+        SOC_MESSAGE_PERIOD_MS, SOC_MESSAGE_PHASE_MS },
+    { "status",          build_status_message,               false, CAN_TX_TELEMETRY,
+        STATUS_MESSAGE_PERIOD_MS, STATUS_MESSAGE_PHASE_MS },
+    { "main can errors", build_main_can_error_counters_message, false, CAN_TX_TELEMETRY,
+        MAIN_CAN_ERRORS_MESSAGE_PERIOD_MS, MAIN_CAN_ERRORS_MESSAGE_PHASE_MS },
+    { "pack can errors", build_pack_can_error_counters_message, false, CAN_TX_TELEMETRY,
+        PACK_CAN_ERRORS_MESSAGE_PERIOD_MS, PACK_CAN_ERRORS_MESSAGE_PHASE_MS },
+    { "module liveness", build_module_liveness_message,      true,  CAN_TX_TELEMETRY,
+        MODULE_LIVENESS_MESSAGE_PERIOD_MS, MODULE_LIVENESS_MESSAGE_PHASE_MS },
+};
+
+void send_telemetry() {
+    extern Telemetry telemetry;
+    telemetry.tick();
+}
+
+// Called by the main port for every frame the controller reports sent. Only
+// early sends are tagged.
+void handle_main_frame_sent(uint32_t canId, uint32_t tag, Timestamp sentTime) {
+    extern Telemetry telemetry;
+    if ( tag != 0 ) {
+        telemetry.frame_sent(tag, sentTime);
+    }
+}
+
+void Telemetry::initialise() {
+    started = false;
+    fastPending = 0;
+    critical_section_init(&lock);
+    nextTag = 1;
+    for ( int m = 0; m < NUM_TELEMETRY_MESSAGES; m++ ) {
+        nextSend[m] = Timestamp();
+        lastSendTime[m] = Timestamp();
+        fastRequestTime[m] = Timestamp();
+        fastSendCount[m] = 0;
+        fastFoldedCount[m] = 0;
+        awaitingSent[m] = false;
+        awaitingTag[m] = 0;
+        awaitingChangeTime[m] = Timestamp();
+        fastLatencyMaxUs[m] = 0;
+        fastLatencyTotalUs[m] = 0;
+        fastLatencyCount[m] = 0;
+        sentCount[m] = 0;
+        dropCount[m] = 0;
+        bitCount[m] = 0;
+        lastPrintBitCount[m] = 0;
+    }
+    lastPrintTime = monotonic_now();
+
+    extern Scheduler scheduler;
+    task = scheduler.add("telemetry", send_telemetry, TASK_CONTROL, milliseconds(TELEMETRY_TICK_MS),
+        milliseconds(TELEMETRY_TICK_MS));
+}
+
+void Telemetry::print() {
+    extern Bms bms;
+    Timestamp now = monotonic_now();
+    uint64_t elapsedUs = ( now - lastPrintTime ).as_us();
+    lastPrintTime = now;
+
+    // Share of the bus in hundredths of a percent
+    uint64_t totalBits = 0;
+    uint32_t load[NUM_TELEMETRY_MESSAGES];
+    for ( int m = 0; m < NUM_TELEMETRY_MESSAGES; m++ ) {
+        uint64_t bits = bitCount[m] - lastPrintBitCount[m];
+        lastPrintBitCount[m] = bitCount[m];
+        totalBits += bits;
+        load[m] = elapsedUs > 0 ? bits * 10000 * 1000000 / ( elapsedUs * MAIN_CAN_BITS_PER_SECOND ) : 0;
+    }
+    uint32_t totalLoad = elapsedUs > 0 ? totalBits * 10000 * 1000000 / ( elapsedUs * MAIN_CAN_BITS_PER_SECOND ) : 0;
+
+    printf("[telemetry] bus load:%lu.%02lu%% tx queue max:%u core queue max:%u\n", totalLoad / 100,
+        totalLoad % 100, bms.get_tx_max_depth(), bms.get_tx_request_max_depth());
+    for ( int m = 0; m < NUM_TELEMETRY_MESSAGES; m++ ) {
+        const TelemetryMessage* message = &TELEMETRY_MESSAGES[m];
+        critical_section_enter_blocking(&lock);
+        uint32_t meanLatency = fastLatencyCount[m] > 0 ? fastLatencyTotalUs[m] / fastLatencyCount[m] : 0;
+        uint32_t maxLatency = fastLatencyMaxUs[m];
+        critical_section_exit(&lock);
+        printf("[telemetry] %-16s period:%lums phase:%lums sent:%lu dropped:%lu load:%lu.%02lu%% early:%lu "
+            "folded:%lu change to bus(mean/max):%lu/%luus\n", message->name, message->periodMs, message->phaseMs,
+            sentCount[m], dropCount[m], load[m] / 100, load[m] % 100, fastSendCount[m], fastFoldedCount[m],
+            meanLatency, maxLatency);
+    }
+}
+
+// Send whatever has come due. Phases are counted from the first tick, so the
+// time spent starting up doesn't make everything due at once.
+void Telemetry::tick() {
+    Timestamp now = monotonic_now();
+    if ( !started ) {
+        for ( int m = 0; m < NUM_TELEMETRY_MESSAGES; m++ ) {
+            nextSend[m] = now + milliseconds(TELEMETRY_MESSAGES[m].phaseMs);
+        }
+        started = true;
+    }
+
+    // Early sends first, as long as the message hasn't gone out too recently
+    uint32_t sentEarly = 0;
+    for ( int m = 0; m < NUM_TELEMETRY_MESSAGES; m++ ) {
+        if ( !( fastPending & ( 1u << m ) ) ) {
+            continue;
+        }
+        if ( lastSendTime[m].is_set() && now < lastSendTime[m] + milliseconds(FAST_TELEMETRY_MIN_INTERVAL_MS) ) {
+            continue;
+        }
+        fastPending &= ~( 1u << m );
+        fastSendCount[m]++;
+        send(m, fastRequestTime[m]);
+        sentEarly |= 1u << m;
+    }
+
+    for ( int m = 0; m < NUM_TELEMETRY_MESSAGES; m++ ) {
+        const TelemetryMessage* message = &TELEMETRY_MESSAGES[m];
+        if ( message->periodMs == 0 || now < nextSend[m] ) {
+            continue;
+        }
+        // An early send this tick stands in for the periodic one
+        if ( !( sentEarly & ( 1u << m ) ) ) {
+            send(m);
+        }
+        // Keep to the phase, skipping any periods that were missed
+        Duration period = milliseconds(message->periodMs);
+        int64_t missed = ( now - nextSend[m] ).as_us() / period.as_us();
+        nextSend[m] = nextSend[m] + period * ( missed + 1 );
+    }
+}
+
+// Build and queue one message. changeTime is set for early sends, so the time
+// to the bus can be measured.
+void Telemetry::send(int m, Timestamp changeTime) {
+    extern Bms bms;
+    const TelemetryMessage* message = &TELEMETRY_MESSAGES[m];
+    can_frame frame;
+    message->build(&frame);
+    uint32_t tag = 0;
+    if ( changeTime.is_set() ) {
+        tag = nextTag;
+        if ( ++nextTag == 0 ) {
+            nextTag = 1;
+        }
+        // Has to be in place before the frame can possibly go out
+        critical_section_enter_blocking(&lock);
+        awaitingTag[m] = tag;
+        awaitingChangeTime[m] = changeTime;
+        awaitingSent[m] = true;
+        critical_section_exit(&lock);
+    }
+    if ( bms.send_frame(&frame, message->doChecksum, message->priority, tag) ) {
+        sentCount[m]++;
+        bitCount[m] += CAN_FRAME_OVERHEAD_BITS + 8 * frame.can_dlc;
+        lastSendTime[m] = monotonic_now();
+    } else {
+        dropCount[m]++;
+        if ( tag != 0 ) {
+            critical_section_enter_blocking(&lock);
+            awaitingSent[m] = false;
+            critical_section_exit(&lock);
+        }
+    }
+}
+
+/*
+ * Ask for a message to be sent as soon as the rate limit allows, because
+ * something it reports has just changed. Core 0 only.
+ */
+void Telemetry::send_soon(int m) {
+    extern Scheduler scheduler;
+    if ( fastPending & ( 1u << m ) ) {
+        fastFoldedCount[m]++;
+        return;
+    }
+    fastPending |= 1u << m;
+    fastRequestTime[m] = monotonic_now();
+    scheduler.post(task);
+}
+
+// The early frame carrying this tag has gone out, which ends its measurement.
+// A tag that no longer matches belongs to an early send that was overtaken.
+void Telemetry::frame_sent(uint32_t tag, Timestamp sentTime) {
+    critical_section_enter_blocking(&lock);
+    for ( int m = 0; m < NUM_TELEMETRY_MESSAGES; m++ ) {
+        if ( !awaitingSent[m] || awaitingTag[m] != tag ) {
+            continue;
+        }
+        uint32_t latency = ( sentTime - awaitingChangeTime[m] ).as_us();
+        if ( latency > fastLatencyMaxUs[m] ) {
+            fastLatencyMaxUs[m] = latency;
+        }
+        fastLatencyTotalUs[m] += latency;
+        fastLatencyCount[m]++;
+        awaitingSent[m] = false;
+    }
+    critical_section_exit(&lock);
+}
@@ -0,0 +1,144 @@
+/*
+ * This file is part of the ev mustang bms project.
+ *
+ * Copyright (C) 2024 Christian Kelly <chrskly@chrskly.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "include/timerwheel.h"
+#include "include/scheduler.h"
+
+
+void advance_timer_wheel() {
+    extern TimerWheel timerWheel;
+    timerWheel.advance();
+}
+
+void TimerWheel::initialise() {
+    critical_section_init(&lock);
+    tick = 0;
+    for ( int s = 0; s < TIMER_WHEEL_SLOTS; s++ ) {
+        slotHead[s] = -1;
+    }
+    for ( int t = 0; t < NUM_LIVENESS_TIMERS; t++ ) {
+        deadline[t] = 0;
+        ttl[t] = 0;
+        next[t] = -1;
+        prev[t] = -1;
+    }
+    alive = 0;
+    expiryHandler = NULL;
+    armCount = 0;
+    expiryCount = 0;
+
+    printf("[wheel][init] %d timers, %d slots of %dms\n", NUM_LIVENESS_TIMERS, TIMER_WHEEL_SLOTS, LIVENESS_TICK_MS);
+    extern Scheduler scheduler;
+    scheduler.add("timer wheel", advance_timer_wheel, TASK_SAFETY, milliseconds(LIVENESS_TICK_MS),
+        milliseconds(LIVENESS_TICK_MS));
+}
+
+void TimerWheel::print() {
+    uint64_t bits = alive;
+    printf("[wheel] tick:%lu heartbeats:%lu expiries:%lu alive:0x%08lx%08lx\n", tick, armCount, expiryCount,
+        (uint32_t)( bits >> 32 ), (uint32_t)bits);
+}
+
+// Start tracking a timer. It counts as alive until ttlTicks pass without a
+// heartbeat.
+void TimerWheel::add(int timer, uint32_t ttlTicks) {
+    critical_section_enter_blocking(&lock);
+    ttl[timer] = ttlTicks;
+    critical_section_exit(&lock);
+    heartbeat(timer);
+}
+
+// Push the timer's deadline out to a full TTL from now
+void TimerWheel::heartbeat(int timer) {
+    critical_section_enter_blocking(&lock);
+    uint64_t bit = 1ull << timer;
+    uint32_t newDeadline = tick + ttl[timer];
+    if ( ( alive & bit ) && deadline[timer] == newDeadline ) {
+        // Already armed this tick, which is most heartbeats
+        critical_section_exit(&lock);
+        return;
+    }
+    if ( alive & bit ) {
+        unlink(timer);
+    }
+    deadline[timer] = newDeadline;
+    link(timer);
+    alive |= bit;
+    armCount++;
+    critical_section_exit(&lock);
+}
+
+/*
+ * Move on one tick and expire whatever is due in the new slot. Timers that are
+ * a full turn or more away share the slot, so only those whose deadline is
+ * this tick go. The handler is called outside the lock.
+ */
+void TimerWheel::advance() {
+    uint64_t expired = 0;
+
+    critical_section_enter_blocking(&lock);
+    tick = tick + 1;
+    int t = slotHead[tick & ( TIMER_WHEEL_SLOTS - 1 )];
+    while ( t >= 0 ) {
+        int following = next[t];
+        if ( deadline[t] == tick ) {
+            unlink(t);
+            alive &= ~( 1ull << t );
+            expired |= 1ull << t;
+            expiryCount++;
+        }
+        t = following;
+    }
+    critical_section_exit(&lock);
+
+    while ( expired != 0 ) {
+        int timer = __builtin_ctzll(expired);
+        expired &= expired - 1;
+        if ( expiryHandler != NULL ) {
+            expiryHandler(timer);
+        }
+    }
+}
+
+// Put the timer at the front of its deadline's slot. Lock must be held.
+void TimerWheel::link(int timer) {
+    int slot = deadline[timer] & ( TIMER_WHEEL_SLOTS - 1 );
+    prev[timer] = -1;
+    next[timer] = slotHead[slot];
+    if ( slotHead[slot] >= 0 ) {
+        prev[slotHead[slot]] = timer;
+    }
+    slotHead[slot] = timer;
+}
+
+// Take the timer out of its slot. Lock must be held.
+void TimerWheel::unlink(int timer) {
+    if ( prev[timer] >= 0 ) {
+        next[prev[timer]] = next[timer];
+    } else {
+        slotHead[deadline[timer] & ( TIMER_WHEEL_SLOTS - 1 )] = next[timer];
+    }
+    if ( next[timer] >= 0 ) {
+        prev[next[timer]] = prev[timer];
+    }
+    next[timer] = -1;
+    prev[timer] = -1;
+}
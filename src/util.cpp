@@ -18,16 +18,16 @@
  */
 
 
-#include <time.h>
 #include <stdio.h>
 #include <pico/stdlib.h>
 
 #include "mcp2515/mcp2515.h"
+#include "include/monotime.h"
 
 
-clock_t get_clock() {
-    return (clock_t) time_us_64() / 10000;
-}
+#if FAKE_CLOCK
+Timestamp fakeClockNow;
+#endif
 
 void zero_frame(can_frame* frame) {
     frame->can_id = 0;